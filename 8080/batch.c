@@ -0,0 +1,908 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "emulator.h"
+#include "opcodes.h"
+
+/*
+ * GCC builds the vector kernels twice, for AVX2 and for the baseline, and
+ * picks one when the program is loaded.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define VECTOR_KERNELS __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_KERNELS
+#endif
+
+batch_t *
+create_batch(size_t count)
+{
+    if (count == 0 || count > UINT32_MAX)
+    {
+        return NULL;
+    }
+
+    batch_t * batch = calloc(1, sizeof(batch_t));
+    if (batch == NULL)
+    {
+        return NULL;
+    }
+
+    batch->count = count;
+    batch->memory = calloc(count, BATCH_LANE_STRIDE);
+    batch->stack_pointer = calloc(count, sizeof(uint16_t));
+    batch->program_counter = calloc(count, sizeof(uint16_t));
+    batch->flag_result = calloc(count, sizeof(uint16_t));
+    batch->flag_aux = calloc(count, 1);
+    batch->flags_lazy = calloc(count, 1);
+    batch->flags = calloc(count, 1);
+    batch->interrupt_enabled = calloc(count, 1);
+    batch->halted = calloc(count, 1);
+    batch->cycles = calloc(count, sizeof(uint64_t));
+    batch->deadline = calloc(count, sizeof(uint64_t));
+    batch->opcode = calloc(count, sizeof(uint16_t));
+    batch->operand[0] = calloc(count, 1);
+    batch->operand[1] = calloc(count, 1);
+
+    int failed = batch->memory == NULL || batch->stack_pointer == NULL ||
+                 batch->program_counter == NULL || batch->flag_result == NULL ||
+                 batch->flag_aux == NULL || batch->flags_lazy == NULL ||
+                 batch->flags == NULL || batch->interrupt_enabled == NULL ||
+                 batch->halted == NULL || batch->cycles == NULL ||
+                 batch->deadline == NULL || batch->opcode == NULL ||
+                 batch->operand[0] == NULL || batch->operand[1] == NULL;
+
+    for (int r = 0; r < 8; r++)
+    {
+        if (r != M)
+        {
+            batch->registers[r] = calloc(count, 1);
+            failed |= batch->registers[r] == NULL;
+        }
+    }
+
+    if (failed)
+    {
+        free_batch(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+void
+free_batch(batch_t * batch)
+{
+    if (batch == NULL)
+    {
+        return;
+    }
+
+    for (int r = 0; r < 8; r++)
+    {
+        free(batch->registers[r]);
+    }
+
+    free(batch->memory);
+    free(batch->stack_pointer);
+    free(batch->program_counter);
+    free(batch->flag_result);
+    free(batch->flag_aux);
+    free(batch->flags_lazy);
+    free(batch->flags);
+    free(batch->interrupt_enabled);
+    free(batch->halted);
+    free(batch->cycles);
+    free(batch->deadline);
+    free(batch->opcode);
+    free(batch->operand[0]);
+    free(batch->operand[1]);
+    free(batch);
+}
+
+uint8_t *
+batch_memory(const batch_t * batch, size_t lane)
+{
+    return batch->memory + lane * BATCH_LANE_STRIDE;
+}
+
+/*
+ * Copies a lane out to a cpu_8080_t whose memory is the lane's memory.
+ * Everything else in the cpu is cleared.
+ */
+void
+get_batch_lane(const batch_t * batch, size_t lane, cpu_8080_t * cpu)
+{
+    memset(cpu, 0, sizeof(cpu_8080_t));
+
+    cpu->a = batch->registers[A][lane];
+    cpu->b = batch->registers[B][lane];
+    cpu->c = batch->registers[C][lane];
+    cpu->d = batch->registers[D][lane];
+    cpu->e = batch->registers[E][lane];
+    cpu->h = batch->registers[H][lane];
+    cpu->l = batch->registers[L][lane];
+    cpu->stack_pointer = batch->stack_pointer[lane];
+    cpu->program_counter = batch->program_counter[lane];
+    cpu->memory = batch_memory(batch, lane);
+
+    if (!batch->flags_lazy[lane])
+    {
+        unpack_condition_codes(cpu, batch->flags[lane]);
+    }
+
+    cpu->flag_result = batch->flag_result[lane];
+    cpu->flag_aux = batch->flag_aux[lane];
+    cpu->flags_lazy = batch->flags_lazy[lane];
+
+    cpu->interrupt_enabled = batch->interrupt_enabled[lane];
+    cpu->halted = batch->halted[lane];
+    cpu->cycles = batch->cycles[lane];
+}
+
+// Copies the registers of a cpu into a lane. Memory is left alone.
+void
+set_batch_lane(batch_t * batch, size_t lane, const cpu_8080_t * cpu)
+{
+    batch->registers[A][lane] = cpu->a;
+    batch->registers[B][lane] = cpu->b;
+    batch->registers[C][lane] = cpu->c;
+    batch->registers[D][lane] = cpu->d;
+    batch->registers[E][lane] = cpu->e;
+    batch->registers[H][lane] = cpu->h;
+    batch->registers[L][lane] = cpu->l;
+    batch->stack_pointer[lane] = cpu->stack_pointer;
+    batch->program_counter[lane] = cpu->program_counter;
+
+    batch->flag_result[lane] = cpu->flag_result;
+    batch->flag_aux[lane] = cpu->flag_aux;
+    batch->flags_lazy[lane] = cpu->flags_lazy;
+    batch->flags[lane] = pack_condition_codes(cpu);
+
+    batch->interrupt_enabled[lane] = cpu->interrupt_enabled;
+    batch->halted[lane] = cpu->halted;
+    batch->cycles[lane] = cpu->cycles;
+}
+
+/*
+ * Lanes running an opcode that few others are running go through the
+ * interpreter one at a time.
+ */
+
+typedef struct lane_cpu
+{
+    cpu_8080_t cpu; // first, so a cpu_8080_t * can be cast back
+    batch_t * batch;
+    size_t lane;
+} lane_cpu_t;
+
+static uint8_t
+lane_port_in(cpu_8080_t * cpu, uint8_t port)
+{
+    lane_cpu_t * lane = (lane_cpu_t *)cpu;
+    return lane->batch->port_in(lane->batch, lane->lane, port);
+}
+
+static void
+lane_port_out(cpu_8080_t * cpu, uint8_t port, uint8_t value)
+{
+    lane_cpu_t * lane = (lane_cpu_t *)cpu;
+    lane->batch->port_out(lane->batch, lane->lane, port, value);
+}
+
+static void
+step_lane(batch_t * batch, size_t lane)
+{
+    lane_cpu_t scalar;
+
+    get_batch_lane(batch, lane, &scalar.cpu);
+    scalar.batch = batch;
+    scalar.lane = lane;
+    scalar.cpu.port_in = batch->port_in ? lane_port_in : NULL;
+    scalar.cpu.port_out = batch->port_out ? lane_port_out : NULL;
+
+    process_instruction(&scalar.cpu);
+    set_batch_lane(batch, lane, &scalar.cpu);
+}
+
+/*
+ * Vector kernels. Each one runs a single opcode over every lane, writing
+ * only the lanes whose opcode matches. The writes are selects rather than
+ * branches so that the loops vectorize into blends.
+ */
+
+// x where m is 1 and y where it is 0, without a branch.
+#define SELECT(m, x, y) ((y) ^ (((x) ^ (y)) & -(m)))
+
+static inline void
+kernel_advance(batch_t * batch, uint16_t op, uint16_t size)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    uint16_t * program_counter = batch->program_counter;
+    uint64_t * cycles = batch->cycles;
+    uint8_t cost = opcode_table[op].cycles;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        program_counter[n] += SELECT(m, size, 0);
+        cycles[n] += SELECT(m, cost, 0);
+    }
+}
+
+static inline void
+kernel_mov(batch_t * batch, uint16_t op, uint8_t * dst, const uint8_t * src)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        dst[n] = SELECT(m, src[n], dst[n]);
+    }
+}
+
+static inline void
+kernel_lxi(batch_t * batch, uint16_t op, uint8_t * hi, uint8_t * lo)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    const uint8_t * operand_lo = batch->operand[0];
+    const uint8_t * operand_hi = batch->operand[1];
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        hi[n] = SELECT(m, operand_hi[n], hi[n]);
+        lo[n] = SELECT(m, operand_lo[n], lo[n]);
+    }
+}
+
+static inline void
+kernel_lxi_sp(batch_t * batch, uint16_t op)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    const uint8_t * operand_lo = batch->operand[0];
+    const uint8_t * operand_hi = batch->operand[1];
+    uint16_t * stack_pointer = batch->stack_pointer;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        uint16_t value = operand_lo[n] | (operand_hi[n] << 8);
+        stack_pointer[n] = SELECT(m, value, stack_pointer[n]);
+    }
+}
+
+static inline void
+kernel_inx(batch_t * batch, uint16_t op, uint8_t * hi, uint8_t * lo, uint16_t delta)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        uint16_t value = ((hi[n] << 8) | lo[n]) + delta;
+        hi[n] = SELECT(m, value >> 8, hi[n]);
+        lo[n] = SELECT(m, value & 0xFF, lo[n]);
+    }
+}
+
+static inline void
+kernel_inx_sp(batch_t * batch, uint16_t op, uint16_t delta)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    uint16_t * stack_pointer = batch->stack_pointer;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        stack_pointer[n] += SELECT(m, delta, 0);
+    }
+}
+
+// INR and DCR; the carry is left alone.
+static inline void
+kernel_inr(batch_t * batch, uint16_t op, uint8_t * reg, int decrement)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    uint16_t * flag_result = batch->flag_result;
+    uint8_t * flag_aux = batch->flag_aux;
+    uint8_t * flags_lazy = batch->flags_lazy;
+    uint8_t delta = decrement ? 0xFF : 1;
+    uint8_t invert = decrement ? 0xFF : 0;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        uint8_t value = reg[n];
+        uint8_t result = value + delta;
+        uint8_t aux = (value ^ 1 ^ result) ^ invert;
+        flag_result[n] = SELECT(m, result | (flag_result[n] & 0x100), flag_result[n]);
+        flag_aux[n] = SELECT(m, aux, flag_aux[n]);
+        flags_lazy[n] = SELECT(m, 1, flags_lazy[n]);
+        reg[n] = SELECT(m, result, value);
+    }
+}
+
+// Records an ALU result for the matching lanes, as the ALU helpers do.
+#define ALU_KERNEL(RESULT, AUX, WRITES_A) \
+    for (size_t n = 0; n < count; n++) \
+    { \
+        int m = opcode[n] == op; \
+        uint16_t a = accumulator[n]; \
+        uint16_t v = value[n]; \
+        uint16_t carry = (flag_result[n] >> 8) & 1; \
+        uint16_t result = (RESULT) & 0x1FF; \
+        uint8_t aux = (AUX); \
+        (void)carry; \
+        flag_result[n] = SELECT(m, result, flag_result[n]); \
+        flag_aux[n] = SELECT(m, aux, flag_aux[n]); \
+        flags_lazy[n] = SELECT(m, 1, flags_lazy[n]); \
+        if (WRITES_A) \
+        { \
+            accumulator[n] = SELECT(m, result & 0xFF, a); \
+        } \
+    }
+
+// Nothing else points into the restrict arrays, which saves the vectorizer
+// from checking for overlaps at run time. value may be the accumulator.
+static inline void
+alu_lanes(size_t count, const uint16_t * restrict opcode, uint16_t op,
+          uint8_t * accumulator, const uint8_t * value,
+          uint16_t * restrict flag_result, uint8_t * restrict flag_aux,
+          uint8_t * restrict flags_lazy)
+{
+    switch((op >> 3) & 7)
+    {
+        case 0: ALU_KERNEL(a + v, a ^ v ^ result, 1); break;             // ADD
+        case 1: ALU_KERNEL(a + v + carry, a ^ v ^ result, 1); break;     // ADC
+        case 2: ALU_KERNEL(a - v, ~(a ^ v ^ result), 1); break;          // SUB
+        case 3: ALU_KERNEL(a - v - carry, ~(a ^ v ^ result), 1); break;  // SBB
+        case 4: ALU_KERNEL(a & v, (a | v) << 1, 1); break;               // ANA
+        case 5: ALU_KERNEL(a ^ v, 0, 1); break;                          // XRA
+        case 6: ALU_KERNEL(a | v, 0, 1); break;                          // ORA
+        default: ALU_KERNEL(a - v, ~(a ^ v ^ result), 0); break;         // CMP
+    }
+}
+
+static inline void
+kernel_alu(batch_t * batch, uint16_t op, const uint8_t * value)
+{
+    alu_lanes(batch->count, batch->opcode, op, batch->registers[A], value,
+              batch->flag_result, batch->flag_aux, batch->flags_lazy);
+}
+
+static inline void
+kernel_rotate(batch_t * batch, uint16_t op)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    uint8_t * accumulator = batch->registers[A];
+    uint16_t * flag_result = batch->flag_result;
+    int left = op == 0x07 || op == 0x17;    // RLC, RAL
+    int through = op == 0x17 || op == 0x1F; // RAL, RAR
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        uint8_t a = accumulator[n];
+        uint8_t carry = (flag_result[n] >> 8) & 1;
+        uint8_t out = left ? a >> 7 : a & 1;
+        uint8_t in = through ? carry : out;
+        uint8_t result = left ? (a << 1) | in : (a >> 1) | (in << 7);
+
+        flag_result[n] = SELECT(m, (flag_result[n] & 0xFF) | (out << 8), flag_result[n]);
+        accumulator[n] = SELECT(m, result, a);
+    }
+}
+
+static inline void
+kernel_cma(batch_t * batch, uint16_t op)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    uint8_t * accumulator = batch->registers[A];
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        accumulator[n] ^= SELECT(m, 0xFF, 0);
+    }
+}
+
+static inline void
+kernel_carry(batch_t * batch, uint16_t op, int complement)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    uint16_t * flag_result = batch->flag_result;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int m = opcode[n] == op;
+        uint16_t carry = complement ? flag_result[n] ^ 0x100 : (flag_result[n] & 0xFF) | 0x100;
+        flag_result[n] = SELECT(m, carry, flag_result[n]);
+    }
+}
+
+// Jumps to the operand where TAKEN holds; JMP passes 1.
+#define JUMP_KERNEL(TAKEN) \
+    for (size_t n = 0; n < count; n++) \
+    { \
+        int m = opcode[n] == op; \
+        uint16_t fr = flag_result[n]; \
+        uint8_t lazy = flags_lazy[n]; \
+        uint8_t explicit = flags[n]; \
+        uint16_t target = operand_lo[n] | (operand_hi[n] << 8); \
+        uint16_t next = program_counter[n] + 3; \
+        (void)fr; (void)lazy; (void)explicit; \
+        program_counter[n] = SELECT(m, (TAKEN) ? target : next, program_counter[n]); \
+    }
+
+static inline uint8_t
+parity8(uint8_t x)
+{
+    x ^= x >> 4;
+    x ^= x >> 2;
+    x ^= x >> 1;
+    return !(x & 1);
+}
+
+static inline void
+kernel_jump(batch_t * batch, uint16_t op)
+{
+    size_t count = batch->count;
+    const uint16_t * opcode = batch->opcode;
+    const uint16_t * flag_result = batch->flag_result;
+    const uint8_t * flags_lazy = batch->flags_lazy;
+    const uint8_t * flags = batch->flags;
+    const uint8_t * operand_lo = batch->operand[0];
+    const uint8_t * operand_hi = batch->operand[1];
+    uint16_t * program_counter = batch->program_counter;
+    uint8_t want = (op >> 3) & 1;
+
+    if ((op & 7) == 3)
+    {
+        JUMP_KERNEL(1);
+        return;
+    }
+
+    switch((op >> 4) & 3)
+    {
+        case 0: // JNZ, JZ
+            JUMP_KERNEL((lazy ? (fr & 0xFF) == 0 : (explicit >> 6) & 1) == want);
+            break;
+        case 1: // JNC, JC
+            JUMP_KERNEL(((fr >> 8) & 1) == want);
+            break;
+        case 2: // JPO, JPE
+            JUMP_KERNEL((lazy ? parity8(fr) : (explicit >> 2) & 1) == want);
+            break;
+        default: // JP, JM
+            JUMP_KERNEL((lazy ? (fr >> 7) & 1 : explicit >> 7) == want);
+            break;
+    }
+}
+
+/*
+ * Length of an instruction that execute_dense has a kernel for, or 0 for
+ * the opcodes that touch memory, the stack or I/O.
+ */
+static int
+kernel_length(uint8_t op)
+{
+    uint8_t dst = (op >> 3) & 7;
+    uint8_t src = op & 7;
+
+    switch(op & 0xC0)
+    {
+        case 0x40: // MOV, HLT
+            return dst != M && src != M;
+        case 0x80: // ALU register
+            return src != M;
+        case 0xC0: // ALU immediate, Jcc, JMP
+            return src == 6 ? 2 : (src == 2 || op == 0xC3 || op == 0xCB) ? 3 : 0;
+    }
+
+    switch(src)
+    {
+        case 0: // NOP
+            return 1;
+        case 1: // LXI
+            return (op & 0x08) ? 0 : 3;
+        case 3: // INX, DCX
+            return 1;
+        case 4: // INR
+        case 5: // DCR
+            return dst != M;
+        case 6: // MVI
+            return dst != M ? 2 : 0;
+        case 7: // rotates, CMA, STC, CMC
+            return op != 0x27;
+    }
+
+    return 0;
+}
+
+/*
+ * Runs one opcode over the lanes with a vector kernel. Returns 0 for the
+ * opcodes without one, which go lane by lane instead.
+ */
+VECTOR_KERNELS static int
+execute_dense(batch_t * batch, uint16_t op)
+{
+    uint8_t ** reg = batch->registers;
+    uint8_t dst = (op >> 3) & 7;
+    uint8_t src = op & 7;
+    uint8_t pair = (op >> 4) & 3;
+    uint16_t size = kernel_length(op);
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    if ((op & 0xC0) == 0x40) // MOV
+    {
+        kernel_mov(batch, op, reg[dst], reg[src]);
+    }
+    else if ((op & 0xC0) == 0x80) // ALU register
+    {
+        kernel_alu(batch, op, reg[src]);
+    }
+    else if ((op & 0xC7) == 0xC6) // ALU immediate
+    {
+        kernel_alu(batch, op, batch->operand[0]);
+    }
+    else if ((op & 0xC7) == 0xC2 || op == 0xC3 || op == 0xCB) // Jcc, JMP
+    {
+        kernel_jump(batch, op);
+        size = 0; // the kernel sets the program counter
+    }
+    else if ((op & 0x07) == 0x00) // NOP
+    {
+    }
+    else if ((op & 0x0F) == 0x01) // LXI
+    {
+        if (pair == SP)
+        {
+            kernel_lxi_sp(batch, op);
+        }
+        else
+        {
+            kernel_lxi(batch, op, reg[pair * 2], reg[pair * 2 + 1]);
+        }
+    }
+    else if ((op & 0x07) == 0x03) // INX, DCX
+    {
+        uint16_t delta = (op & 0x08) ? 0xFFFF : 1;
+
+        if (pair == SP)
+        {
+            kernel_inx_sp(batch, op, delta);
+        }
+        else
+        {
+            kernel_inx(batch, op, reg[pair * 2], reg[pair * 2 + 1], delta);
+        }
+    }
+    else if ((op & 0x06) == 0x04) // INR, DCR
+    {
+        kernel_inr(batch, op, reg[dst], op & 1);
+    }
+    else if ((op & 0x07) == 0x06) // MVI
+    {
+        kernel_mov(batch, op, reg[dst], batch->operand[0]);
+    }
+    else if (op == 0x07 || op == 0x0F || op == 0x17 || op == 0x1F)
+    {
+        kernel_rotate(batch, op);
+    }
+    else if (op == 0x2F) // CMA
+    {
+        kernel_cma(batch, op);
+    }
+    else // STC, CMC
+    {
+        kernel_carry(batch, op, op == 0x3F);
+    }
+
+    kernel_advance(batch, op, size);
+    return 1;
+}
+
+/*
+ * A view of lanes [first, first + count) of a batch, sharing its arrays.
+ */
+static void
+tile_view(const batch_t * batch, size_t first, size_t count, batch_t * tile)
+{
+    *tile = *batch;
+    tile->count = count;
+
+    for (int r = 0; r < 8; r++)
+    {
+        tile->registers[r] = r == M ? NULL : batch->registers[r] + first;
+    }
+
+    tile->stack_pointer += first;
+    tile->program_counter += first;
+    tile->flag_result += first;
+    tile->flag_aux += first;
+    tile->flags_lazy += first;
+    tile->flags += first;
+    tile->interrupt_enabled += first;
+    tile->halted += first;
+    tile->cycles += first;
+    tile->memory = batch_memory(batch, first);
+    tile->deadline += first;
+    tile->opcode += first;
+    tile->operand[0] += first;
+    tile->operand[1] += first;
+}
+
+/*
+ * Fetches the next instruction of every lane of a tile, marking lanes that
+ * have halted or run out of cycles BATCH_IDLE. Returns the opcode of the
+ * first lane if every lane has the same one, or -1.
+ */
+static int
+fetch_tile(batch_t * tile)
+{
+    size_t count = tile->count;
+    uint16_t * opcode = tile->opcode;
+    uint8_t * operand_lo = tile->operand[0];
+    uint8_t * operand_hi = tile->operand[1];
+
+    for (size_t n = 0; n < count; n++)
+    {
+        const uint8_t * memory = batch_memory(tile, n);
+        uint16_t pc = tile->program_counter[n];
+        uint32_t word;
+
+        // The padding after each lane's memory makes the 4-byte load safe;
+        // only an instruction that wraps past 0xFFFF, or a big-endian host,
+        // needs the slow way.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (pc < 0xFFFE)
+        {
+            memcpy(&word, memory + pc, sizeof(word));
+        }
+        else
+#endif
+        {
+            word = memory[pc] | (memory[(uint16_t)(pc + 1)] << 8) |
+                   (memory[(uint16_t)(pc + 2)] << 16);
+        }
+
+        opcode[n] = word & 0xFF;
+        operand_lo[n] = (word >> 8) & 0xFF;
+        operand_hi[n] = (word >> 16) & 0xFF;
+    }
+
+    const uint8_t * halted = tile->halted;
+    const uint64_t * cycles = tile->cycles;
+    const uint64_t * deadline = tile->deadline;
+    uint16_t lead = halted[0] || cycles[0] >= deadline[0] ? BATCH_IDLE : opcode[0];
+    uint16_t differ = 0;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        int idle = halted[n] | (cycles[n] >= deadline[n]);
+        opcode[n] = SELECT(idle, BATCH_IDLE, opcode[n]);
+        differ |= opcode[n] ^ lead;
+    }
+
+    return differ ? -1 : lead;
+}
+
+/*
+ * When every lane of a tile is at the same address, with the same code
+ * there, the instructions up to the next jump or memory access are decoded
+ * once from the first lane and run kernel after kernel with no fetching in
+ * between. Returns 0 if the tile is not in that state.
+ */
+static int
+run_converged(batch_t * tile)
+{
+    size_t count = tile->count;
+    const uint16_t * program_counter = tile->program_counter;
+    const uint8_t * halted = tile->halted;
+    const uint64_t * cycles = tile->cycles;
+    const uint64_t * deadline = tile->deadline;
+    uint16_t start = program_counter[0];
+    uint16_t differ = 0;
+    uint8_t stopped = 0;
+    uint64_t room = UINT64_MAX;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        uint64_t left = deadline[n] > cycles[n] ? deadline[n] - cycles[n] : 0;
+        differ |= program_counter[n] ^ start;
+        stopped |= halted[n];
+        room = left < room ? left : room;
+    }
+
+    if (differ || stopped || room == 0)
+    {
+        return 0;
+    }
+
+    // An instruction runs while the cycles spent before it are under
+    // budget, as in process_instructions().
+    const uint8_t * code = batch_memory(tile, 0) + start;
+    uint16_t offset[BATCH_RUN_OPS];
+    uint32_t length = 0;
+    uint64_t spent = 0;
+    int ops = 0;
+
+    while (ops < BATCH_RUN_OPS && start + length + 3 <= BATCH_MEMORY_SIZE && spent < room)
+    {
+        uint8_t op = code[length];
+        int size = kernel_length(op);
+
+        if (size == 0)
+        {
+            break;
+        }
+
+        offset[ops++] = length;
+        length += size;
+        spent += opcode_table[op].cycles;
+
+        if ((op & 0xC0) == 0xC0) // Jcc, JMP
+        {
+            break;
+        }
+    }
+
+    if (ops == 0)
+    {
+        return 0;
+    }
+
+    for (size_t n = 1; n < count; n++)
+    {
+        if (memcmp(batch_memory(tile, n) + start, code, length) != 0)
+        {
+            return 0;
+        }
+    }
+
+    uint16_t * opcode = tile->opcode;
+    uint8_t * operand_lo = tile->operand[0];
+    uint8_t * operand_hi = tile->operand[1];
+
+    for (int i = 0; i < ops; i++)
+    {
+        const uint8_t * instruction = code + offset[i];
+
+        for (size_t n = 0; n < count; n++)
+        {
+            opcode[n] = instruction[0];
+            operand_lo[n] = instruction[1];
+            operand_hi[n] = instruction[2];
+        }
+
+        execute_dense(tile, instruction[0]);
+    }
+
+    return 1;
+}
+
+/*
+ * Runs at least one instruction on every lane of a tile that has one to
+ * run. When
+ * the lanes agree on the opcode, which they do until their paths split,
+ * that is one kernel. Otherwise the lanes are counted by opcode: common
+ * opcodes go through the vector kernels and the rest run lane by lane, so
+ * lanes that have wandered apart cost little more than the interpreter.
+ * Returns 0 once every lane is idle.
+ */
+static int
+step_tile(batch_t * batch, batch_t * tile, size_t first)
+{
+    size_t count = tile->count;
+    const uint16_t * opcode = tile->opcode;
+
+    if (run_converged(tile))
+    {
+        return 1;
+    }
+
+    int lead = fetch_tile(tile);
+
+    if (lead >= 0)
+    {
+        if (lead == BATCH_IDLE)
+        {
+            return 0;
+        }
+
+        if (!execute_dense(tile, lead))
+        {
+            for (size_t n = 0; n < count; n++)
+            {
+                step_lane(batch, first + n);
+            }
+        }
+
+        return 1;
+    }
+
+    uint32_t group_size[BATCH_IDLE + 1] = { 0 };
+    uint8_t by_lane[BATCH_IDLE + 1] = { 0 };
+    int any_by_lane = 0;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        group_size[opcode[n]]++;
+    }
+
+    for (int op = 0; op < BATCH_IDLE; op++)
+    {
+        if (group_size[op] == 0)
+        {
+            continue;
+        }
+
+        if ((size_t)group_size[op] * BATCH_DENSITY < count || !execute_dense(tile, op))
+        {
+            by_lane[op] = 1;
+            any_by_lane = 1;
+        }
+    }
+
+    for (size_t n = 0; any_by_lane && n < count; n++)
+    {
+        if (by_lane[opcode[n]])
+        {
+            step_lane(batch, first + n);
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Steps every lane until it halts or has used up the cycle budget. Lanes
+ * are run a tile at a time so that the memory they touch stays in the
+ * caches and TLB. Returns the number of lanes that have not halted.
+ */
+size_t
+run_batch(batch_t * batch, uint64_t cycle_budget)
+{
+    size_t count = batch->count;
+
+    for (size_t n = 0; n < count; n++)
+    {
+        batch->deadline[n] = batch->cycles[n] + cycle_budget;
+    }
+
+    for (size_t first = 0; first < count; first += BATCH_TILE)
+    {
+        batch_t tile;
+        size_t size = count - first < BATCH_TILE ? count - first : BATCH_TILE;
+
+        tile_view(batch, first, size, &tile);
+        while (step_tile(batch, &tile, first))
+        {
+        }
+    }
+
+    size_t running = 0;
+    for (size_t n = 0; n < count; n++)
+    {
+        running += !batch->halted[n];
+    }
+
+    return running;
+}
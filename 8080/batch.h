@@ -0,0 +1,70 @@
+#ifndef BATCH_8080_H_
+#define BATCH_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emulator.h"
+
+#define BATCH_MEMORY_SIZE 0x10000 // bytes of memory per machine
+
+// Lanes are a cache line further apart than their size, so that the same
+// address in every lane does not fall in the same cache set.
+#define BATCH_LANE_STRIDE (BATCH_MEMORY_SIZE + 64)
+
+// Lanes with no instruction to run this step.
+#define BATCH_IDLE 0x100
+
+// Lanes stepped together in lock-step.
+#define BATCH_TILE 256
+
+// Instructions decoded at a time for a tile whose lanes are all at the
+// same address.
+#define BATCH_RUN_OPS 32
+
+// Opcodes run by at least 1/BATCH_DENSITY of the lanes of a tile go through
+// a vector kernel over the tile; rarer ones are run lane by lane.
+#define BATCH_DENSITY 16
+
+/*
+ * Many independent 8080 machines stepped in lock-step. Registers are kept
+ * as one array per register, indexed by lane, so each opcode can be run
+ * over all the lanes at once.
+ */
+typedef struct batch
+{
+    size_t count;
+
+    uint8_t * registers[8];    // B, C, D, E, H, L, unused, A
+    uint16_t * stack_pointer;
+    uint16_t * program_counter;
+
+    // Flags, kept lazily as in cpu_8080_t. flags holds the PUSH PSW byte
+    // for lanes where flags_lazy is clear.
+    uint16_t * flag_result;
+    uint8_t * flag_aux;
+    uint8_t * flags_lazy;
+    uint8_t * flags;
+
+    uint8_t * interrupt_enabled;
+    uint8_t * halted;
+    uint64_t * cycles;
+    uint8_t * memory;          // count * BATCH_LANE_STRIDE bytes
+
+    // Optional I/O port handlers, shared by every lane.
+    uint8_t (*port_in)(struct batch * batch, size_t lane, uint8_t port);
+    void (*port_out)(struct batch * batch, size_t lane, uint8_t port, uint8_t value);
+
+    // Scratch space for each step.
+    uint64_t * deadline;
+    uint16_t * opcode;
+    uint8_t * operand[2];
+} batch_t;
+
+batch_t * create_batch(size_t count);
+void free_batch(batch_t * batch);
+uint8_t * batch_memory(const batch_t * batch, size_t lane);
+void get_batch_lane(const batch_t * batch, size_t lane, cpu_8080_t * cpu);
+void set_batch_lane(batch_t * batch, size_t lane, const cpu_8080_t * cpu);
+size_t run_batch(batch_t * batch, uint64_t cycle_budget);
+
+#endif /* !BATCH_8080_H_ */
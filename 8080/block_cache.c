@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_cache.h"
+#include "jit.h"
+#include "opcodes.h"
+
+/*
+ * Anything that can move the program counter somewhere other than the next
+ * instruction ends a block, as do HLT and EI so that interrupts are looked
+ * at between blocks.
+ */
+static int
+ends_block(uint8_t opcode)
+{
+    switch(opcode)
+    {
+        case 0x76: // HLT
+        case 0xC3: // JMP
+        case 0xCB:
+        case 0xC9: // RET
+        case 0xD9:
+        case 0xCD: // CALL
+        case 0xDD:
+        case 0xED:
+        case 0xFD:
+        case 0xE9: // PCHL
+        case 0xFB: // EI
+            return 1;
+    }
+
+    if ((opcode & 0xC0) == 0xC0)
+    {
+        switch(opcode & 0x07)
+        {
+            case 0x0: // Rcc
+            case 0x2: // Jcc
+            case 0x4: // Ccc
+            case 0x7: // RST
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+block_cache_t *
+create_block_cache(void)
+{
+    return calloc(1, sizeof(block_cache_t));
+}
+
+void
+free_block_cache(block_cache_t * cache)
+{
+    free_jit(cache->jit);
+    free(cache);
+}
+
+/*
+ * Drops every block. Called when the cache fills up and by anyone who
+ * changes memory behind the emulator's back.
+ */
+void
+flush_block_cache(cpu_8080_t * cpu)
+{
+    block_cache_t * cache = cpu->block_cache;
+
+    memset(cache->lookup, 0, sizeof(cache->lookup));
+    memset(cache->code, 0, sizeof(cache->code));
+    cache->block_count = 0;
+    cache->op_count = 0;
+    reset_jit(cache->jit);
+
+    for (int page = 0; page < 256; page++)
+    {
+        cpu->page_flags[page] &= ~PAGE_CODE;
+    }
+}
+
+/*
+ * Throws away native code but keeps the blocks, for when the JIT runs out
+ * of room. Native code for invalidated blocks is only reclaimed this way
+ * or by a flush. Blocks are compiled again once they are hot again.
+ */
+void
+drop_native_code(block_cache_t * cache)
+{
+    for (int i = 0; i < cache->block_count; i++)
+    {
+        cache->blocks[i].native = NULL;
+        cache->blocks[i].hits = 0;
+    }
+
+    reset_jit(cache->jit);
+}
+
+block_t *
+translate_block(cpu_8080_t * cpu, uint16_t address)
+{
+    block_cache_t * cache = cpu->block_cache;
+
+    if (cache->block_count == MAX_BLOCKS ||
+        cache->op_count + MAX_BLOCK_OPS > MAX_CACHED_OPS)
+    {
+        flush_block_cache(cpu);
+    }
+
+    block_t * block = &cache->blocks[cache->block_count++];
+    block->start = address;
+    block->count = 0;
+    block->ops = &cache->ops[cache->op_count];
+    block->hits = 0;
+    block->native = NULL;
+
+    uint16_t pc = address;
+    uint8_t opcode;
+
+    do
+    {
+        micro_op_t * uop = &block->ops[block->count++];
+
+        opcode = cpu->memory[pc];
+        uop->opcode = opcode;
+        uop->address = pc;
+        uop->operand = cpu->memory[(uint16_t)(pc + 1)] |
+                       (cpu->memory[(uint16_t)(pc + 2)] << 8);
+
+        for (int i = 0; i < opcode_table[opcode].size; i++, pc++)
+        {
+            cache->code[pc >> 3] |= 1 << (pc & 7);
+            cpu->page_flags[pc >> 8] |= PAGE_CODE;
+        }
+    } while (!ends_block(opcode) && block->count < MAX_BLOCK_OPS);
+
+    block->size = pc - address;
+    cache->op_count += block->count;
+    cache->lookup[address] = block;
+
+    return block;
+}
+
+// Turns a block's micro-ops into exits and takes it out of the lookup.
+static void
+drop_block(block_cache_t * cache, block_t * block)
+{
+    for (int i = 0; i < block->count; i++)
+    {
+        block->ops[i].opcode = BLOCK_EXIT;
+    }
+
+    cache->lookup[block->start] = NULL;
+}
+
+/*
+ * Called for stores to pages holding cached code. Drops every block that
+ * covers the address and turns its micro-ops into exits, so a block that
+ * overwrote itself stops after the store. Storage is only reclaimed by a
+ * flush.
+ */
+void
+invalidate_blocks(cpu_8080_t * cpu, uint16_t address)
+{
+    block_cache_t * cache = cpu->block_cache;
+
+    if (!(cache->code[address >> 3] & (1 << (address & 7))))
+    {
+        return;
+    }
+
+    for (int back = 0; back < MAX_BLOCK_SIZE; back++)
+    {
+        uint16_t start = address - back;
+        block_t * block = cache->lookup[start];
+
+        if (block != NULL && (uint16_t)(address - start) < block->size)
+        {
+            drop_block(cache, block);
+        }
+    }
+}
+
+/*
+ * The same for a page replaced as a whole: one pass over the blocks that
+ * start in the page or close enough before it to reach in. Afterwards no
+ * block covers the page, so it no longer holds code.
+ */
+void
+invalidate_page(cpu_8080_t * cpu, uint8_t page)
+{
+    block_cache_t * cache = cpu->block_cache;
+    uint16_t base = page << 8;
+
+    if (!(cpu->page_flags[page] & PAGE_CODE))
+    {
+        return;
+    }
+
+    for (int offset = 1 - MAX_BLOCK_SIZE; offset < 256; offset++)
+    {
+        uint16_t start = base + offset;
+        block_t * block = cache->lookup[start];
+
+        if (block != NULL && (offset >= 0 || (uint16_t)(base - start) < block->size))
+        {
+            drop_block(cache, block);
+        }
+    }
+
+    memset(cache->code + base / 8, 0, 256 / 8);
+    cpu->page_flags[page] &= ~PAGE_CODE;
+}
@@ -0,0 +1,59 @@
+#ifndef BLOCK_CACHE_8080_H_
+#define BLOCK_CACHE_8080_H_
+
+#include <stdint.h>
+#include "emulator.h"
+
+#define MAX_BLOCK_OPS    32     // micro-ops in one block
+#define MAX_BLOCK_SIZE   (MAX_BLOCK_OPS * 3)
+#define MAX_BLOCK_CYCLES (MAX_BLOCK_OPS * 18) // the longest a block can run
+#define MAX_BLOCKS       8192
+#define MAX_CACHED_OPS   65536
+
+// Micro-op that leaves the block; invalidated blocks are filled with it.
+#define BLOCK_EXIT     0x100
+
+// One pre-decoded instruction.
+typedef struct micro_op
+{
+    uint16_t opcode;
+    uint16_t address;
+    uint16_t operand;
+} micro_op_t;
+
+struct jit;
+struct jit_registers;
+
+// A straight-line run of instructions ending at a branch, call or return.
+typedef struct block
+{
+    uint16_t start;
+    uint16_t size;  // bytes of guest code covered
+    uint16_t count; // micro-ops in the block
+    micro_op_t * ops;
+
+    // Times run by the block executor, and native code once it is hot.
+    uint32_t hits;
+    uint32_t (*native)(cpu_8080_t * cpu, struct jit_registers * registers);
+} block_t;
+
+typedef struct block_cache
+{
+    block_t * lookup[0x10000];          // blocks by start address
+    uint8_t code[0x10000 / 8];          // bitmap of bytes covered by blocks
+    block_t blocks[MAX_BLOCKS];
+    micro_op_t ops[MAX_CACHED_OPS];
+    int block_count;
+    int op_count;
+    struct jit * jit;                   // optional, see jit.h
+} block_cache_t;
+
+block_cache_t * create_block_cache(void);
+void free_block_cache(block_cache_t * cache);
+block_t * translate_block(cpu_8080_t * cpu, uint16_t address);
+void invalidate_blocks(cpu_8080_t * cpu, uint16_t address);
+void invalidate_page(cpu_8080_t * cpu, uint8_t page);
+void flush_block_cache(cpu_8080_t * cpu);
+void drop_native_code(block_cache_t * cache);
+
+#endif /* !BLOCK_CACHE_8080_H_ */
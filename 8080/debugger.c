@@ -0,0 +1,716 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debugger.h"
+#include "emulator.h"
+#include "history.h"
+
+// Postfix operations of a condition.
+enum {
+    OP_NUMBER,
+    OP_REGISTER,
+    OP_MEMORY,
+    OP_NOT,
+    OP_COMPLEMENT,
+    OP_NEGATE,
+    OP_MULTIPLY,
+    OP_ADD,
+    OP_SUBTRACT,
+    OP_LESS,
+    OP_LESS_EQUAL,
+    OP_GREATER,
+    OP_GREATER_EQUAL,
+    OP_EQUAL,
+    OP_NOT_EQUAL,
+    OP_AND,
+    OP_XOR,
+    OP_OR,
+    OP_LOGICAL_AND,
+    OP_LOGICAL_OR
+};
+
+enum {
+    REG_A, REG_B, REG_C, REG_D, REG_E, REG_H, REG_L,
+    REG_BC, REG_DE, REG_HL, REG_SP, REG_PC, REG_M,
+    FLAG_S, FLAG_Z, FLAG_AC, FLAG_P, FLAG_CY
+};
+
+static const struct
+{
+    const char * name;
+    uint8_t id;
+} register_names[] = {
+    { "A", REG_A }, { "B", REG_B }, { "C", REG_C }, { "D", REG_D },
+    { "E", REG_E }, { "H", REG_H }, { "L", REG_L }, { "BC", REG_BC },
+    { "DE", REG_DE }, { "HL", REG_HL }, { "SP", REG_SP }, { "PC", REG_PC },
+    { "M", REG_M }, { "S", FLAG_S }, { "Z", FLAG_Z }, { "AC", FLAG_AC },
+    { "P", FLAG_P }, { "CY", FLAG_CY }
+};
+
+// Binary operators by C precedence, higher binding tighter. Two-character
+// ones come first so that "<=" is not taken for "<".
+static const struct
+{
+    const char * text;
+    int level;
+    uint8_t op;
+} binary_operators[] = {
+    { "||", 1, OP_LOGICAL_OR }, { "&&", 2, OP_LOGICAL_AND },
+    { "==", 6, OP_EQUAL }, { "!=", 6, OP_NOT_EQUAL },
+    { "<=", 7, OP_LESS_EQUAL }, { ">=", 7, OP_GREATER_EQUAL },
+    { "|", 3, OP_OR }, { "^", 4, OP_XOR }, { "&", 5, OP_AND },
+    { "<", 7, OP_LESS }, { ">", 7, OP_GREATER },
+    { "+", 8, OP_ADD }, { "-", 8, OP_SUBTRACT }, { "*", 9, OP_MULTIPLY }
+};
+
+typedef struct parser
+{
+    const char * p;
+    debug_expression_t * expression;
+    int failed;
+} parser_t;
+
+static void
+emit(parser_t * parser, uint8_t kind, uint32_t value)
+{
+    debug_expression_t * expression = parser->expression;
+
+    if (expression->length == DEBUG_MAX_CODE)
+    {
+        parser->failed = 1;
+        return;
+    }
+
+    expression->code[expression->length].kind = kind;
+    expression->code[expression->length].value = value;
+    expression->length++;
+}
+
+static void
+skip_spaces(parser_t * parser)
+{
+    while (isspace((unsigned char)*parser->p))
+    {
+        parser->p++;
+    }
+}
+
+static int
+expect(parser_t * parser, char c)
+{
+    skip_spaces(parser);
+
+    if (*parser->p != c)
+    {
+        parser->failed = 1;
+        return 0;
+    }
+
+    parser->p++;
+    return 1;
+}
+
+static void parse_binary(parser_t * parser, int level);
+
+static void
+parse_unary(parser_t * parser)
+{
+    skip_spaces(parser);
+
+    char c = *parser->p;
+
+    if (parser->failed)
+    {
+        return;
+    }
+
+    if (c == '!' || c == '~' || c == '-')
+    {
+        parser->p++;
+        parse_unary(parser);
+        emit(parser, c == '!' ? OP_NOT : c == '~' ? OP_COMPLEMENT : OP_NEGATE, 0);
+    }
+    else if (c == '(')
+    {
+        parser->p++;
+        parse_binary(parser, 1);
+        expect(parser, ')');
+    }
+    else if (c == '[')
+    {
+        parser->p++;
+        parse_binary(parser, 1);
+        if (expect(parser, ']'))
+        {
+            emit(parser, OP_MEMORY, 0);
+        }
+    }
+    else if (isdigit((unsigned char)c))
+    {
+        int hex = c == '0' && (parser->p[1] == 'x' || parser->p[1] == 'X');
+        char * end;
+        unsigned long value = strtoul(parser->p, &end, hex ? 16 : 10);
+
+        parser->p = end;
+        emit(parser, OP_NUMBER, (uint32_t)value);
+    }
+    else if (isalpha((unsigned char)c))
+    {
+        char name[4];
+        size_t length = 0;
+
+        while (isalpha((unsigned char)*parser->p))
+        {
+            if (length < sizeof(name) - 1)
+            {
+                name[length] = toupper((unsigned char)*parser->p);
+            }
+
+            length++;
+            parser->p++;
+        }
+
+        parser->failed = 1;
+        if (length < sizeof(name))
+        {
+            name[length] = '\0';
+
+            for (size_t i = 0; i < sizeof(register_names) / sizeof(register_names[0]); i++)
+            {
+                if (strcmp(name, register_names[i].name) == 0)
+                {
+                    parser->failed = 0;
+                    emit(parser, OP_REGISTER, register_names[i].id);
+                    break;
+                }
+            }
+        }
+    }
+    else
+    {
+        parser->failed = 1;
+    }
+}
+
+// Operands joined by operators of at least level, by precedence climbing.
+static void
+parse_binary(parser_t * parser, int level)
+{
+    parse_unary(parser);
+
+    while (!parser->failed)
+    {
+        size_t i;
+
+        skip_spaces(parser);
+        for (i = 0; i < sizeof(binary_operators) / sizeof(binary_operators[0]); i++)
+        {
+            const char * text = binary_operators[i].text;
+
+            if (strncmp(parser->p, text, strlen(text)) == 0)
+            {
+                break;
+            }
+        }
+
+        if (i == sizeof(binary_operators) / sizeof(binary_operators[0]) ||
+            binary_operators[i].level < level)
+        {
+            return;
+        }
+
+        parser->p += strlen(binary_operators[i].text);
+        parse_binary(parser, binary_operators[i].level + 1);
+        emit(parser, binary_operators[i].op, 0);
+    }
+}
+
+/*
+ * Compiles a condition, see debugger.h. NULL or blank text is always true.
+ * Returns 0, or -1 if it does not parse or is too long.
+ */
+int
+compile_condition(debug_expression_t * expression, const char * text)
+{
+    parser_t parser = { text ? text : "", expression, 0 };
+
+    expression->length = 0;
+    skip_spaces(&parser);
+
+    if (*parser.p == '\0')
+    {
+        return 0;
+    }
+
+    parse_binary(&parser, 1);
+    skip_spaces(&parser);
+
+    if (parser.failed || *parser.p != '\0')
+    {
+        expression->length = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int32_t
+register_value(const cpu_8080_t * cpu, uint32_t id)
+{
+    switch (id)
+    {
+        case REG_A:   return cpu->a;
+        case REG_B:   return cpu->b;
+        case REG_C:   return cpu->c;
+        case REG_D:   return cpu->d;
+        case REG_E:   return cpu->e;
+        case REG_H:   return cpu->h;
+        case REG_L:   return cpu->l;
+        case REG_BC:  return cpu->b << 8 | cpu->c;
+        case REG_DE:  return cpu->d << 8 | cpu->e;
+        case REG_HL:  return cpu->h << 8 | cpu->l;
+        case REG_SP:  return cpu->stack_pointer;
+        case REG_PC:  return cpu->program_counter;
+        case REG_M:   return cpu->memory[cpu->h << 8 | cpu->l];
+        case FLAG_S:  return pack_condition_codes(cpu) >> 7 & 1;
+        case FLAG_Z:  return pack_condition_codes(cpu) >> 6 & 1;
+        case FLAG_AC: return pack_condition_codes(cpu) >> 4 & 1;
+        case FLAG_P:  return pack_condition_codes(cpu) >> 2 & 1;
+        default:      return pack_condition_codes(cpu) & 1;
+    }
+}
+
+// Works a compiled condition out on the machine as it is.
+int32_t
+evaluate_condition(const debug_expression_t * expression, const cpu_8080_t * cpu)
+{
+    int32_t stack[DEBUG_MAX_CODE];
+    int depth = 0;
+
+    if (expression->length == 0)
+    {
+        return 1;
+    }
+
+    for (int i = 0; i < expression->length; i++)
+    {
+        const debug_op_t * op = &expression->code[i];
+
+        switch (op->kind)
+        {
+            case OP_NUMBER:
+                stack[depth++] = (int32_t)op->value;
+                continue;
+            case OP_REGISTER:
+                stack[depth++] = register_value(cpu, op->value);
+                continue;
+            case OP_MEMORY:
+                stack[depth - 1] = cpu->memory[stack[depth - 1] & 0xFFFF];
+                continue;
+            case OP_NOT:
+                stack[depth - 1] = !stack[depth - 1];
+                continue;
+            case OP_COMPLEMENT:
+                stack[depth - 1] = ~stack[depth - 1];
+                continue;
+            case OP_NEGATE:
+                stack[depth - 1] = (int32_t)(0 - (uint32_t)stack[depth - 1]);
+                continue;
+            default:
+                break;
+        }
+
+        // Binary: the right operand is on top.
+        int32_t right = stack[--depth];
+        int32_t left = stack[depth - 1];
+        int32_t result;
+
+        switch (op->kind)
+        {
+            case OP_MULTIPLY:      result = (int32_t)((uint32_t)left * (uint32_t)right); break;
+            case OP_ADD:           result = (int32_t)((uint32_t)left + (uint32_t)right); break;
+            case OP_SUBTRACT:      result = (int32_t)((uint32_t)left - (uint32_t)right); break;
+            case OP_LESS:          result = left < right; break;
+            case OP_LESS_EQUAL:    result = left <= right; break;
+            case OP_GREATER:       result = left > right; break;
+            case OP_GREATER_EQUAL: result = left >= right; break;
+            case OP_EQUAL:         result = left == right; break;
+            case OP_NOT_EQUAL:     result = left != right; break;
+            case OP_AND:           result = left & right; break;
+            case OP_XOR:           result = left ^ right; break;
+            case OP_OR:            result = left | right; break;
+            case OP_LOGICAL_AND:   result = left && right; break;
+            default:               result = left || right; break;
+        }
+
+        stack[depth - 1] = result;
+    }
+
+    return stack[0];
+}
+
+static int
+has_address(const uint8_t * bits, uint16_t address)
+{
+    return bits[address / 8] >> (address % 8) & 1;
+}
+
+// Sets PAGE_WATCH on exactly the pages with anything watched.
+static void
+mark_pages(debugger_t * debugger)
+{
+    cpu_8080_t * cpu = debugger->cpu;
+
+    if (cpu == NULL)
+    {
+        return;
+    }
+
+    for (int page = 0; page < 256; page++)
+    {
+        int watched = 0;
+
+        for (int i = page * 32; i < page * 32 + 32; i++)
+        {
+            watched |= debugger->breaks[i] | debugger->reads[i] | debugger->writes[i];
+        }
+
+        if (watched)
+        {
+            cpu->page_flags[page] |= PAGE_WATCH;
+        }
+        else
+        {
+            cpu->page_flags[page] &= ~PAGE_WATCH;
+        }
+    }
+}
+
+static void
+mark_point(debugger_t * debugger, const debug_point_t * point)
+{
+    for (uint32_t address = point->first; address <= point->last; address++)
+    {
+        uint8_t bit = 1 << (address % 8);
+
+        if (point->kinds & DEBUG_BREAK)
+        {
+            debugger->breaks[address / 8] |= bit;
+        }
+
+        if (point->kinds & DEBUG_READ)
+        {
+            debugger->reads[address / 8] |= bit;
+        }
+
+        if (point->kinds & DEBUG_WRITE)
+        {
+            debugger->writes[address / 8] |= bit;
+        }
+    }
+}
+
+debugger_t *
+create_debugger(void)
+{
+    debugger_t * debugger = calloc(1, sizeof(debugger_t));
+    if (debugger == NULL)
+    {
+        return NULL;
+    }
+
+    debugger->stop_cycle = UINT64_MAX;
+    debugger->hit.point = -1;
+
+    return debugger;
+}
+
+void
+free_debugger(debugger_t * debugger)
+{
+    if (debugger != NULL)
+    {
+        detach_debugger(debugger);
+        free(debugger);
+    }
+}
+
+// Sets cpu->debugger and flags the pages the points are on.
+void
+attach_debugger(debugger_t * debugger, cpu_8080_t * cpu)
+{
+    detach_debugger(debugger);
+    debugger->cpu = cpu;
+    cpu->debugger = debugger;
+    mark_pages(debugger);
+}
+
+void
+detach_debugger(debugger_t * debugger)
+{
+    cpu_8080_t * cpu = debugger->cpu;
+
+    if (cpu == NULL)
+    {
+        return;
+    }
+
+    for (int page = 0; page < 256; page++)
+    {
+        cpu->page_flags[page] &= ~PAGE_WATCH;
+    }
+
+    cpu->debugger = NULL;
+    debugger->cpu = NULL;
+}
+
+/*
+ * Adds a breakpoint, a watchpoint or both, as kinds says, on the bytes from
+ * first to last, stopping only when condition is true, see debugger.h.
+ * Returns the point's number, or -1 if there are too many or the condition
+ * does not compile.
+ */
+int
+add_point(debugger_t * debugger, int kinds, uint16_t first, uint16_t last,
+          const char * condition)
+{
+    if (debugger->count == DEBUG_MAX_POINTS || first > last)
+    {
+        return -1;
+    }
+
+    debug_point_t * point = &debugger->points[debugger->count];
+
+    if (compile_condition(&point->condition, condition) != 0)
+    {
+        return -1;
+    }
+
+    point->kinds = kinds;
+    point->first = first;
+    point->last = last;
+    mark_point(debugger, point);
+    mark_pages(debugger);
+
+    return debugger->count++;
+}
+
+// Removes a point. Those numbered after it move down one.
+void
+remove_point(debugger_t * debugger, int point)
+{
+    if (point < 0 || point >= debugger->count)
+    {
+        return;
+    }
+
+    memmove(&debugger->points[point], &debugger->points[point + 1],
+            (debugger->count - point - 1) * sizeof(debug_point_t));
+    debugger->count--;
+
+    memset(debugger->breaks, 0, sizeof(debugger->breaks));
+    memset(debugger->reads, 0, sizeof(debugger->reads));
+    memset(debugger->writes, 0, sizeof(debugger->writes));
+
+    for (int i = 0; i < debugger->count; i++)
+    {
+        mark_point(debugger, &debugger->points[i]);
+    }
+
+    mark_pages(debugger);
+}
+
+// Lets a stopped machine run on, starting with the instruction it is on.
+void
+resume_debugger(debugger_t * debugger)
+{
+    debugger->stopped = 0;
+}
+
+// The first point of a kind on address whose condition holds, or -1.
+static int
+find_point(const debugger_t * debugger, const cpu_8080_t * cpu, int kind, uint16_t address)
+{
+    for (int i = 0; i < debugger->count; i++)
+    {
+        const debug_point_t * point = &debugger->points[i];
+
+        if ((point->kinds & kind) && address >= point->first && address <= point->last &&
+            evaluate_condition(&point->condition, cpu) != 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void
+watch(debugger_t * debugger, const cpu_8080_t * cpu, debug_kind_t kind,
+      uint16_t address, uint8_t value)
+{
+    // The first hit of an instruction is the one that counts.
+    if (debugger->pending)
+    {
+        return;
+    }
+
+    int point = find_point(debugger, cpu, kind, address);
+
+    if (point >= 0)
+    {
+        debugger->pending = 1;
+        debugger->hit.point = point;
+        debugger->hit.kind = kind;
+        debugger->hit.address = address;
+        debugger->hit.value = value;
+        debugger->hit.culprit = debugger->instruction;
+    }
+}
+
+// A load from a PAGE_WATCH page. Called by the emulator.
+void
+watch_read(debugger_t * debugger, const cpu_8080_t * cpu, uint16_t address, uint8_t value)
+{
+    if (has_address(debugger->reads, address))
+    {
+        watch(debugger, cpu, DEBUG_READ, address, value);
+    }
+}
+
+// A store to a PAGE_WATCH page, of the value now there. Called by the
+// emulator.
+void
+watch_write(debugger_t * debugger, const cpu_8080_t * cpu, uint16_t address, uint8_t value)
+{
+    if (has_address(debugger->writes, address))
+    {
+        watch(debugger, cpu, DEBUG_WRITE, address, value);
+    }
+}
+
+// A breakpoint on the instruction at the program counter, if one applies.
+static int
+find_break(debugger_t * debugger, const cpu_8080_t * cpu)
+{
+    uint16_t address = cpu->program_counter;
+
+    if (!has_address(debugger->breaks, address))
+    {
+        return 0;
+    }
+
+    int point = find_point(debugger, cpu, DEBUG_BREAK, address);
+
+    if (point < 0)
+    {
+        return 0;
+    }
+
+    debugger->hit.point = point;
+    debugger->hit.kind = DEBUG_BREAK;
+    debugger->hit.address = address;
+    debugger->hit.value = cpu->memory[address];
+    debugger->hit.culprit = address;
+
+    return 1;
+}
+
+/*
+ * The slow path of debug_instruction(): stops the machine if the last
+ * instruction hit a watchpoint or this one is on a breakpoint. The
+ * instruction it stopped at runs once it is resumed.
+ */
+int
+check_debugger(debugger_t * debugger, const cpu_8080_t * cpu, uint64_t cycle)
+{
+    if (debugger->passive || cycle == debugger->stop_cycle)
+    {
+        return 0;
+    }
+
+    if (debugger->pending)
+    {
+        debugger->pending = 0;
+    }
+    else if (!find_break(debugger, cpu))
+    {
+        return 0;
+    }
+
+    debugger->stopped = 1;
+    debugger->stop_cycle = cycle;
+
+    return 1;
+}
+
+typedef struct point_search
+{
+    debugger_t * debugger;
+    debug_hit_t hit;        // of the last point reached
+} point_search_t;
+
+static int
+point_reached(const cpu_8080_t * cpu, void * context)
+{
+    point_search_t * search = context;
+    debugger_t * debugger = search->debugger;
+    int answer = 0;
+
+    if (debugger->pending)
+    {
+        debugger->pending = 0;
+        answer = HISTORY_STOP_BEFORE;
+    }
+    else if (find_break(debugger, cpu))
+    {
+        answer = HISTORY_STOP_HERE;
+    }
+
+    if (answer)
+    {
+        search->hit = debugger->hit;
+    }
+
+    return answer;
+}
+
+/*
+ * Runs the machine backward to the last breakpoint before it, or to just
+ * before the last instruction that hit a watchpoint, see history.h. The
+ * debugger is left stopped there. Returns what run_back() does.
+ */
+int
+run_back_to_point(debugger_t * debugger, history_t * history)
+{
+    point_search_t search = { debugger, debugger->hit };
+    int result = run_back(history, point_reached, &search);
+
+    // Playing forward to the point found hits the points before it again.
+    debugger->hit = search.hit;
+
+    return result;
+}
+
+// Says what stopped the machine. Returns what snprintf() does.
+int
+describe_stop(const debugger_t * debugger, char * text, size_t size)
+{
+    const debug_hit_t * hit = &debugger->hit;
+
+    if (hit->point < 0)
+    {
+        return snprintf(text, size, "no point");
+    }
+
+    if (hit->kind == DEBUG_BREAK)
+    {
+        return snprintf(text, size, "breakpoint %d at 0x%04x", hit->point, hit->address);
+    }
+
+    return snprintf(text, size, "watchpoint %d: %s 0x%02x %s 0x%04x by the instruction at 0x%04x",
+                    hit->point, hit->kind == DEBUG_READ ? "read of" : "write of", hit->value,
+                    hit->kind == DEBUG_READ ? "from" : "to", hit->address, hit->culprit);
+}
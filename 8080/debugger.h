@@ -0,0 +1,142 @@
+#ifndef DEBUGGER_8080_H_
+#define DEBUGGER_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emulator.h"
+
+struct history;
+
+/*
+ * Breakpoints and watchpoints. An emulator built with EMULATOR_8080_DEBUG
+ * stops a CPU with cpu->debugger set before running an instruction at a
+ * breakpoint, and after running one that reads or writes a watched byte.
+ * Without it cpu->debugger is ignored and the interpreter carries no
+ * debugging code at all. The JIT is bypassed while it is set.
+ *
+ * Nothing is searched on the way. Each page that holds a breakpoint or a
+ * watched byte has PAGE_WATCH set in cpu->page_flags, so loads, stores and
+ * fetches anywhere else only test that flag; stores already take the slow
+ * path for any flag. On a flagged page a bitmap per kind says whether the
+ * byte itself is watched, and only then are the points looked through.
+ *
+ * Any point may have a condition, an expression in C syntax over the
+ * registers A B C D E H L BC DE HL SP PC, the flags S Z AC P CY, numbers in
+ * decimal or 0x hex and [address] for a byte of memory; M is [HL]. It stops
+ * the machine only when the condition is not zero. A watchpoint's is
+ * looked at as the access happens, partway through the instruction.
+ *
+ * Once stopped, debugger->stopped is set, run_until(), run_scheduler(),
+ * play_replay() and run_history() return, and the fleet reports the
+ * machine as stopped. resume_debugger() lets it run on, past the point it
+ * stopped at. Going back in a history, see history.h, leaves it stopped
+ * wherever the machine lands.
+ */
+
+#define DEBUG_MAX_POINTS 64
+#define DEBUG_MAX_CODE   64
+
+typedef enum debug_kind
+{
+    DEBUG_BREAK = 1,
+    DEBUG_READ  = 2,
+    DEBUG_WRITE = 4
+} debug_kind_t;
+
+// A condition compiled to postfix.
+typedef struct debug_op
+{
+    uint8_t kind;
+    uint32_t value;         // of a number, or which register
+} debug_op_t;
+
+typedef struct debug_expression
+{
+    debug_op_t code[DEBUG_MAX_CODE];
+    int length;             // 0 for always
+} debug_expression_t;
+
+typedef struct debug_point
+{
+    int kinds;              // debug_kind_t bits
+    uint16_t first;         // the bytes it covers
+    uint16_t last;
+    debug_expression_t condition;
+} debug_point_t;
+
+// What stopped the machine: the point, the access and the instruction.
+typedef struct debug_hit
+{
+    int point;
+    debug_kind_t kind;
+    uint16_t address;
+    uint8_t value;
+    uint16_t culprit;
+} debug_hit_t;
+
+typedef struct debugger
+{
+    cpu_8080_t * cpu;       // attached to, or NULL
+    debug_point_t points[DEBUG_MAX_POINTS];
+    int count;
+
+    // A bit per address, per kind.
+    uint8_t breaks[0x10000 / 8];
+    uint8_t reads[0x10000 / 8];
+    uint8_t writes[0x10000 / 8];
+
+    uint16_t instruction;   // the address of the one being run
+    int pending;            // a watchpoint was hit by it
+    int passive;            // note hits but do not stop, while going back
+    int stopped;
+    uint64_t stop_cycle;    // where it stopped last
+    debug_hit_t hit;
+} debugger_t;
+
+debugger_t * create_debugger(void);
+void free_debugger(debugger_t * debugger);
+void attach_debugger(debugger_t * debugger, cpu_8080_t * cpu);
+void detach_debugger(debugger_t * debugger);
+int compile_condition(debug_expression_t * expression, const char * text);
+int32_t evaluate_condition(const debug_expression_t * expression, const cpu_8080_t * cpu);
+int add_point(debugger_t * debugger, int kinds, uint16_t first, uint16_t last,
+              const char * condition);
+void remove_point(debugger_t * debugger, int point);
+void resume_debugger(debugger_t * debugger);
+void watch_read(debugger_t * debugger, const cpu_8080_t * cpu, uint16_t address,
+                uint8_t value);
+void watch_write(debugger_t * debugger, const cpu_8080_t * cpu, uint16_t address,
+                 uint8_t value);
+int check_debugger(debugger_t * debugger, const cpu_8080_t * cpu, uint64_t cycle);
+int run_back_to_point(debugger_t * debugger, struct history * history);
+int describe_stop(const debugger_t * debugger, char * text, size_t size);
+
+#ifdef EMULATOR_8080_DEBUG
+#define DEBUGGING(cpu) ((cpu)->debugger != NULL)
+#define DEBUG_STOPPED(cpu) ((cpu)->debugger != NULL && (cpu)->debugger->stopped)
+#else
+#define DEBUGGING(cpu) 0
+#define DEBUG_STOPPED(cpu) 0
+#endif
+
+/*
+ * Says whether to stop before the instruction at the program counter, on
+ * cycle. Called by the interpreter before every instruction of a debugged
+ * CPU.
+ */
+static inline int
+debug_instruction(cpu_8080_t * cpu, uint64_t cycle)
+{
+    debugger_t * debugger = cpu->debugger;
+
+    debugger->instruction = cpu->program_counter;
+
+    if (debugger->pending || (cpu->page_flags[cpu->program_counter >> 8] & PAGE_WATCH))
+    {
+        return check_debugger(debugger, cpu, cycle);
+    }
+
+    return 0;
+}
+
+#endif /* !DEBUGGER_8080_H_ */
@@ -1,13 +1,38 @@
 #ifndef DISASSEMBLER_8080_H_
 #define DISASSEMBLER_8080_H_
 
-typedef struct instruction
+#include <stddef.h>
+#include <stdint.h>
+
+// The longest instruction, in bytes.
+#define MAX_INSTRUCTION_SIZE 3
+
+// The most bytes format_data() puts on a line.
+#define MAX_DATA_BYTES 8
+
+// The most characters disassemble_text(), format_data() and
+// format_address() write.
+#define MAX_TEXT_SIZE 40
+
+/*
+ * What trace_code() found in a 64 KiB address space, one bit per address,
+ * address n at bit n % 8 of byte n / 8.
+ */
+typedef struct code_map
 {
-    char size;
-    char mnemonic[255];
-    char has_address;
-} instruction_t;
+    uint8_t starts[0x10000 / 8]; // instructions reached from an entry point
+    uint8_t code[0x10000 / 8];   // bytes of those instructions
+    uint8_t labels[0x10000 / 8]; // targets of jumps, calls and RSTs
+} code_map_t;
+
+#define CODE_MAP_BIT(bits, n) ((bits)[(n) / 8] >> ((n) % 8) & 1)
 
+int instruction_size(unsigned char opcode);
+int format_address(char * text, uint64_t address);
+int disassemble_text(const unsigned char * code, char * text, int * size);
+int format_data(const unsigned char * data, int count, char * text);
 int disassemble(unsigned char * buf, char * disassembled, int program_counter);
+int trace_code(const unsigned char * image, size_t size,
+               const uint16_t * entries, int count, code_map_t * map);
 
 #endif /* !DISASSEMBLER_8080_H_ */
@@ -1,13 +1,32 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "block_cache.h"
+#include "debugger.h"
 #include "emulator.h"
+#include "fleet.h"
+#include "jit.h"
+#include "memory_map.h"
+#include "opcodes.h"
+#include "ports.h"
+#include "profile.h"
+#include "replay.h"
+#include "rom.h"
+#include "trace.h"
 
+/*
+ * Prints the registers and exits. Nothing in the emulator calls it. The
+ * trace is closed so it keeps what led up to this; memory is left to its
+ * owner, which may have mapped it rather than allocated it.
+ */
 void
 die(cpu_8080_t * cpu)
 {
     // The program counter advances ahead of any errors.
     cpu->program_counter--;
+    materialize_condition_codes(cpu);
 
     printf("Instructon 0x%02x\n", cpu->memory[cpu->program_counter]);
     printf("PC         0x%04x\n", cpu->program_counter);
@@ -26,8 +45,11 @@ die(cpu_8080_t * cpu)
     printf("parity     0x%02x\n", cpu->condition_codes.p);
     printf("carry      0x%02x\n", cpu->condition_codes.cy);
 
-    free(cpu->memory);
-    free(cpu);
+    if (cpu->trace != NULL)
+    {
+        close_trace(cpu->trace);
+        cpu->trace = NULL;
+    }
 
     exit(1);
 }
@@ -36,715 +58,1429 @@ die(cpu_8080_t * cpu)
  * The parity bit is set when the number of bits set in a byte are even and
  * reset when they are odd.
  */
-static int
-parity(int byte)
+#define P2(n) n, n ^ 1, n ^ 1, n
+#define P4(n) P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n) P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
+
+static const uint8_t parity_table[256] = { P6(1), P6(0), P6(0), P6(1) };
+
+#undef P6
+#undef P4
+#undef P2
+
+/*
+ * Lazy flags. Arithmetic only records its result and the bits that give the
+ * auxiliary carry; the individual flags are worked out when something reads
+ * them.
+ */
+
+static inline uint8_t
+zero_flag(const cpu_8080_t * cpu)
 {
-    int parity = 0;
-    byte = (byte & (1 << 7));
+    return cpu->flags_lazy ? (cpu->flag_result & 0xFF) == 0 : cpu->condition_codes.z;
+}
 
-    for (int i = 0; i < 8; i++)
-    {
-        if (byte & 0x1)
-        {
-            parity++;
-        }
+static inline uint8_t
+sign_flag(const cpu_8080_t * cpu)
+{
+    return cpu->flags_lazy ? (cpu->flag_result >> 7) & 1 : cpu->condition_codes.s;
+}
 
-        byte >>= 1;
-    }
+static inline uint8_t
+parity_flag(const cpu_8080_t * cpu)
+{
+    return cpu->flags_lazy ? parity_table[cpu->flag_result & 0xFF] : cpu->condition_codes.p;
+}
+
+static inline uint8_t
+aux_carry_flag(const cpu_8080_t * cpu)
+{
+    return cpu->flags_lazy ? (cpu->flag_aux >> 4) & 1 : cpu->condition_codes.ac;
+}
+
+static inline uint8_t
+carry_flag(const cpu_8080_t * cpu)
+{
+    return (cpu->flag_result >> 8) & 1;
+}
+
+static inline void
+set_carry_flag(cpu_8080_t * cpu, uint8_t carry)
+{
+    cpu->flag_result = (cpu->flag_result & 0xFF) | (carry << 8);
+}
 
-    return (0 == (parity & 0x1));
+// Records a result that sets Z, S and P. The carry is bit 8 of the result.
+static inline void
+set_result_flags(cpu_8080_t * cpu, uint16_t result, uint8_t aux)
+{
+    cpu->flag_result = result;
+    cpu->flag_aux = aux;
+    cpu->flags_lazy = 1;
 }
 
 /*
- * Single register instructions.
+ * Brings condition_codes up to date with the lazily evaluated flags.
  */
-
 void
-process_condition_bits(cpu_8080_t * cpu, uint16_t value, uint8_t bits)
+materialize_condition_codes(cpu_8080_t * cpu)
 {
-    if (bits & ZERO_BIT) {
-        cpu->condition_codes.z = value == 0;
-    }
+    cpu->condition_codes.s = sign_flag(cpu);
+    cpu->condition_codes.z = zero_flag(cpu);
+    cpu->condition_codes.ac = aux_carry_flag(cpu);
+    cpu->condition_codes.p = parity_flag(cpu);
+    cpu->condition_codes.cy = carry_flag(cpu);
+    cpu->flags_lazy = 0;
+}
 
-    if (bits & SIGN_BIT) {
-        cpu->condition_codes.s = (value & 0x80) == 0x80;
-    }
+/*
+ * Memory and stack access.
+ * Every load and store made on behalf of the guest goes through these.
+ */
 
-    if (bits & AUX_CARRY_BIT) {
-        cpu->condition_codes.ac = (value & 0xF) == 0xF;
-    }
+// A load from a page a device answers, recorded or played back like IN.
+static uint8_t
+mmio_in(const cpu_8080_t * cpu, uint16_t address, uint64_t cycle)
+{
+    const memory_map_t * map = cpu->memory_map;
+    uint8_t page = address >> 8;
 
-    if (bits & PARITY_BIT) {
-        cpu->condition_codes.p = parity(value);
+    if (cpu->replay != NULL && cpu->replay->state == REPLAY_PLAYING)
+    {
+        return play_load(cpu->replay, cycle, address);
     }
 
-    if (bits & CARRY_BIT) {
-        cpu->condition_codes.cy = (value & 0x80) == 0x80;
+    uint8_t value = map->read[page](map->device[page], address, cycle);
+
+    if (cpu->replay != NULL)
+    {
+        record_load(cpu->replay, cycle, address, value);
     }
+
+    return value;
 }
 
-// Increment register or memory.
-static int
-inr(cpu_8080_t * cpu, uint8_t * reg)
+// Slow path for loads from pages with PAGE_MMIO_IN or PAGE_WATCH.
+static uint8_t
+read_hooks(const cpu_8080_t * cpu, uint16_t address, uint64_t cycle)
 {
-    (*reg)++;
-    process_condition_bits(cpu, *reg, ZERO_BIT | SIGN_BIT | PARITY_BIT | AUX_CARRY_BIT);
-    return 5;
+    uint8_t flags = cpu->page_flags[address >> 8];
+    uint8_t value = cpu->memory[address];
+
+    if (flags & PAGE_MMIO_IN)
+    {
+        value = mmio_in(cpu, address, cycle);
+    }
+
+    if (DEBUGGING(cpu) && (flags & PAGE_WATCH))
+    {
+        watch_read(cpu->debugger, cpu, address, value);
+    }
+
+    return value;
 }
 
-static int
-inr_m(cpu_8080_t * cpu)
+// Loads, given the cycle the loading instruction started on.
+static inline uint8_t
+read_byte(const cpu_8080_t * cpu, uint16_t address, uint64_t cycle)
 {
-    uint16_t address = (cpu->h << 8) | cpu->l;
-    cpu->memory[address] = cpu->memory[address] + 1;
-    process_condition_bits(cpu, cpu->memory[address], ZERO_BIT | SIGN_BIT | PARITY_BIT | AUX_CARRY_BIT);
+    uint8_t hooked = DEBUGGING(cpu) ? PAGE_MMIO_IN | PAGE_WATCH : PAGE_MMIO_IN;
 
-    return 10;
+    if (cpu->page_flags[address >> 8] & hooked)
+    {
+        return read_hooks(cpu, address, cycle);
+    }
+
+    return cpu->memory[address];
 }
 
-// Decrement register or memory.
-static int
-dcr(cpu_8080_t * cpu, uint8_t * reg)
+// Instruction bytes, which read watchpoints leave out.
+static inline uint8_t
+fetch_byte(const cpu_8080_t * cpu, uint16_t address)
 {
-    (*reg)--;
-    process_condition_bits(cpu, *reg, ZERO_BIT | SIGN_BIT | PARITY_BIT | AUX_CARRY_BIT);
-    return 5;
+    return cpu->memory[address];
 }
 
-static int
-dcr_m(cpu_8080_t * cpu)
+// Slow path for stores to pages that something is keeping an eye on.
+static void
+write_hooks(cpu_8080_t * cpu, uint16_t address)
 {
-    uint16_t address = (cpu->h << 8) | cpu->l;
-    cpu->memory[address]--;
-    process_condition_bits(cpu, cpu->memory[address], ZERO_BIT | SIGN_BIT | PARITY_BIT | AUX_CARRY_BIT);
+    uint8_t page = address >> 8;
+
+    if (cpu->page_flags[page] & PAGE_CODE)
+    {
+        invalidate_blocks(cpu, address);
+    }
 
-    return 10;
+    if (cpu->page_flags[page] & PAGE_CLEAN)
+    {
+        cpu->page_flags[page] &= ~PAGE_CLEAN;
+        cpu->dirty_pages[page / 8] |= 1 << (page % 8);
+    }
+
+    if (DEBUGGING(cpu) && (cpu->page_flags[page] & PAGE_WATCH))
+    {
+        watch_write(cpu->debugger, cpu, address, cpu->memory[address]);
+    }
 }
 
 /*
- * Data transfer instructions.
- * Instructions that transfer data between registers or between memory and
- * registers.
+ * Stores to pages with flags, see memory_map.h. ROM drops them, MMIO hands
+ * them to its device, and a mirrored page passes them on to its copies.
  */
+static void
+write_mapped(cpu_8080_t * cpu, uint16_t address, uint8_t value)
+{
+    const memory_map_t * map = cpu->memory_map;
+    uint8_t page = address >> 8;
+    uint8_t flags = cpu->page_flags[page];
+    uint8_t alias = page;
 
-// Store Accumulator.
-static int
-stax(cpu_8080_t * cpu, uint8_t rp)
+    // Mirrored copies are watched one by one, by write_hooks().
+    if (DEBUGGING(cpu) && (flags & PAGE_WATCH) && !(flags & PAGE_MIRROR))
+    {
+        watch_write(cpu->debugger, cpu, address, value);
+    }
+
+    if (flags & PAGE_ROM)
+    {
+        return;
+    }
+
+    if (flags & PAGE_MMIO)
+    {
+        map->write[page](map->device[page], address, value);
+        return;
+    }
+
+    do
+    {
+        uint16_t copy = (alias << 8) | (address & 0xFF);
+
+        cpu->memory[copy] = value;
+        write_hooks(cpu, copy);
+        alias = map->mirror[alias];
+    } while (alias != page);
+}
+
+static inline void
+write_byte(cpu_8080_t * cpu, uint16_t address, uint8_t value)
 {
-    switch(rp)
+    uint8_t flags = cpu->page_flags[address >> 8];
+
+    if (flags & PAGE_MAPPED)
     {
-        case B:
-            {
-                uint16_t addr = (cpu->b << 8) | cpu->c;
-                cpu->memory[addr] = cpu->a;
-            }
-            break;
-        case D:
-            {
-                uint16_t addr = (cpu->d << 8) | cpu->e;
-                cpu->memory[addr] = cpu->a;
-            }
-            break;
-        default:
-            die(cpu);
+        write_mapped(cpu, address, value);
+        return;
     }
 
-    return 7;
+    cpu->memory[address] = value;
+
+    if (flags)
+    {
+        write_hooks(cpu, address);
+    }
 }
 
-/*
- * Register pair instructions.
- * Instructions which operate on a pair of registers.
- */
+static inline uint16_t
+read_word(const cpu_8080_t * cpu, uint16_t address, uint64_t cycle)
+{
+    return read_byte(cpu, address, cycle) | (read_byte(cpu, address + 1, cycle) << 8);
+}
 
-// Double add.
-static int
-dad(cpu_8080_t * cpu, uint8_t rp)
+static inline uint16_t
+fetch_word(const cpu_8080_t * cpu, uint16_t address)
+{
+    return fetch_byte(cpu, address) | (fetch_byte(cpu, address + 1) << 8);
+}
+
+static inline void
+write_word(cpu_8080_t * cpu, uint16_t address, uint16_t value)
+{
+    write_byte(cpu, address, value & 0xFF);
+    write_byte(cpu, address + 1, value >> 8);
+}
+
+static inline void
+push(cpu_8080_t * cpu, uint16_t value)
+{
+    cpu->stack_pointer -= 2;
+    write_word(cpu, cpu->stack_pointer, value);
+}
+
+static inline uint16_t
+pop(cpu_8080_t * cpu, uint64_t cycle)
 {
+    uint16_t value = read_word(cpu, cpu->stack_pointer, cycle);
+    cpu->stack_pointer += 2;
+    return value;
+}
+
+static inline void
+call(cpu_8080_t * cpu, uint16_t address, uint16_t return_address)
+{
+    push(cpu, return_address);
+    cpu->program_counter = address;
+}
 
-    uint16_t data = (cpu->h << 8) | cpu->l;
+/*
+ * Register pairs and the program status word.
+ */
 
+static inline uint16_t
+get_pair(const cpu_8080_t * cpu, uint8_t rp)
+{
     switch(rp)
     {
         case BC:
-            {
-                uint16_t tmp = (cpu->b << 8) | cpu->c;
-                data += tmp;
-            }
-            break;
+            return (cpu->b << 8) | cpu->c;
         case DE:
-            {
-                uint16_t tmp = (cpu->d << 8) | cpu->e;
-                data += tmp;
-            }
-            break;
+            return (cpu->d << 8) | cpu->e;
         case HL:
-            data += data;
-            break;
-        case SP:
-            data += cpu->stack_pointer;
-            break;
+            return (cpu->h << 8) | cpu->l;
         default:
-            die(cpu);
-            break;
+            return cpu->stack_pointer;
     }
-
-    cpu->condition_codes.cy = data > 0xFF;
-    cpu->h = (data & 0xFF00) >> 8;
-    cpu->l = data & 0xFF;
-
-    return 10;
 }
 
-// Increment register pair.
-static int
-inx(cpu_8080_t * cpu, uint8_t rp)
+static inline void
+set_pair(cpu_8080_t * cpu, uint8_t rp, uint16_t value)
 {
     switch(rp)
     {
         case BC:
-            {
-                uint16_t value = (cpu->b << 8) | cpu->c;
-                value++;
-                cpu->b = (value & 0xFF00) >> 8;
-                cpu->c = value & 0xFF;
-            }
+            cpu->b = value >> 8;
+            cpu->c = value & 0xFF;
             break;
         case DE:
-            {
-                uint16_t value = (cpu->d << 8) | cpu->e;
-                value++;
-                cpu->d = (value & 0xFF00) >> 8;
-                cpu->e = value & 0xFF;
-            }
+            cpu->d = value >> 8;
+            cpu->e = value & 0xFF;
             break;
         case HL:
-            {
-                uint16_t value = (cpu->h << 8) | cpu->l;
-                value++;
-                cpu->h = (value & 0xFF00) >> 8;
-                cpu->l = value & 0xFF;
-            }
-            break;
-        case SP:
-            {
-                uint16_t value = cpu->stack_pointer;
-                value++;
-                cpu->stack_pointer = value & 0xFFFF;
-            }
+            cpu->h = value >> 8;
+            cpu->l = value & 0xFF;
             break;
         default:
-            die(cpu);
+            cpu->stack_pointer = value;
             break;
     }
-
-    return 5;
 }
 
 /*
- * Immediate instructions.
- * Instructions that perform operations on byte(s) which are part of the
- * instruction itself.
+ * The flags byte as pushed by PUSH PSW: S Z 0 AC 0 P 1 CY.
  */
-
-// Load a register pair immediately.
-static int
-lxi(cpu_8080_t * cpu, uint8_t reg, uint8_t * opcode)
+uint8_t
+pack_condition_codes(const cpu_8080_t * cpu)
 {
-    switch(reg)
-    {
-        case B:
-            cpu->c = opcode[1];
-            cpu->b = opcode[2];
-            break;
-        case D:
-            cpu->e = opcode[1];
-            cpu->d = opcode[2];
-            break;
-        case H:
-            cpu->l = opcode[1];
-            cpu->h = opcode[2];
-            break;
-        case SP:
-            cpu->stack_pointer = ((opcode[2] << 8) | opcode[1]) & 0xFFFF;
-            break;
-        default:
-            die(cpu);
-            break;
-    }
-
-    cpu->program_counter += 2;
+    return (sign_flag(cpu) << 7) |
+           (zero_flag(cpu) << 6) |
+           (aux_carry_flag(cpu) << 4) |
+           (parity_flag(cpu) << 2) |
+           (1 << 1) |
+           carry_flag(cpu);
+}
 
-    return 10;
+void
+unpack_condition_codes(cpu_8080_t * cpu, uint8_t flags)
+{
+    cpu->condition_codes.s = (flags >> 7) & 1;
+    cpu->condition_codes.z = (flags >> 6) & 1;
+    cpu->condition_codes.ac = (flags >> 4) & 1;
+    cpu->condition_codes.p = (flags >> 2) & 1;
+    cpu->condition_codes.cy = flags & 1;
+    cpu->flag_result = (flags & 1) << 8;
+    cpu->flags_lazy = 0;
 }
 
-int
-process_instruction(cpu_8080_t * cpu)
+static inline uint16_t
+get_psw(const cpu_8080_t * cpu)
 {
-    int cycles = 0;
-    uint8_t * opcode = &cpu->memory[cpu->program_counter];
+    return (cpu->a << 8) | pack_condition_codes(cpu);
+}
 
-    cpu->program_counter++;
+static inline void
+set_psw(cpu_8080_t * cpu, uint16_t value)
+{
+    cpu->a = value >> 8;
+    unpack_condition_codes(cpu, value & 0xFF);
+}
 
-    switch(*opcode)
+// Evaluates the condition encoded in bits 3-5 of a jump, call or return.
+static inline int
+condition(const cpu_8080_t * cpu, uint8_t cc)
+{
+    switch(cc)
     {
-        case 0x00:
-        case 0x08:
-        case 0x10:
-        case 0x18:
-        case 0x20:
-        case 0x28:
-        case 0x30:
-        case 0x38:
-            return 4;
-            break;
-        case 0x01: // LXI B, D16
-            cycles = lxi(cpu, B, opcode);
-            break;
-        case 0x02:
-            cycles = stax(cpu, B);
-            break;
-        case 0x03:
-            cycles = inx(cpu, B);
-            break;
-        case 0x04:
-            cycles = inr(cpu, &cpu->b);
-            break;
-        case 0x05:
-            cycles = dcr(cpu, &cpu->b);
-            break;
-        case 0x06:
-            cpu->b = opcode[1];
-            cpu->program_counter++;
-            break;
-        case 0x07:
-            {
-                unsigned char tmp = cpu->a;
-                cpu->a = ((tmp << 1) | (tmp & 0x80) >> 7);
-                cpu->condition_codes.cy = ((tmp & 0x80) == 0x80);
-            }
-            break;
-        case 0x09:
-            {
-                unsigned int register_pair_HL = (cpu->h << 8) | (cpu->l);
-                unsigned int register_pair_BC = (cpu->b << 8) | (cpu->c);
-                register_pair_HL += register_pair_BC;
-                cpu->condition_codes.cy = (register_pair_HL > 0xff);
-                cpu->h = (register_pair_HL & 0xff00) >> 8;
-                cpu->l = register_pair_HL & 0xff;
-            }
-            break;
-        case 0x0A:
-            {
-                unsigned short int register_pair = (cpu->b << 8) | (cpu->c);
-                cpu->a = cpu->memory[register_pair];
-            }
-            break;
-        case 0x0B:
-            {
-                unsigned short int register_pair = (cpu->b << 8) | (cpu->c);
-                register_pair -= 1;
-                cpu->b = (register_pair & 0xff00) >> 8;
-                cpu->c = register_pair & 0xff;
-            }
-            break;
-        case 0x0C:
-            cycles = inr(cpu, &cpu->c);
-            break;
-        case 0x0D:
-            cycles = dcr(cpu, &cpu->c);
-            break;
-        case 0x0E:
-            cpu->c = opcode[1];
-            cpu->program_counter++;
-            break;
-        case 0x0F:
-            {
-                unsigned char x = cpu->a;
-                cpu-> a = ((x & 1) << 7 | (x >> 1));
-                cpu->condition_codes.cy = ((x & 1) == 1);
-            }
-            break;
+        case 0: return !zero_flag(cpu);
+        case 1: return zero_flag(cpu);
+        case 2: return !carry_flag(cpu);
+        case 3: return carry_flag(cpu);
+        case 4: return !parity_flag(cpu);
+        case 5: return parity_flag(cpu);
+        case 6: return !sign_flag(cpu);
+        default: return sign_flag(cpu);
+    }
+}
 
-        case 0x11:
-            cycles = lxi(cpu, D, opcode);
-            break;
-        case 0x12:
-            cycles = stax(cpu, D);
-            break;
-        case 0x13:
-            {
-                unsigned short int register_pair = (cpu->d << 8) | (cpu->e);
-                register_pair += 1;
-                cpu->d = (register_pair & 0xff00) >> 8;
-                cpu->e = register_pair & 0xff;
-            }
-            break;
-        case 0x14:
-            cycles = inr(cpu, &cpu->d);
-            break;
-        case 0x15:
-            cycles = dcr(cpu, &cpu->d);
-            break;
-        case 0x16:
-            cpu->d = opcode[1];
-            cpu->program_counter++;
-            break;
-        case 0x17:
-            {
-                unsigned char x = cpu->a;
-                cpu-> a = ((x << 1) | cpu->condition_codes.cy);
-                cpu->condition_codes.cy = ((x & 0x80) == 0x80);
-            }
-            break;
-        case 0x19:
-            {
-                unsigned int register_pair_HL = (cpu->h << 8) | (cpu->l);
-                unsigned int register_pair_DE = (cpu->d << 8) | (cpu->e);
-                register_pair_HL += register_pair_DE;
-                cpu->condition_codes.cy = (register_pair_HL > 0xff);
-                cpu->h = (register_pair_HL & 0xff00) >> 8;
-                cpu->l = register_pair_HL & 0xff;
-            }
-            break;
-        case 0x1A:
-            {
-                unsigned short int register_pair = (cpu->d << 8) | (cpu->e);
-                cpu->a = cpu->memory[register_pair];
-            }
-            break;
-        case 0x1B:
-            {
-                unsigned short int register_pair = (cpu->d << 8) | (cpu->e);
-                register_pair -= 1;
-                cpu->b = (register_pair & 0xff00) >> 8;
-                cpu->e = register_pair & 0xff;
-            }
-            break;
-        case 0x1C:
-            cycles = inr(cpu, &cpu->e);
-            break;
-        case 0x1D:
-            cycles = dcr(cpu, &cpu->e);
-            break;
-        case 0x1E:
-            cpu->e = opcode[1];
-            cpu->program_counter++;
-            break;
-        case 0x1F:
-            {
-                unsigned char x = cpu->a;
-                cpu-> a = ((cpu->condition_codes.cy << 7) | (x >> 1));
-                cpu->condition_codes.cy = ((x & 1) == 1);
-            }
-            break;
+/*
+ * I/O ports. The port bus serves the ports it maps. Without a handler, IN
+ * reads zero and OUT is discarded.
+ */
 
-        case 0x21:
-            cycles = lxi(cpu, H, opcode);
-            break;
-        case 0x22: die(cpu); break;
-        case 0x23: die(cpu); break;
-        case 0x24:
-            cycles = inr(cpu, &cpu->h);
-            break;
-        case 0x25:
-            cycles = dcr(cpu, &cpu->h);
-            break;
-        case 0x26: die(cpu); break;
-        case 0x27: die(cpu); break;
-        case 0x29: die(cpu); break;
-        case 0x2A: die(cpu); break;
-        case 0x2B: die(cpu); break;
-        case 0x2C:
-            cycles = inr(cpu, &cpu->l);
-            break;
-        case 0x2D:
-            cycles = dcr(cpu, &cpu->l);
-            break;
-        case 0x2E: die(cpu); break;
-        case 0x2F: die(cpu); break;
+static inline uint8_t
+device_in(cpu_8080_t * cpu, uint8_t port, uint64_t cycle)
+{
+    if (cpu->ports != NULL && cpu->ports->in[port].kind != PORT_UNMAPPED)
+    {
+        return bus_in(cpu->ports, port, cycle);
+    }
 
-        case 0x31:
-            cycles = lxi(cpu, SP, opcode);
-            break;
-        case 0x32: die(cpu); break;
-        case 0x33: die(cpu); break;
-        case 0x34:
-            cycles = inr_m(cpu);
-            break;
-        case 0x35:
-            cycles = dcr_m(cpu);
-            break;
-        case 0x36: die(cpu); break;
-        case 0x37: die(cpu); break;
-        case 0x39: die(cpu); break;
-        case 0x3A: die(cpu); break;
-        case 0x3B: die(cpu); break;
-        case 0x3C:
-            cycles = inr(cpu, &cpu->a);
-            break;
-        case 0x3D:
-            cycles = dcr(cpu, &cpu->a);
-            break;
-        case 0x3E: die(cpu); break;
-        case 0x3F: die(cpu); break;
+    return cpu->port_in ? cpu->port_in(cpu, port) : 0;
+}
 
-        case 0x40:
-            cpu->b = cpu->c;
-            break;
-        case 0x41:
-            cpu->b = cpu->d;
-            break;
-        case 0x42:
-            cpu->b = cpu->e;
-            break;
-        case 0x43: die(cpu); break;
-        case 0x44: die(cpu); break;
-        case 0x45: die(cpu); break;
-        case 0x46: die(cpu); break;
-        case 0x47: die(cpu); break;
-        case 0x48: die(cpu); break;
-        case 0x49: die(cpu); break;
-        case 0x4A: die(cpu); break;
-        case 0x4B: die(cpu); break;
-        case 0x4C: die(cpu); break;
-        case 0x4D: die(cpu); break;
-        case 0x4E: die(cpu); break;
-        case 0x4F: die(cpu); break;
-
-        case 0x50: die(cpu); break;
-        case 0x51: die(cpu); break;
-        case 0x52: die(cpu); break;
-        case 0x53: die(cpu); break;
-        case 0x54: die(cpu); break;
-        case 0x55: die(cpu); break;
-        case 0x56: die(cpu); break;
-        case 0x57: die(cpu); break;
-        case 0x58: die(cpu); break;
-        case 0x59: die(cpu); break;
-        case 0x5A: die(cpu); break;
-        case 0x5B: die(cpu); break;
-        case 0x5C: die(cpu); break;
-        case 0x5D: die(cpu); break;
-        case 0x5E: die(cpu); break;
-        case 0x5F: die(cpu); break;
-
-        case 0x60: die(cpu); break;
-        case 0x61: die(cpu); break;
-        case 0x62: die(cpu); break;
-        case 0x63: die(cpu); break;
-        case 0x64: die(cpu); break;
-        case 0x65: die(cpu); break;
-        case 0x66: die(cpu); break;
-        case 0x67: die(cpu); break;
-        case 0x68: die(cpu); break;
-        case 0x69: die(cpu); break;
-        case 0x6A: die(cpu); break;
-        case 0x6B: die(cpu); break;
-        case 0x6C: die(cpu); break;
-        case 0x6D: die(cpu); break;
-        case 0x6E: die(cpu); break;
-        case 0x6F: die(cpu); break;
-
-        case 0x70: die(cpu); break;
-        case 0x71: die(cpu); break;
-        case 0x72: die(cpu); break;
-        case 0x73: die(cpu); break;
-        case 0x74: die(cpu); break;
-        case 0x75: die(cpu); break;
-        case 0x76: die(cpu); break;
-        case 0x77: die(cpu); break;
-        case 0x78: die(cpu); break;
-        case 0x79: die(cpu); break;
-        case 0x7A: die(cpu); break;
-        case 0x7B: die(cpu); break;
-        case 0x7C: die(cpu); break;
-        case 0x7D: die(cpu); break;
-        case 0x7E: die(cpu); break;
-        case 0x7F: die(cpu); break;
-
-        case 0x80: die(cpu); break;
-        case 0x81: die(cpu); break;
-        case 0x82: die(cpu); break;
-        case 0x83: die(cpu); break;
-        case 0x84: die(cpu); break;
-        case 0x85: die(cpu); break;
-        case 0x86: die(cpu); break;
-        case 0x87: die(cpu); break;
-        case 0x88: die(cpu); break;
-        case 0x89: die(cpu); break;
-        case 0x8A: die(cpu); break;
-        case 0x8B: die(cpu); break;
-        case 0x8C: die(cpu); break;
-        case 0x8D: die(cpu); break;
-        case 0x8E: die(cpu); break;
-        case 0x8F: die(cpu); break;
-
-        case 0x90: die(cpu); break;
-        case 0x91: die(cpu); break;
-        case 0x92: die(cpu); break;
-        case 0x93: die(cpu); break;
-        case 0x94: die(cpu); break;
-        case 0x95: die(cpu); break;
-        case 0x96: die(cpu); break;
-        case 0x97: die(cpu); break;
-        case 0x98: die(cpu); break;
-        case 0x99: die(cpu); break;
-        case 0x9A: die(cpu); break;
-        case 0x9B: die(cpu); break;
-        case 0x9C: die(cpu); break;
-        case 0x9D: die(cpu); break;
-        case 0x9E: die(cpu); break;
-        case 0x9F: die(cpu); break;
-
-        case 0xA0: die(cpu); break;
-        case 0xA1: die(cpu); break;
-        case 0xA2: die(cpu); break;
-        case 0xA3: die(cpu); break;
-        case 0xA4: die(cpu); break;
-        case 0xA5: die(cpu); break;
-        case 0xA6: die(cpu); break;
-        case 0xA7: die(cpu); break;
-        case 0xA8: die(cpu); break;
-        case 0xA9: die(cpu); break;
-        case 0xAA: die(cpu); break;
-        case 0xAB: die(cpu); break;
-        case 0xAC: die(cpu); break;
-        case 0xAD: die(cpu); break;
-        case 0xAE: die(cpu); break;
-        case 0xAF: die(cpu); break;
-
-        case 0xB0: die(cpu); break;
-        case 0xB1: die(cpu); break;
-        case 0xB2: die(cpu); break;
-        case 0xB3: die(cpu); break;
-        case 0xB4: die(cpu); break;
-        case 0xB5: die(cpu); break;
-        case 0xB6: die(cpu); break;
-        case 0xB7: die(cpu); break;
-        case 0xB8: die(cpu); break;
-        case 0xB9: die(cpu); break;
-        case 0xBA: die(cpu); break;
-        case 0xBB: die(cpu); break;
-        case 0xBC: die(cpu); break;
-        case 0xBD: die(cpu); break;
-        case 0xBE: die(cpu); break;
-        case 0xBF: die(cpu); break;
-
-        case 0xC0: die(cpu); break;
-        case 0xC1: die(cpu); break;
-        case 0xC2: die(cpu); break;
-        case 0xC3: die(cpu); break;
-        case 0xC4: die(cpu); break;
-        case 0xC5: die(cpu); break;
-        case 0xC6: die(cpu); break;
-        case 0xC7: die(cpu); break;
-        case 0xC8: die(cpu); break;
-        case 0xC9: die(cpu); break;
-        case 0xCA: die(cpu); break;
-        case 0xCB: die(cpu); break;
-        case 0xCC: die(cpu); break;
-        case 0xCD: die(cpu); break;
-        case 0xCE: die(cpu); break;
-        case 0xCF: die(cpu); break;
-
-        case 0xD0: die(cpu); break;
-        case 0xD1: die(cpu); break;
-        case 0xD2: die(cpu); break;
-        case 0xD3: die(cpu); break;
-        case 0xD4: die(cpu); break;
-        case 0xD5: die(cpu); break;
-        case 0xD6: die(cpu); break;
-        case 0xD7: die(cpu); break;
-        case 0xD8: die(cpu); break;
-        case 0xD9: die(cpu); break;
-        case 0xDA: die(cpu); break;
-        case 0xDB: die(cpu); break;
-        case 0xDC: die(cpu); break;
-        case 0xDD: die(cpu); break;
-        case 0xDE: die(cpu); break;
-        case 0xDF: die(cpu); break;
-
-        case 0xE0: die(cpu); break;
-        case 0xE1: die(cpu); break;
-        case 0xE2: die(cpu); break;
-        case 0xE3: die(cpu); break;
-        case 0xE4: die(cpu); break;
-        case 0xE5: die(cpu); break;
-        case 0xE6: die(cpu); break;
-        case 0xE7: die(cpu); break;
-        case 0xE8: die(cpu); break;
-        case 0xE9: die(cpu); break;
-        case 0xEA: die(cpu); break;
-        case 0xEB: die(cpu); break;
-        case 0xEC: die(cpu); break;
-        case 0xED: die(cpu); break;
-        case 0xEE: die(cpu); break;
-        case 0xEF: die(cpu); break;
-
-        case 0xF0: die(cpu); break;
-        case 0xF1: die(cpu); break;
-        case 0xF2: die(cpu); break;
-        case 0xF3: die(cpu); break;
-        case 0xF4: die(cpu); break;
-        case 0xF5: die(cpu); break;
-        case 0xF6: die(cpu); break;
-        case 0xF7: die(cpu); break;
-        case 0xF8: die(cpu); break;
-        case 0xF9: die(cpu); break;
-        case 0xFA: die(cpu); break;
-        case 0xFB: die(cpu); break;
-        case 0xFC: die(cpu); break;
-        case 0xFD: die(cpu); break;
-        case 0xFE: die(cpu); break;
-        case 0xFF: die(cpu); break;
+// IN while being recorded or played back, see replay.h.
+static uint8_t
+replayed_in(cpu_8080_t * cpu, uint8_t port, uint64_t cycle)
+{
+    if (cpu->replay->state == REPLAY_PLAYING)
+    {
+        return play_input(cpu->replay, cycle, port);
     }
 
-    return cycles;
-}
+    uint8_t value = device_in(cpu, port, cycle);
+    record_input(cpu->replay, cycle, port, value);
 
-#define MAX_RAM_SIZE 0x10000 // 16 kB
+    return value;
+}
 
-void
-load_rom_to_memory(cpu_8080_t * cpu, const char * filename)
+static inline uint8_t
+port_in(cpu_8080_t * cpu, uint8_t port, uint64_t cycle)
 {
-    FILE * fp = fopen(filename, "rb");
-    if (fp == NULL)
+    if (cpu->replay != NULL)
     {
-        fprintf(stderr, "Could not open the 8080 ROM %s.\n", filename);
-        exit(1);
+        return replayed_in(cpu, port, cycle);
     }
 
-    fseek(fp, 0L, SEEK_END);
-    int fsize = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-
-    unsigned char * buffer = &cpu->memory[0];
-    fread(buffer, fsize, 1, fp);
-    fclose(fp);
+    return device_in(cpu, port, cycle);
 }
 
-int
-main(int argc, const char * argv[])
+static inline void
+port_out(cpu_8080_t * cpu, uint8_t port, uint8_t value, uint64_t cycle)
 {
-    if (argc < 2)
+    if (cpu->ports != NULL && cpu->ports->out[port].kind != PORT_UNMAPPED)
     {
-        fprintf(stderr, "Please supply an 8080 ROM.\n");
-        return 1;
+        bus_out(cpu->ports, port, value, cycle);
+    }
+    else if (cpu->port_out)
+    {
+        cpu->port_out(cpu, port, value);
     }
+}
+
+/*
+ * Single register instructions.
+ */
+
+// Increment register or memory. The carry is left alone.
+static inline uint8_t
+inr(cpu_8080_t * cpu, uint8_t value)
+{
+    uint8_t result = value + 1;
+    set_result_flags(cpu, result | (cpu->flag_result & 0x100), value ^ 1 ^ result);
+    return result;
+}
 
-    cpu_8080_t * cpu = calloc(1, sizeof(cpu_8080_t));
-    cpu->memory = malloc(MAX_RAM_SIZE);
+// Decrement register or memory. The carry is left alone.
+static inline uint8_t
+dcr(cpu_8080_t * cpu, uint8_t value)
+{
+    uint8_t result = value - 1;
+    set_result_flags(cpu, result | (cpu->flag_result & 0x100), ~(value ^ 1 ^ result));
+    return result;
+}
 
-    load_rom_to_memory(cpu, argv[1]);
+// Decimal adjust accumulator.
+static inline void
+daa(cpu_8080_t * cpu)
+{
+    uint8_t correction = 0;
+    uint8_t carry = carry_flag(cpu);
+    uint8_t lsb = cpu->a & 0xF;
+    uint8_t msb = cpu->a >> 4;
 
-    for(;;)
+    if (aux_carry_flag(cpu) || lsb > 9)
     {
-        process_instruction(cpu);
+        correction += 0x06;
     }
 
-    free(cpu->memory);
-    free(cpu);
+    if (carry || msb > 9 || (msb >= 9 && lsb > 9))
+    {
+        correction += 0x60;
+        carry = 1;
+    }
 
-    return 0;
+    uint8_t result = cpu->a + correction;
+    set_result_flags(cpu, result | (carry << 8), cpu->a ^ correction ^ result);
+    cpu->a = result;
 }
+
+/*
+ * Register or memory to accumulator instructions.
+ *
+ * Bit 4 of a ^ value ^ result is the carry (or borrow) into bit 4. The 8080
+ * sets the auxiliary carry on subtraction when no borrow is taken, hence
+ * the complement.
+ */
+
+static inline void
+add(cpu_8080_t * cpu, uint8_t value, uint8_t carry)
+{
+    uint16_t result = cpu->a + value + carry;
+    set_result_flags(cpu, result, cpu->a ^ value ^ result);
+    cpu->a = result & 0xFF;
+}
+
+static inline void
+sub(cpu_8080_t * cpu, uint8_t value, uint8_t borrow)
+{
+    uint16_t result = (cpu->a - value - borrow) & 0x1FF;
+    set_result_flags(cpu, result, ~(cpu->a ^ value ^ result));
+    cpu->a = result & 0xFF;
+}
+
+static inline void
+cmp(cpu_8080_t * cpu, uint8_t value)
+{
+    uint16_t result = (cpu->a - value) & 0x1FF;
+    set_result_flags(cpu, result, ~(cpu->a ^ value ^ result));
+}
+
+static inline void
+ana(cpu_8080_t * cpu, uint8_t value)
+{
+    set_result_flags(cpu, cpu->a & value, (cpu->a | value) << 1);
+    cpu->a &= value;
+}
+
+static inline void
+xra(cpu_8080_t * cpu, uint8_t value)
+{
+    cpu->a ^= value;
+    set_result_flags(cpu, cpu->a, 0);
+}
+
+static inline void
+ora(cpu_8080_t * cpu, uint8_t value)
+{
+    cpu->a |= value;
+    set_result_flags(cpu, cpu->a, 0);
+}
+
+/*
+ * Rotate accumulator instructions.
+ */
+
+static inline void
+rlc(cpu_8080_t * cpu)
+{
+    set_carry_flag(cpu, cpu->a >> 7);
+    cpu->a = (cpu->a << 1) | (cpu->a >> 7);
+}
+
+static inline void
+rrc(cpu_8080_t * cpu)
+{
+    set_carry_flag(cpu, cpu->a & 1);
+    cpu->a = (cpu->a >> 1) | (cpu->a << 7);
+}
+
+static inline void
+ral(cpu_8080_t * cpu)
+{
+    uint8_t carry = carry_flag(cpu);
+    set_carry_flag(cpu, cpu->a >> 7);
+    cpu->a = (cpu->a << 1) | carry;
+}
+
+static inline void
+rar(cpu_8080_t * cpu)
+{
+    uint8_t carry = carry_flag(cpu);
+    set_carry_flag(cpu, cpu->a & 1);
+    cpu->a = (cpu->a >> 1) | (carry << 7);
+}
+
+/*
+ * Register pair instructions.
+ */
+
+// Double add.
+static inline void
+dad(cpu_8080_t * cpu, uint16_t value)
+{
+    uint32_t result = get_pair(cpu, HL) + value;
+    set_carry_flag(cpu, result > 0xFFFF);
+    set_pair(cpu, HL, result & 0xFFFF);
+}
+
+/*
+ * Tracing, see trace.h, profiling, see profile.h, and debugging, see
+ * debugger.h. Built without EMULATOR_8080_TRACE, EMULATOR_8080_PROFILE or
+ * EMULATOR_8080_DEBUG, TRACING(), PROFILING() or DEBUGGING() is always
+ * false and the interpreter has no code for it. Only the interpreter
+ * watches instructions: process_blocks() hands such a CPU over to it.
+ */
+
+// Hooks are inlined into every opcode body, as a call there costs more
+// than the hook itself.
+#if defined(__GNUC__)
+#define HOOK_INLINE __attribute__((always_inline)) inline
+#else
+#define HOOK_INLINE inline
+#endif
+
+#ifdef EMULATOR_8080_TRACE
+#define TRACING(cpu) ((cpu)->trace != NULL)
+
+static HOOK_INLINE void
+trace_instruction(cpu_8080_t * cpu, uint64_t cycle, uint16_t address,
+                  uint8_t opcode, uint16_t operand)
+{
+    trace_record_t * record = trace_record(cpu->trace);
+
+    record->cycle = cycle;
+    record->address = address;
+    record->code[0] = opcode;
+    record->code[1] = operand & 0xFF;
+    record->code[2] = operand >> 8;
+
+    // The flags are left lazy for read_trace() to work out.
+    record->flags = cpu->flags_lazy ? cpu->flag_result & 0xFF : pack_condition_codes(cpu);
+    record->lazy = cpu->flags_lazy << 7 | (cpu->flag_aux & 0x10) | ((cpu->flag_result >> 8) & 1);
+    record->a = cpu->a;
+    record->b = cpu->b;
+    record->c = cpu->c;
+    record->d = cpu->d;
+    record->e = cpu->e;
+    record->h = cpu->h;
+    record->l = cpu->l;
+    record->stack_pointer = cpu->stack_pointer;
+}
+#else
+#define TRACING(cpu) 0
+#endif
+
+#ifdef EMULATOR_8080_PROFILE
+#define PROFILING(cpu) ((cpu)->profile != NULL)
+
+static HOOK_INLINE void
+profile_hook(cpu_8080_t * cpu, uint64_t cycle, uint16_t address, uint8_t opcode)
+{
+    profile_instruction(cpu->profile, cycle, address, opcode, cpu->stack_pointer);
+}
+#else
+#define PROFILING(cpu) 0
+#endif
+
+/*
+ * The dispatch loop. GCC and Clang get a threaded interpreter that jumps
+ * straight from one opcode body to the next through a table of label
+ * addresses; everything else gets the portable switch. Define
+ * EMULATOR_8080_PORTABLE_DISPATCH to force the switch.
+ */
+#if defined(__GNUC__) && !defined(EMULATOR_8080_PORTABLE_DISPATCH)
+#define COMPUTED_GOTO 1
+#endif
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// Label addresses of the opcode bodies in execute.inc.
+#define DISPATCH_LABELS                                                                         \
+    &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,     \
+    &&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B, &&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,     \
+    &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,     \
+    &&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B, &&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,     \
+    &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,     \
+    &&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B, &&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,     \
+    &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,     \
+    &&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B, &&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,     \
+    &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,     \
+    &&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B, &&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,     \
+    &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,     \
+    &&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B, &&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,     \
+    &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,     \
+    &&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B, &&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,     \
+    &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,     \
+    &&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B, &&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,     \
+    &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,     \
+    &&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B, &&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,     \
+    &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,     \
+    &&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B, &&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,     \
+    &&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3, &&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,     \
+    &&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB, &&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,     \
+    &&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3, &&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,     \
+    &&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB, &&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,     \
+    &&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3, &&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,     \
+    &&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB, &&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,     \
+    &&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_0xD3, &&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,     \
+    &&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_0xDB, &&op_0xDC, &&op_0xDD, &&op_0xDE, &&op_0xDF,     \
+    &&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_0xE3, &&op_0xE4, &&op_0xE5, &&op_0xE6, &&op_0xE7,     \
+    &&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_0xEB, &&op_0xEC, &&op_0xED, &&op_0xEE, &&op_0xEF,     \
+    &&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3, &&op_0xF4, &&op_0xF5, &&op_0xF6, &&op_0xF7,     \
+    &&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB, &&op_0xFC, &&op_0xFD, &&op_0xFE, &&op_0xFF,
+#endif
+
+/*
+ * The interpreter. Fetches and decodes straight from memory, checking the
+ * budget after every instruction. Leaves adding up cpu->cycles and taking
+ * interrupts to the caller.
+ */
+
+// Operands of the current instruction; the program counter is past the opcode.
+#define IMM8    fetch_byte(cpu, cpu->program_counter)
+#define IMM16   fetch_word(cpu, cpu->program_counter)
+#define SKIP(n) (cpu->program_counter += (n))
+// The cycle the current instruction started on.
+#define NOW     (cpu->cycles + cycles)
+
+#ifdef EMULATOR_8080_TRACE
+#define TRACE_FETCH()                                                           \
+    (TRACING(cpu) ? trace_instruction(cpu, cpu->cycles + cycles,                \
+                                      cpu->program_counter,                     \
+                                      fetch_byte(cpu, cpu->program_counter),    \
+                                      fetch_word(cpu, cpu->program_counter + 1)) \
+                  : (void)0)
+#else
+#define TRACE_FETCH() ((void)0)
+#endif
+#ifdef EMULATOR_8080_PROFILE
+#define PROFILE_FETCH()                                                         \
+    (PROFILING(cpu) ? profile_hook(cpu, cpu->cycles + cycles,                   \
+                                   cpu->program_counter,                        \
+                                   fetch_byte(cpu, cpu->program_counter))       \
+                    : (void)0)
+#else
+#define PROFILE_FETCH() ((void)0)
+#endif
+#ifdef EMULATOR_8080_DEBUG
+#define DEBUG_CHECK()                                                           \
+    do                                                                          \
+    {                                                                           \
+        if (DEBUGGING(cpu) && debug_instruction(cpu, cpu->cycles + cycles))     \
+        {                                                                       \
+            goto done;                                                          \
+        }                                                                       \
+    } while (0)
+#else
+#define DEBUG_CHECK() ((void)0)
+#endif
+#define FETCH() (TRACE_FETCH(), PROFILE_FETCH(), opcode = fetch_byte(cpu, cpu->program_counter++))
+#define STOP()                                  \
+    do                                          \
+    {                                           \
+        cycles += opcode_table[opcode].cycles;  \
+        goto done;                              \
+    } while (0)
+
+#ifdef COMPUTED_GOTO
+#define OPCODE(op) op_##op:
+#define BEGIN_DISPATCH() DEBUG_CHECK(); FETCH(); goto *dispatch_table[opcode];
+#define END_DISPATCH()
+#define NEXT()                                  \
+    do                                          \
+    {                                           \
+        cycles += opcode_table[opcode].cycles;  \
+        if (cycles >= cycle_budget)             \
+        {                                       \
+            goto done;                          \
+        }                                       \
+        DEBUG_CHECK();                          \
+        FETCH();                                \
+        goto *dispatch_table[opcode];           \
+    } while (0)
+#else
+#define OPCODE(op) case op:
+#define BEGIN_DISPATCH() for (;;) { DEBUG_CHECK(); FETCH(); switch(opcode) {
+#define END_DISPATCH() } }
+#define NEXT()                                  \
+    {                                           \
+        cycles += opcode_table[opcode].cycles;  \
+        if (cycles >= cycle_budget)             \
+        {                                       \
+            goto done;                          \
+        }                                       \
+        continue;                               \
+    }
+#endif
+
+static uint64_t
+run_instructions(cpu_8080_t * cpu, uint64_t cycle_budget)
+{
+    uint64_t cycles = 0;
+    uint8_t opcode;
+
+#ifdef COMPUTED_GOTO
+    static const void * const dispatch_table[] = { DISPATCH_LABELS };
+#endif
+
+    if (cpu->halted)
+    {
+        return 0;
+    }
+
+    BEGIN_DISPATCH()
+#include "execute.inc"
+
+    END_DISPATCH()
+
+done:
+    return cycles;
+}
+
+#undef IMM8
+#undef IMM16
+#undef FETCH
+#undef TRACE_FETCH
+#undef PROFILE_FETCH
+#undef DEBUG_CHECK
+#undef STOP
+#undef OPCODE
+#undef BEGIN_DISPATCH
+#undef END_DISPATCH
+#undef NEXT
+
+/*
+ * Raises the interrupt line with an RST 0-7 for the CPU to run when it
+ * takes the interrupt. A later interrupt raised before then replaces it.
+ */
+void
+raise_interrupt(cpu_8080_t * cpu, uint8_t vector)
+{
+    // Played back, interrupts come from the recording.
+    if (cpu->replay != NULL && cpu->replay->state == REPLAY_PLAYING)
+    {
+        return;
+    }
+
+    cpu->interrupt_pending = 1;
+    cpu->interrupt_vector = vector & 7;
+}
+
+/*
+ * Takes a raised interrupt if interrupts are on, running its RST and
+ * waking a halted CPU. After EI, which leaves the dispatch loop, the next
+ * instruction is run here first, so that EI; RET returns before another
+ * interrupt comes in. Adds the cycles spent to cpu->cycles and returns
+ * them.
+ */
+static uint64_t
+poll_interrupt(cpu_8080_t * cpu)
+{
+    uint64_t cycles = 0;
+
+    if (cpu->interrupt_enabled == INTERRUPTS_AFTER_NEXT)
+    {
+        if (!cpu->interrupt_pending)
+        {
+            cpu->interrupt_enabled = INTERRUPTS_ON;
+            return 0;
+        }
+
+        // Interrupts stay off for that instruction unless it is DI, or EI
+        // again.
+        uint8_t opcode = cpu->memory[cpu->program_counter];
+
+        cpu->interrupt_enabled = INTERRUPTS_OFF;
+        cycles = run_instructions(cpu, 1);
+        cpu->cycles += cycles;
+        if (opcode != 0xF3 && cpu->interrupt_enabled == INTERRUPTS_OFF)
+        {
+            cpu->interrupt_enabled = INTERRUPTS_ON;
+        }
+    }
+
+    if (cpu->interrupt_pending && cpu->interrupt_enabled == INTERRUPTS_ON)
+    {
+        uint8_t rst = 0xC7 | cpu->interrupt_vector << 3;
+
+#ifdef EMULATOR_8080_TRACE
+        if (TRACING(cpu))
+        {
+            trace_instruction(cpu, cpu->cycles, cpu->program_counter, rst, 0);
+        }
+#endif
+#ifdef EMULATOR_8080_PROFILE
+        if (PROFILING(cpu))
+        {
+            profile_hook(cpu, cpu->cycles, cpu->program_counter, rst);
+        }
+#endif
+
+        if (cpu->replay != NULL)
+        {
+            record_interrupt(cpu->replay, cpu->cycles, cpu->interrupt_vector);
+        }
+
+        cpu->interrupt_pending = 0;
+        cpu->interrupt_enabled = INTERRUPTS_OFF;
+        cpu->halted = 0;
+        call(cpu, cpu->interrupt_vector * 8, cpu->program_counter);
+        cycles += opcode_table[rst].cycles;
+        cpu->cycles += opcode_table[rst].cycles;
+    }
+
+    return cycles;
+}
+
+// Takes a keyframe of a machine being recorded once it is due.
+static inline void
+poll_keyframe(cpu_8080_t * cpu)
+{
+    if (cpu->replay != NULL && cpu->cycles >= cpu->replay->next_keyframe)
+    {
+        take_keyframe(cpu->replay, cpu);
+    }
+}
+
+uint64_t
+process_instructions(cpu_8080_t * cpu, uint64_t cycle_budget)
+{
+    poll_keyframe(cpu);
+
+    uint64_t cycles = poll_interrupt(cpu);
+
+    if (cycles < cycle_budget)
+    {
+        uint64_t run = run_instructions(cpu, cycle_budget - cycles);
+
+        cpu->cycles += run;
+        cycles += run;
+    }
+
+    return cycles;
+}
+
+/*
+ * The block executor. Runs pre-decoded blocks out of the block cache and
+ * only checks the budget between blocks. A store that invalidates the block
+ * being run turns its remaining micro-ops into BLOCK_EXIT. With a JIT, hot
+ * blocks run as native code and the executor picks up wherever that stops.
+ */
+
+#define IMM8    (uop->operand & 0xFF)
+#define IMM16   (uop->operand)
+
+#define DECODE()                                \
+    do                                          \
+    {                                           \
+        opcode = uop->opcode;                   \
+        cpu->program_counter = uop->address + 1;\
+    } while (0)
+#define STOP()                                  \
+    do                                          \
+    {                                           \
+        cycles += opcode_table[opcode].cycles;  \
+        goto done;                              \
+    } while (0)
+
+#ifdef COMPUTED_GOTO
+#define OPCODE(op) op_##op:
+#define BEGIN_DISPATCH() DECODE(); goto *dispatch_table[opcode];
+#define END_DISPATCH()
+#define NEXT()                                  \
+    do                                          \
+    {                                           \
+        cycles += opcode_table[opcode].cycles;  \
+        if (++uop == end)                       \
+        {                                       \
+            goto block_done;                    \
+        }                                       \
+        DECODE();                               \
+        goto *dispatch_table[opcode];           \
+    } while (0)
+#else
+#define OPCODE(op) case op:
+#define BEGIN_DISPATCH() for (;;) { DECODE(); switch(opcode) {
+#define END_DISPATCH() } }
+#define NEXT()                                  \
+    {                                           \
+        cycles += opcode_table[opcode].cycles;  \
+        if (++uop == end)                       \
+        {                                       \
+            goto block_done;                    \
+        }                                       \
+        continue;                               \
+    }
+#endif
+
+uint64_t
+process_blocks(cpu_8080_t * cpu, uint64_t cycle_budget)
+{
+    block_cache_t * cache = cpu->block_cache;
+    const micro_op_t * uop;
+    const micro_op_t * end;
+    uint64_t spent = 0;   // already in cpu->cycles
+    uint64_t cycles = 0;  // since then
+    uint16_t opcode;
+
+#ifdef COMPUTED_GOTO
+    static const void * const dispatch_table[] = {
+        DISPATCH_LABELS
+        &&op_BLOCK_EXIT
+    };
+#endif
+
+    if (cache == NULL || TRACING(cpu) || PROFILING(cpu) || DEBUGGING(cpu))
+    {
+        return process_instructions(cpu, cycle_budget);
+    }
+
+    poll_keyframe(cpu);
+
+    while (spent + cycles < cycle_budget)
+    {
+        // cpu->cycles is brought up to date between blocks, for the poll
+        // and for the ports.
+        cpu->cycles += cycles;
+        spent += cycles;
+        cycles = 0;
+
+        spent += poll_interrupt(cpu);
+        if (spent >= cycle_budget || cpu->halted)
+        {
+            break;
+        }
+
+        block_t * block = cache->lookup[cpu->program_counter];
+        if (block == NULL)
+        {
+            block = translate_block(cpu, cpu->program_counter);
+        }
+
+        uop = block->ops;
+        end = uop + block->count;
+
+        if (block->native == NULL && cache->jit != NULL &&
+            ++block->hits == JIT_THRESHOLD &&
+            compile_block(cache->jit, block) < 0)
+        {
+            drop_native_code(cache);
+            compile_block(cache->jit, block);
+        }
+
+        if (block->native != NULL)
+        {
+            uint32_t result = run_native_block(cpu, block);
+            cycles += result >> 8;
+            uop += result & 0xFF;
+
+            if (uop == end)
+            {
+                continue;
+            }
+        }
+
+        BEGIN_DISPATCH()
+#include "execute.inc"
+
+        OPCODE(BLOCK_EXIT)
+            cpu->program_counter = uop->address;
+            goto block_done;
+        END_DISPATCH()
+
+block_done:
+        ;
+    }
+
+done:
+    cpu->cycles += cycles;
+    return spent + cycles;
+}
+
+#undef IMM8
+#undef IMM16
+#undef SKIP
+#undef NOW
+#undef DECODE
+#undef STOP
+#undef OPCODE
+#undef BEGIN_DISPATCH
+#undef END_DISPATCH
+#undef NEXT
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+int
+process_instruction(cpu_8080_t * cpu)
+{
+    // Every instruction takes at least four states, so this runs exactly
+    // one, or takes a raised interrupt.
+    return (int)process_instructions(cpu, 1);
+}
+
+/*
+ * Copies a ROM file into the machine's memory at origin. Returns ROM_OK, or
+ * the reason it could not be loaded, leaving memory untouched.
+ */
+int
+load_rom_to_memory(cpu_8080_t * cpu, const char * filename, uint16_t origin)
+{
+    rom_t rom;
+    rom_status_t status = open_rom(&rom, filename);
+
+    if (status != ROM_OK)
+    {
+        return status;
+    }
+
+    if (rom.size > 0x10000u - origin)
+    {
+        close_rom(&rom);
+        return ROM_TOO_LARGE;
+    }
+
+    memcpy(cpu->memory + origin, rom.data, rom.size);
+    close_rom(&rom);
+
+    return ROM_OK;
+}
+
+/*
+ * The command line emulator. EMULATOR_8080_NO_MAIN leaves it out, to link
+ * the emulator into another program, as the tests do.
+ */
+#ifndef EMULATOR_8080_NO_MAIN
+
+static void
+report(fleet_job_t * job, void * context)
+{
+    int * failures = context;
+
+    printf("%s", (const char *)job->user);
+    if (job->seed)
+    {
+        printf(" seed %llu", (unsigned long long)job->seed);
+    }
+
+    printf(": %s after %llu cycles in %.3f s, PC 0x%04x\n",
+           fleet_status_name(job->status), (unsigned long long)job->cycles,
+           job->seconds, job->cpu.program_counter);
+    fflush(stdout);
+
+    *failures += job->status != FLEET_HALTED;
+}
+
+static int
+write_profile(const profile_t * profile, const char * filename,
+              int (*write)(const profile_t * profile, FILE * file))
+{
+    FILE * file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    int failed = write(profile, file) != 0;
+    failed |= fclose(file) != 0;
+
+    return failed ? -1 : 0;
+}
+
+// Plays a recording back to cycle and says where the machine got to.
+// Returns 0 if it went as recorded.
+static int
+play_back(const char * filename, uint64_t cycle)
+{
+    replay_t * replay = load_replay(filename);
+    if (replay == NULL)
+    {
+        fprintf(stderr, "Could not read the recording %s.\n", filename);
+        return -1;
+    }
+
+    cpu_8080_t cpu;
+    memset(&cpu, 0, sizeof(cpu));
+    cpu.memory = calloc(1, 0x10000);
+    cpu.block_cache = create_block_cache();
+
+    if (cpu.memory == NULL || cpu.block_cache == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    cpu.block_cache->jit = create_jit();
+
+    int status = seek_replay(replay, &cpu, cycle);
+
+    printf("%s: %s at %llu cycles of %llu, PC 0x%04x\n", filename,
+           status == 0 ? "played back" : "diverged",
+           (unsigned long long)cpu.cycles, (unsigned long long)replay->end,
+           cpu.program_counter);
+
+    free_block_cache(cpu.block_cache);
+    free(cpu.memory);
+    free_replay(replay);
+
+    return status;
+}
+
+// Adds a point given as ADDR[+SIZE][:CONDITION], creating the debugger on
+// the first. Returns 0, or -1 if it does not parse.
+static int
+add_option_point(debugger_t ** debugger, int kinds, const char * text)
+{
+    char * end;
+    unsigned long first = strtoul(text, &end, 0);
+    unsigned long size = 1;
+
+    if (end == text || first > 0xffff)
+    {
+        return -1;
+    }
+
+    if (*end == '+')
+    {
+        text = end + 1;
+        size = strtoul(text, &end, 0);
+        if (end == text || size == 0 || size > 0x10000 - first)
+        {
+            return -1;
+        }
+    }
+
+    if (*end != '\0' && *end != ':')
+    {
+        return -1;
+    }
+
+    if (*debugger == NULL && (*debugger = create_debugger()) == NULL)
+    {
+        return -1;
+    }
+
+    return add_point(*debugger, kinds, first, first + size - 1,
+                     *end == ':' ? end + 1 : NULL) < 0 ? -1 : 0;
+}
+
+/*
+ * Runs each ROM, or each ROM under seeds 1 to n, on every core and reports
+ * how each machine finished. Exits non-zero unless they all halted. With
+ * -T, a single machine is traced to the file given, see trace.h. With -P
+ * or -F, a single machine is profiled, see profile.h, sampling every
+ * instruction or one every -p, and the report or the folded stacks are
+ * written to the files given. With -R, a single machine is recorded, with
+ * a keyframe every -K cycles, see replay.h. -r plays a recording back, to
+ * cycle -c or its end. -b, -w and -W stop a single machine at a breakpoint,
+ * or on a write or a read of the bytes given, if a condition holds, see
+ * debugger.h.
+ */
+int
+main(int argc, char * argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seeds = 0;
+    uint64_t cycle_budget = 0;
+    double timeout = 0;
+    const char * trace_file = NULL;
+    trace_t * trace = NULL;
+    const char * report_file = NULL;
+    const char * stacks_file = NULL;
+    uint32_t period = 1;
+    profile_t * profile = NULL;
+    const char * record_file = NULL;
+    const char * play_file = NULL;
+    uint64_t interval = 0;
+    replay_t * replay = NULL;
+    debugger_t * debugger = NULL;
+    int option;
+
+    while ((option = getopt(argc, argv, "j:n:c:t:T:P:F:p:R:K:r:b:w:W:")) != -1)
+    {
+        switch(option)
+        {
+            case 'j': threads = atoi(optarg); break;
+            case 'n': seeds = strtoull(optarg, NULL, 0); break;
+            case 'c': cycle_budget = strtoull(optarg, NULL, 0); break;
+            case 't': timeout = strtod(optarg, NULL); break;
+            case 'T': trace_file = optarg; break;
+            case 'P': report_file = optarg; break;
+            case 'F': stacks_file = optarg; break;
+            case 'p': period = strtoul(optarg, NULL, 0); break;
+            case 'R': record_file = optarg; break;
+            case 'K': interval = strtoull(optarg, NULL, 0); break;
+            case 'r': play_file = optarg; break;
+            case 'b': case 'w': case 'W':
+                if (add_option_point(&debugger, option == 'b' ? DEBUG_BREAK :
+                                     option == 'w' ? DEBUG_WRITE : DEBUG_READ, optarg) != 0)
+                {
+                    fprintf(stderr, "Could not add the point %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            default: optind = argc + 1; break;
+        }
+    }
+
+    int watched = trace_file != NULL || report_file != NULL || stacks_file != NULL ||
+                  record_file != NULL || debugger != NULL;
+
+    if (play_file != NULL && optind == argc && !watched)
+    {
+        return play_back(play_file, cycle_budget ? cycle_budget : UINT64_MAX) != 0;
+    }
+
+    if (optind >= argc || play_file != NULL ||
+        (watched && (seeds > 1 || optind != argc - 1)))
+    {
+        fprintf(stderr, "usage: %s [-j threads] [-n seeds] [-c cycles] [-t seconds] rom...\n"
+                        "       %s [-T trace] [-P report] [-F stacks] [-p period] [-R recording] [-K interval]\n"
+                        "              [-b addr[:condition]] [-w addr[+size][:condition]] [-W addr[+size][:condition]]\n"
+                        "              [-n 1] [-c cycles] [-t seconds] rom\n"
+                        "       %s -r recording [-c cycle]\n",
+                argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    if (trace_file != NULL)
+    {
+#ifdef EMULATOR_8080_TRACE
+        trace = open_trace(trace_file);
+        if (trace == NULL)
+        {
+            fprintf(stderr, "Could not create the trace %s.\n", trace_file);
+            return 1;
+        }
+#else
+        fprintf(stderr, "This emulator was built without EMULATOR_8080_TRACE.\n");
+        return 1;
+#endif
+    }
+
+    if (report_file != NULL || stacks_file != NULL)
+    {
+#ifdef EMULATOR_8080_PROFILE
+        profile = create_profile(period);
+        if (profile == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            return 1;
+        }
+#else
+        (void)period;
+        fprintf(stderr, "This emulator was built without EMULATOR_8080_PROFILE.\n");
+        return 1;
+#endif
+    }
+
+#ifndef EMULATOR_8080_DEBUG
+    if (debugger != NULL)
+    {
+        fprintf(stderr, "This emulator was built without EMULATOR_8080_DEBUG.\n");
+        return 1;
+    }
+#endif
+
+    if (record_file != NULL)
+    {
+        replay = create_replay(interval);
+        if (replay == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            return 1;
+        }
+    }
+
+    int roms = argc - optind;
+    size_t per_rom = seeds ? seeds : 1;
+    fleet_job_t * jobs = calloc(roms * per_rom, sizeof(fleet_job_t));
+    int failures = 0;
+
+    if (jobs == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    for (int rom = 0; rom < roms; rom++)
+    {
+        // Each machine maps the file for itself; this only checks it first.
+        rom_t image;
+        rom_status_t status = open_rom(&image, argv[optind + rom]);
+        if (status != ROM_OK)
+        {
+            fprintf(stderr, "The 8080 ROM %s %s.\n", argv[optind + rom],
+                    rom_status_name(status));
+            return 1;
+        }
+
+        close_rom(&image);
+
+        for (size_t i = 0; i < per_rom; i++)
+        {
+            fleet_job_t * job = &jobs[rom * per_rom + i];
+
+            job->rom = argv[optind + rom];
+            job->seed = seeds ? i + 1 : 0;
+            job->cycle_budget = cycle_budget;
+            job->timeout = timeout;
+            job->trace = trace;
+            job->profile = profile;
+            job->replay = replay;
+            job->debugger = debugger;
+            job->user = argv[optind + rom];
+        }
+    }
+
+    if (run_fleet(jobs, roms * per_rom, threads, report, &failures) != 0)
+    {
+        fprintf(stderr, "Could not start the emulator threads.\n");
+        return 1;
+    }
+
+    if (trace != NULL && close_trace(trace) != 0)
+    {
+        fprintf(stderr, "Could not write the trace %s.\n", trace_file);
+        failures++;
+    }
+
+    if (report_file != NULL && write_profile(profile, report_file, write_profile_report) != 0)
+    {
+        fprintf(stderr, "Could not write the profile %s.\n", report_file);
+        failures++;
+    }
+
+    if (stacks_file != NULL && write_profile(profile, stacks_file, write_profile_stacks) != 0)
+    {
+        fprintf(stderr, "Could not write the stacks %s.\n", stacks_file);
+        failures++;
+    }
+
+    free_profile(profile);
+
+    if (replay != NULL && (replay->failed || save_replay(replay, record_file) != 0))
+    {
+        fprintf(stderr, "Could not write the recording %s.\n", record_file);
+        failures++;
+    }
+
+    free_replay(replay);
+
+    if (debugger != NULL && debugger->stopped)
+    {
+        char stop[128];
+        describe_stop(debugger, stop, sizeof(stop));
+        printf("Stopped by %s.\n", stop);
+    }
+
+    free_debugger(debugger);
+    free(jobs);
+
+    return failures != 0;
+}
+
+#endif /* !EMULATOR_8080_NO_MAIN */
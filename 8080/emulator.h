@@ -19,15 +19,26 @@ enum {
     SP = 0x03
 };
 
-// Condition code (status) bits.
+// Page flags. Stores to a page with any flag set take the slow path.
 enum {
-    ZERO_BIT      = 1,
-    SIGN_BIT      = 1 << 1,
-    AUX_CARRY_BIT = 1 << 2,
-    PARITY_BIT    = 1 << 3,
-    CARRY_BIT     = 1 << 4
+    PAGE_CODE    = 1,  // holds code cached by the block cache
+    PAGE_CLEAN   = 2,  // unwritten since a checkpoint restore, see snapshot.h
+    PAGE_ROM     = 4,  // read-only, see memory_map.h
+    PAGE_MMIO    = 8,  // stores go to a device
+    PAGE_MIRROR  = 16, // shares its bytes with other pages
+    PAGE_WATCH   = 32, // holds a breakpoint or watched bytes, see debugger.h
+    PAGE_MMIO_IN = 64, // loads go to a device too, and take the slow path
+
+    PAGE_MAPPED = PAGE_ROM | PAGE_MMIO | PAGE_MMIO_IN | PAGE_MIRROR
 };
 
+// Values of interrupt_enabled. EI turns interrupts on only once the
+// instruction after it has run.
+enum {
+    INTERRUPTS_OFF        = 0,
+    INTERRUPTS_ON         = 1,
+    INTERRUPTS_AFTER_NEXT = 2
+};
 
 typedef struct condition_codes
 {
@@ -53,12 +64,65 @@ typedef struct cpu
     unsigned char * memory;
     condition_codes_t condition_codes;
     unsigned char interrupt_enabled;
+    unsigned char halted;
+    uint64_t cycles;
+
+    // An interrupt raised by raise_interrupt() and not yet taken, and the
+    // RST it runs. It is looked at between blocks, or each time the
+    // interpreter is called, rather than after every instruction.
+    uint8_t interrupt_pending;
+    uint8_t interrupt_vector;
+
+    // Flags are evaluated lazily. flag_result is the last result with the
+    // carry in bit 8, and bit 4 of flag_aux is the auxiliary carry. While
+    // flags_lazy is set, Z, S, P and AC are derived from these rather than
+    // read from condition_codes. The carry always lives in flag_result.
+    // Call materialize_condition_codes() before reading condition_codes.
+    uint16_t flag_result;
+    uint8_t flag_aux;
+    uint8_t flags_lazy;
+
+    // One byte per 256-byte page of memory, see the PAGE_ flags.
+    uint8_t page_flags[256];
+
+    // Bitmap of the pages written to since they were PAGE_CLEAN.
+    uint8_t dirty_pages[256 / 8];
+    struct block_cache * block_cache;
+
+    // Optional map of ROM, MMIO and mirrored pages, see memory_map.h.
+    struct memory_map * memory_map;
+
+    // Optional I/O port bus, see ports.h, and handlers for IN and OUT on
+    // the ports it leaves unmapped.
+    struct port_bus * ports;
+    uint8_t (*port_in)(struct cpu * cpu, uint8_t port);
+    void (*port_out)(struct cpu * cpu, uint8_t port, uint8_t value);
+
+    // Optional trace of every instruction run, see trace.h. Only looked at
+    // when built with EMULATOR_8080_TRACE; the JIT is bypassed while set.
+    struct trace * trace;
+
+    // Optional profile, see profile.h. Likewise only looked at when built
+    // with EMULATOR_8080_PROFILE.
+    struct profile * profile;
+
+    // Optional recording being made or played back, see replay.h.
+    struct replay * replay;
+
+    // Optional breakpoints and watchpoints, see debugger.h. Only looked at
+    // when built with EMULATOR_8080_DEBUG; the JIT is bypassed while set.
+    struct debugger * debugger;
 
 } cpu_8080_t;
 
 void die(cpu_8080_t * cpu);
-void process_condition_bits(cpu_8080_t * cpu, uint16_t value, uint8_t bits);
+void materialize_condition_codes(cpu_8080_t * cpu);
+uint8_t pack_condition_codes(const cpu_8080_t * cpu);
+void unpack_condition_codes(cpu_8080_t * cpu, uint8_t flags);
+void raise_interrupt(cpu_8080_t * cpu, uint8_t vector);
 int process_instruction(cpu_8080_t * cpu);
-void load_rom_to_memory(cpu_8080_t * cpu, const char * filename);
+uint64_t process_instructions(cpu_8080_t * cpu, uint64_t cycle_budget);
+uint64_t process_blocks(cpu_8080_t * cpu, uint64_t cycle_budget);
+int load_rom_to_memory(cpu_8080_t * cpu, const char * filename, uint16_t origin);
 
 #endif /* !EMULATOR_8080_H_ */
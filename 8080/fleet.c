@@ -0,0 +1,348 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "block_cache.h"
+#include "debugger.h"
+#include "emulator.h"
+#include "fleet.h"
+#include "jit.h"
+#include "profile.h"
+#include "replay.h"
+#include "rom.h"
+
+/*
+ * Each worker owns a run of the job queue. It takes jobs from the back of
+ * its own run, and once that is empty steals from the front of the others.
+ * Jobs never create more jobs, so a worker is done when every run is empty.
+ */
+
+typedef struct worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    size_t head;            // next job for thieves
+    size_t tail;            // one past the next job for the owner
+    struct fleet * fleet;
+    int index;
+    block_cache_t * cache;  // reused from job to job
+} worker_t;
+
+typedef struct fleet
+{
+    fleet_job_t * jobs;
+    worker_t * workers;
+    int count;
+    fleet_done_t done;
+    void * context;
+    pthread_mutex_t done_lock;
+} fleet_t;
+
+static const char * status_names[] = {
+    "halted",
+    "out of cycles",
+    "timed out",
+    "stopped",
+    "failed"
+};
+
+const char *
+fleet_status_name(fleet_status_t status)
+{
+    return status_names[status];
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+take_job(worker_t * worker, size_t * job)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->head < worker->tail)
+    {
+        *job = --worker->tail;
+        found = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return found;
+}
+
+static int
+steal_job(worker_t * thief, size_t * job)
+{
+    fleet_t * fleet = thief->fleet;
+
+    for (int i = 1; i < fleet->count; i++)
+    {
+        worker_t * victim = &fleet->workers[(thief->index + i) % fleet->count];
+        int found = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail)
+        {
+            *job = victim->head++;
+            found = 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (found)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// xorshift64*, enough to give every seed its own machine.
+static uint8_t
+next_random(uint64_t * state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+static void
+seed_machine(cpu_8080_t * cpu, uint64_t seed, size_t from)
+{
+    uint64_t state = seed;
+
+    cpu->a = next_random(&state);
+    cpu->b = next_random(&state);
+    cpu->c = next_random(&state);
+    cpu->d = next_random(&state);
+    cpu->e = next_random(&state);
+    cpu->h = next_random(&state);
+    cpu->l = next_random(&state);
+
+    for (size_t address = from; address < 0x10000; address++)
+    {
+        cpu->memory[address] = next_random(&state);
+    }
+}
+
+static void
+run_job(worker_t * worker, fleet_job_t * job)
+{
+    double start = now();
+    cpu_8080_t * cpu = calloc(1, sizeof(cpu_8080_t));
+    uint8_t * memory;
+    size_t size;
+
+    if (cpu == NULL || map_rom(job->rom, 0, &memory, &size) != ROM_OK)
+    {
+        job->status = FLEET_FAILED;
+        free(cpu);
+        return;
+    }
+
+    cpu->memory = memory;
+    cpu->trace = job->trace;
+    cpu->profile = job->profile;
+
+    if (job->seed)
+    {
+        seed_machine(cpu, job->seed, size);
+    }
+
+    if (worker->cache != NULL)
+    {
+        cpu->block_cache = worker->cache;
+        flush_block_cache(cpu);
+    }
+
+    if (job->replay != NULL)
+    {
+        start_recording(job->replay, cpu);
+    }
+
+    if (job->debugger != NULL)
+    {
+        attach_debugger(job->debugger, cpu);
+    }
+
+    job->status = FLEET_HALTED;
+    while (!cpu->halted)
+    {
+        uint64_t slice = FLEET_SLICE;
+
+        if (DEBUG_STOPPED(cpu))
+        {
+            job->status = FLEET_STOPPED;
+            break;
+        }
+
+        if (job->cycle_budget)
+        {
+            if (cpu->cycles >= job->cycle_budget)
+            {
+                job->status = FLEET_OUT_OF_CYCLES;
+                break;
+            }
+
+            if (job->cycle_budget - cpu->cycles < slice)
+            {
+                slice = job->cycle_budget - cpu->cycles;
+            }
+        }
+
+        if (job->timeout > 0 && now() - start > job->timeout)
+        {
+            job->status = FLEET_TIMED_OUT;
+            break;
+        }
+
+        process_blocks(cpu, slice);
+    }
+
+    if (cpu->profile != NULL)
+    {
+        finish_profile(cpu->profile, cpu);
+    }
+
+    if (cpu->replay != NULL)
+    {
+        stop_recording(cpu->replay, cpu);
+    }
+
+    if (job->debugger != NULL)
+    {
+        detach_debugger(job->debugger);
+    }
+
+    job->cycles = cpu->cycles;
+    job->seconds = now() - start;
+    job->cpu = *cpu;
+    job->cpu.memory = NULL;
+    job->cpu.block_cache = NULL;
+    job->cpu.trace = NULL;
+    job->cpu.profile = NULL;
+
+    unmap_rom(memory);
+    free(cpu);
+}
+
+static void *
+work(void * argument)
+{
+    worker_t * worker = argument;
+    fleet_t * fleet = worker->fleet;
+    size_t job;
+
+    worker->cache = create_block_cache();
+    if (worker->cache != NULL)
+    {
+        worker->cache->jit = create_jit();
+    }
+
+    while (take_job(worker, &job) || steal_job(worker, &job))
+    {
+        run_job(worker, &fleet->jobs[job]);
+
+        if (fleet->done != NULL)
+        {
+            pthread_mutex_lock(&fleet->done_lock);
+            fleet->done(&fleet->jobs[job], fleet->context);
+            pthread_mutex_unlock(&fleet->done_lock);
+        }
+    }
+
+    if (worker->cache != NULL)
+    {
+        free_block_cache(worker->cache);
+    }
+
+    return NULL;
+}
+
+/*
+ * Runs every job on a pool of threads and calls done as each one finishes.
+ * Returns 0 once they have all finished, or -1 if out of memory.
+ */
+int
+run_fleet(fleet_job_t * jobs, size_t count, int threads,
+          fleet_done_t done, void * context)
+{
+    fleet_t fleet;
+    int started = 0;
+
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+
+    if ((size_t)threads > count)
+    {
+        threads = count ? count : 1;
+    }
+
+    fleet.jobs = jobs;
+    fleet.count = threads;
+    fleet.done = done;
+    fleet.context = context;
+    fleet.workers = calloc(threads, sizeof(worker_t));
+    if (fleet.workers == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_init(&fleet.done_lock, NULL);
+
+    for (int i = 0; i < threads; i++)
+    {
+        worker_t * worker = &fleet.workers[i];
+
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->fleet = &fleet;
+        worker->index = i;
+        worker->head = count * i / threads;
+        worker->tail = count * (i + 1) / threads;
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&fleet.workers[i].thread, NULL, work, &fleet.workers[i]) != 0)
+        {
+            break;
+        }
+
+        started++;
+    }
+
+    // Whatever a missing thread would have run gets stolen by the others,
+    // or run here if none started.
+    if (started == 0)
+    {
+        for (int i = 0; i < threads; i++)
+        {
+            work(&fleet.workers[i]);
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(fleet.workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_mutex_destroy(&fleet.workers[i].lock);
+    }
+
+    pthread_mutex_destroy(&fleet.done_lock);
+    free(fleet.workers);
+
+    return 0;
+}
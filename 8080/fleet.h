@@ -0,0 +1,52 @@
+#ifndef FLEET_8080_H_
+#define FLEET_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emulator.h"
+
+// Cycles a machine runs between checks of its budget and timeout.
+#define FLEET_SLICE 1000000
+
+typedef enum fleet_status
+{
+    FLEET_HALTED,        // ran HLT
+    FLEET_OUT_OF_CYCLES, // used up its cycle budget
+    FLEET_TIMED_OUT,     // ran past its timeout
+    FLEET_STOPPED,       // stopped by its debugger
+    FLEET_FAILED         // could not be set up
+} fleet_status_t;
+
+/*
+ * One machine to run. The ROM file is mapped copy-on-write at address 0,
+ * see map_rom(), and run from there. A non-zero seed fills the registers
+ * and the memory past the ROM with pseudo-random bytes, so one ROM can be
+ * run under many seeds.
+ */
+typedef struct fleet_job
+{
+    const char * rom;
+    uint64_t seed;
+    uint64_t cycle_budget; // 0 for no limit
+    double timeout;        // seconds of wall time, 0 for no limit
+    struct trace * trace;  // attached to the machine, see trace.h, or NULL
+    struct profile * profile; // likewise, see profile.h; finished with the run
+    struct replay * replay; // recorded from the start, see replay.h, or NULL
+    struct debugger * debugger; // attached to the machine, see debugger.h, or NULL
+    void * user;
+
+    // Filled in when the machine finishes.
+    fleet_status_t status;
+    uint64_t cycles;
+    double seconds;
+    cpu_8080_t cpu;        // final registers; memory is not kept
+} fleet_job_t;
+
+// Called once per job as it finishes, one call at a time.
+typedef void (*fleet_done_t)(fleet_job_t * job, void * context);
+
+const char * fleet_status_name(fleet_status_t status);
+int run_fleet(fleet_job_t * jobs, size_t count, int threads,
+              fleet_done_t done, void * context);
+
+#endif /* !FLEET_8080_H_ */
@@ -0,0 +1,828 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_cache.h"
+#include "debugger.h"
+#include "emulator.h"
+#include "history.h"
+#include "memory_map.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "snapshot.h"
+
+#define MEMORY_SIZE 0x10000
+
+static history_checkpoint_t *
+checkpoint_at(const history_t * history, uint64_t number)
+{
+    return &history->checkpoints[number % HISTORY_MAX_CHECKPOINTS];
+}
+
+static uint64_t
+newest(const history_t * history)
+{
+    return history->first + history->count - 1;
+}
+
+static int
+has_page(const uint8_t * pages, int page)
+{
+    return pages[page / 8] >> (page % 8) & 1;
+}
+
+static int
+count_pages(const uint8_t * pages, int below)
+{
+    int count = 0;
+
+    for (int page = 0; page < below; page++)
+    {
+        count += has_page(pages, page);
+    }
+
+    return count;
+}
+
+// Marks every page clean, so the machine's dirty pages count from now.
+static void
+track_pages(cpu_8080_t * cpu)
+{
+    for (int page = 0; page < 256; page++)
+    {
+        cpu->page_flags[page] |= PAGE_CLEAN;
+    }
+
+    memset(cpu->dirty_pages, 0, sizeof(cpu->dirty_pages));
+}
+
+// The last checkpoint at or before cycle, or the oldest.
+static uint64_t
+find_checkpoint(const history_t * history, uint64_t cycle)
+{
+    uint64_t low = history->first;
+    uint64_t high = history->first + history->count;
+
+    while (high - low > 1)
+    {
+        uint64_t middle = low + (high - low) / 2;
+
+        if (checkpoint_at(history, middle)->cycle <= cycle)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+// A page as it was at a checkpoint: from the last one at or before it that
+// saved the page, or else from the image.
+static const uint8_t *
+saved_page(const history_t * history, uint64_t number, int page)
+{
+    for (; number > history->first; number--)
+    {
+        const history_checkpoint_t * checkpoint = checkpoint_at(history, number);
+
+        if (has_page(checkpoint->pages, page))
+        {
+            return history->arena + checkpoint->offset +
+                   count_pages(checkpoint->pages, page) * 256;
+        }
+    }
+
+    return history->image + page * 256;
+}
+
+// The pages that may differ between the machine and a checkpoint: those
+// written since checkpoint at, and those saved by the checkpoints between.
+static void
+changed_pages(const history_t * history, uint64_t number, uint8_t * pages)
+{
+    const cpu_8080_t * cpu = history->cpu;
+    uint64_t from = number < history->at ? number : history->at;
+    uint64_t to = number < history->at ? history->at : number;
+
+    for (int i = 0; i < 256 / 8; i++)
+    {
+        pages[i] = cpu->dirty_pages[i] | history->stale[i];
+    }
+
+    for (uint64_t n = from + 1; n <= to; n++)
+    {
+        const history_checkpoint_t * checkpoint = checkpoint_at(history, n);
+
+        for (int i = 0; i < 256 / 8; i++)
+        {
+            pages[i] |= checkpoint->pages[i];
+        }
+    }
+}
+
+/*
+ * Saves the machine's banks at a checkpoint, copying the stores of the RAM
+ * banks unless none were written back since the checkpoint before. Returns
+ * 0, or -1 if out of memory.
+ */
+static int
+save_map(const history_t * history, history_checkpoint_t * checkpoint)
+{
+    const memory_map_t * map = history->cpu->memory_map;
+    size_t size;
+
+    checkpoint->bank_stores = NULL;
+
+    if (map == NULL)
+    {
+        return 0;
+    }
+
+    save_banks(map, checkpoint->banks, NULL);
+    checkpoint->bank_writes = map->bank_writes;
+
+    if ((size = bank_store_size(map)) == 0)
+    {
+        return 0;
+    }
+
+    if (history->count != 0)
+    {
+        const history_checkpoint_t * before = checkpoint_at(history, newest(history));
+
+        if (before->bank_writes == map->bank_writes)
+        {
+            checkpoint->bank_stores = before->bank_stores;
+            return 0;
+        }
+    }
+
+    if ((checkpoint->bank_stores = malloc(size)) == NULL)
+    {
+        return -1;
+    }
+
+    save_banks(map, checkpoint->banks, checkpoint->bank_stores);
+    return 0;
+}
+
+// Frees a checkpoint's bank stores unless the one after shares them.
+static void
+drop_map(history_checkpoint_t * checkpoint, const history_checkpoint_t * next)
+{
+    if (next == NULL || next->bank_stores != checkpoint->bank_stores)
+    {
+        free(checkpoint->bank_stores);
+    }
+
+    checkpoint->bank_stores = NULL;
+}
+
+/*
+ * Folds the second oldest checkpoint into the image, which frees its pages
+ * and makes it the oldest. There have to be two.
+ */
+static void
+fold_oldest(history_t * history)
+{
+    history_checkpoint_t * next = checkpoint_at(history, history->first + 1);
+
+    drop_map(checkpoint_at(history, history->first), next);
+
+    for (int page = 0, saved = 0; page < 256; page++)
+    {
+        if (has_page(next->pages, page))
+        {
+            memcpy(history->image + page * 256,
+                   history->arena + next->offset + saved++ * 256, 256);
+        }
+    }
+
+    if (history->at == history->first)
+    {
+        for (int i = 0; i < 256 / 8; i++)
+        {
+            history->stale[i] |= next->pages[i];
+        }
+
+        history->at = history->first + 1;
+    }
+
+    next->size = 0;
+    history->first++;
+    history->count--;
+}
+
+/*
+ * Finds room in the arena for size bytes of pages after the last saved,
+ * wrapping around to the start if need be. Returns 0, or -1 if that would
+ * overwrite pages still kept.
+ */
+static int
+find_room(const history_t * history, size_t size, size_t * offset)
+{
+    const history_checkpoint_t * oldest = NULL;
+
+    for (uint64_t n = history->first; n <= newest(history); n++)
+    {
+        if (checkpoint_at(history, n)->size != 0)
+        {
+            oldest = checkpoint_at(history, n);
+            break;
+        }
+    }
+
+    *offset = history->head;
+
+    if (oldest == NULL)
+    {
+        *offset = 0;
+        return size <= history->arena_size ? 0 : -1;
+    }
+
+    // Pages kept run from the oldest's around to head.
+    if (history->head > oldest->offset)
+    {
+        if (history->arena_size - history->head >= size)
+        {
+            return 0;
+        }
+
+        *offset = 0;
+        return oldest->offset >= size ? 0 : -1;
+    }
+
+    return oldest->offset - history->head >= size ? 0 : -1;
+}
+
+// Takes a checkpoint of the machine, which is at the present.
+static void
+take_checkpoint(history_t * history)
+{
+    cpu_8080_t * cpu = history->cpu;
+    uint8_t pages[256 / 8];
+
+    changed_pages(history, newest(history), pages);
+
+    size_t size = count_pages(pages, 256) * 256;
+    size_t offset = history->head;
+
+    while (history->count == HISTORY_MAX_CHECKPOINTS ||
+           (size != 0 && find_room(history, size, &offset) != 0))
+    {
+        fold_oldest(history);
+    }
+
+    history_checkpoint_t * checkpoint = checkpoint_at(history, history->first + history->count);
+
+    checkpoint->cycle = cpu->cycles;
+    checkpoint->input = history->replay->input_count;
+    checkpoint->interrupt = history->replay->interrupt_count;
+    save_registers(cpu, checkpoint->registers);
+    memcpy(checkpoint->pages, pages, sizeof(pages));
+    checkpoint->offset = offset;
+    checkpoint->size = size;
+
+    if (save_map(history, checkpoint) != 0)
+    {
+        history->failed = 1;
+        return;
+    }
+
+    for (int page = 0, saved = 0; page < 256; page++)
+    {
+        if (has_page(pages, page))
+        {
+            memcpy(history->arena + offset + saved++ * 256, cpu->memory + page * 256, 256);
+        }
+    }
+
+    history->head = offset + size;
+    history->count++;
+    history->at = newest(history);
+    memset(history->stale, 0, sizeof(history->stale));
+    track_pages(cpu);
+}
+
+/*
+ * Puts the machine back in the state of a checkpoint, copying back only
+ * the pages that may have changed, and sets the recording to play from
+ * there up to the present.
+ */
+static void
+restore(history_t * history, uint64_t number)
+{
+    cpu_8080_t * cpu = history->cpu;
+    replay_t * replay = history->replay;
+    const history_checkpoint_t * checkpoint = checkpoint_at(history, number);
+    uint8_t pages[256 / 8];
+
+    if (replay->state == REPLAY_RECORDING)
+    {
+        history->present = cpu->cycles;
+        history->present_pending = cpu->interrupt_pending;
+        history->present_vector = cpu->interrupt_vector;
+    }
+
+    changed_pages(history, number, pages);
+
+    for (int page = 0; page < 256; page++)
+    {
+        if (!has_page(pages, page))
+        {
+            continue;
+        }
+
+        memcpy(cpu->memory + page * 256, saved_page(history, number, page), 256);
+
+        invalidate_page(cpu, page);
+    }
+
+    load_registers(cpu, checkpoint->registers);
+    track_pages(cpu);
+    history->at = number;
+
+    if (cpu->memory_map != NULL)
+    {
+        load_banks(cpu->memory_map, checkpoint->banks, checkpoint->bank_stores);
+        cpu->memory_map->bank_writes = checkpoint->bank_writes;
+    }
+
+    memset(history->stale, 0, sizeof(history->stale));
+
+    // Interrupts come from the recording alone.
+    cpu->interrupt_pending = 0;
+    replay->state = REPLAY_PLAYING;
+    replay->diverged = 0;
+    replay->next_input = checkpoint->input;
+    replay->next_interrupt = checkpoint->interrupt;
+    replay->end = history->present;
+}
+
+/*
+ * Plays back one instruction, or an interrupt being taken. A halted machine
+ * waits for the next interrupt, or the present, in one step.
+ */
+static int
+play_step(history_t * history)
+{
+    const cpu_8080_t * cpu = history->cpu;
+    const replay_t * replay = history->replay;
+    uint64_t next = cpu->cycles + 1;
+
+    if (cpu->halted && !cpu->interrupt_pending)
+    {
+        next = replay->end;
+
+        if (replay->next_interrupt < replay->interrupt_count &&
+            replay->interrupts[replay->next_interrupt].cycle < next)
+        {
+            next = replay->interrupts[replay->next_interrupt].cycle;
+        }
+
+        if (next <= cpu->cycles)
+        {
+            next = cpu->cycles + 1;
+        }
+    }
+
+    if (play_replay(history->replay, history->cpu, next) != 0)
+    {
+        history->failed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Starts keeping the history of a machine from the state it is in, taking
+ * a checkpoint every interval cycles, or every HISTORY_INTERVAL if 0, into
+ * an arena of arena_size bytes, or HISTORY_ARENA_SIZE if 0. The machine is
+ * run with scheduler if it is not NULL, so that its events fire, and
+ * otherwise on its own. The history records the machine, so it must not
+ * have a recording of its own. Returns NULL if out of memory.
+ */
+history_t *
+create_history(cpu_8080_t * cpu, scheduler_t * scheduler, uint64_t interval,
+               size_t arena_size)
+{
+    history_t * history = calloc(1, sizeof(history_t));
+    if (history == NULL)
+    {
+        return NULL;
+    }
+
+    if (arena_size == 0)
+    {
+        arena_size = HISTORY_ARENA_SIZE;
+    }
+    else if (arena_size < MEMORY_SIZE)
+    {
+        arena_size = MEMORY_SIZE;
+    }
+
+    history->cpu = cpu;
+    history->scheduler = scheduler;
+    history->interval = interval ? interval : HISTORY_INTERVAL;
+    history->present = cpu->cycles;
+    history->checkpoints = calloc(HISTORY_MAX_CHECKPOINTS, sizeof(history_checkpoint_t));
+    history->image = malloc(MEMORY_SIZE);
+    history->arena = malloc(arena_size);
+    history->arena_size = arena_size;
+
+    // The recording needs no keyframes past the first, the checkpoints
+    // stand in for them.
+    history->replay = create_replay(UINT64_MAX);
+
+    if (history->checkpoints == NULL || history->image == NULL ||
+        history->arena == NULL || history->replay == NULL ||
+        start_recording(history->replay, cpu) != 0)
+    {
+        free_history(history);
+        return NULL;
+    }
+
+    history_checkpoint_t * checkpoint = checkpoint_at(history, 0);
+
+    checkpoint->cycle = cpu->cycles;
+    save_registers(cpu, checkpoint->registers);
+    memcpy(history->image, cpu->memory, MEMORY_SIZE);
+
+    if (save_map(history, checkpoint) != 0)
+    {
+        free_history(history);
+        return NULL;
+    }
+
+    history->count = 1;
+    track_pages(cpu);
+
+    return history;
+}
+
+// Stops keeping the history and detaches it from the machine, which stays
+// in whatever state it is in.
+void
+free_history(history_t * history)
+{
+    if (history == NULL)
+    {
+        return;
+    }
+
+    cpu_8080_t * cpu = history->cpu;
+
+    if (history->replay != NULL && cpu->replay == history->replay)
+    {
+        stop_recording(history->replay, cpu);
+
+        for (int page = 0; page < 256; page++)
+        {
+            cpu->page_flags[page] &= ~PAGE_CLEAN;
+        }
+    }
+
+    for (uint64_t n = 0; history->checkpoints != NULL && n < history->count; n++)
+    {
+        uint64_t number = history->first + n;
+
+        drop_map(checkpoint_at(history, number),
+                 n + 1 < history->count ? checkpoint_at(history, number + 1) : NULL);
+    }
+
+    free_replay(history->replay);
+    free(history->arena);
+    free(history->image);
+    free(history->checkpoints);
+    free(history);
+}
+
+/*
+ * Runs the machine forward to the first instruction boundary at or past
+ * cycle, playing back what is recorded and running live past the present.
+ * A scheduler or a debugger that stops the machine stops it early, see
+ * debugger.h. Returns 0, or -1 if out of memory or playback diverged,
+ * after which the history is no longer usable.
+ */
+int
+run_history(history_t * history, uint64_t cycle)
+{
+    cpu_8080_t * cpu = history->cpu;
+    replay_t * replay = history->replay;
+
+    if (history->failed)
+    {
+        return -1;
+    }
+
+    if (replay->state == REPLAY_PLAYING)
+    {
+        if (play_replay(replay, cpu, cycle) != 0)
+        {
+            history->failed = 1;
+            return -1;
+        }
+
+        if (cpu->cycles < history->present)
+        {
+            return 0;
+        }
+
+        // Caught up, so from here on it is recorded anew.
+        replay->state = REPLAY_RECORDING;
+        cpu->interrupt_pending = history->present_pending;
+        cpu->interrupt_vector = history->present_vector;
+    }
+
+    while (cpu->cycles < cycle && !DEBUG_STOPPED(cpu))
+    {
+        uint64_t next = checkpoint_at(history, newest(history))->cycle + history->interval;
+        uint64_t until = next < cycle ? next : cycle;
+
+        if (history->scheduler != NULL)
+        {
+            run_scheduler(history->scheduler, until - cpu->cycles);
+        }
+        else
+        {
+            run_until(cpu, until);
+        }
+
+        if (replay->failed)
+        {
+            history->failed = 1;
+            return -1;
+        }
+
+        if (cpu->cycles >= next)
+        {
+            take_checkpoint(history);
+
+            if (history->failed)
+            {
+                return -1;
+            }
+        }
+
+        if (history->scheduler != NULL && history->scheduler->stopped)
+        {
+            break;
+        }
+    }
+
+    history->present = cpu->cycles;
+    return 0;
+}
+
+static int
+seek(history_t * history, uint64_t cycle)
+{
+    cpu_8080_t * cpu = history->cpu;
+    uint64_t number = find_checkpoint(history, cycle);
+    uint64_t start = checkpoint_at(history, number)->cycle;
+
+    if (history->failed)
+    {
+        return -1;
+    }
+
+    if (cpu->cycles > cycle || cpu->cycles < start)
+    {
+        restore(history, number);
+    }
+
+    if (cycle < start)
+    {
+        return 1;
+    }
+
+    return run_history(history, cycle);
+}
+
+static int
+back_one(history_t * history)
+{
+    cpu_8080_t * cpu = history->cpu;
+    uint64_t start = cpu->cycles;
+
+    if (history->failed)
+    {
+        return -1;
+    }
+
+    if (start <= checkpoint_at(history, history->first)->cycle)
+    {
+        return 1;
+    }
+
+    uint64_t number = find_checkpoint(history, start - 1);
+    uint64_t previous;
+
+    restore(history, number);
+
+    do
+    {
+        previous = cpu->cycles;
+
+        if (play_step(history) != 0)
+        {
+            return -1;
+        }
+    } while (cpu->cycles < start);
+
+    restore(history, number);
+    return run_history(history, previous);
+}
+
+static int
+search_back(history_t * history, history_stop_t stop, void * context)
+{
+    cpu_8080_t * cpu = history->cpu;
+    uint64_t limit = cpu->cycles;
+
+    if (history->failed)
+    {
+        return -1;
+    }
+
+    if (limit <= checkpoint_at(history, history->first)->cycle)
+    {
+        return 1;
+    }
+
+    for (uint64_t number = find_checkpoint(history, limit - 1); ; number--)
+    {
+        uint64_t found = UINT64_MAX;
+        uint64_t start;
+        uint64_t previous;
+
+        restore(history, number);
+        start = cpu->cycles;
+        previous = start;
+
+        for (;;)
+        {
+            // What led to the first boundary was gone through before.
+            int answer = stop(cpu, context);
+
+            if (answer == HISTORY_STOP_HERE && cpu->cycles < limit)
+            {
+                found = cpu->cycles;
+            }
+            else if (answer == HISTORY_STOP_BEFORE && cpu->cycles != start)
+            {
+                found = previous;
+            }
+
+            if (cpu->cycles >= limit)
+            {
+                break;
+            }
+
+            previous = cpu->cycles;
+
+            if (play_step(history) != 0)
+            {
+                return -1;
+            }
+        }
+
+        if (found != UINT64_MAX)
+        {
+            restore(history, number);
+            return run_history(history, found);
+        }
+
+        if (number == history->first)
+        {
+            restore(history, number);
+            return 1;
+        }
+
+        limit = checkpoint_at(history, number)->cycle;
+    }
+}
+
+// Going back plays over what has run already, so a debugger only looks on.
+static void
+look_on(history_t * history)
+{
+    debugger_t * debugger = history->cpu->debugger;
+
+    if (debugger != NULL)
+    {
+        debugger->passive = 1;
+        debugger->stopped = 0;
+    }
+}
+
+// And it is left stopped where the machine lands, as if it had stopped there.
+static int
+land(history_t * history, int result)
+{
+    debugger_t * debugger = history->cpu->debugger;
+
+    if (debugger != NULL)
+    {
+        debugger->passive = 0;
+        debugger->pending = 0;
+        debugger->stopped = 1;
+        debugger->stop_cycle = history->cpu->cycles;
+    }
+
+    return result;
+}
+
+/*
+ * Puts the machine in the state it was in, or will be in, at the first
+ * instruction boundary at or past cycle. It goes from the nearest
+ * checkpoint before, unless it is already between that and cycle. Returns
+ * 0, 1 if cycle is older than the history reaches, leaving the machine at
+ * the oldest checkpoint, or -1 as run_history() does.
+ */
+int
+seek_history(history_t * history, uint64_t cycle)
+{
+    look_on(history);
+    return land(history, seek(history, cycle));
+}
+
+/*
+ * Puts the machine back one instruction, or to before the interrupt it
+ * took last, or to where it started waiting in HLT. Returns 0, 1 if it is
+ * at the oldest state kept, or -1 as run_history() does.
+ */
+int
+step_back(history_t * history)
+{
+    look_on(history);
+    return land(history, back_one(history));
+}
+
+/*
+ * Runs backward to the last instruction boundary before the machine's at
+ * which stop says to stop. It goes back a checkpoint at a time, stepping
+ * forward from each and asking stop at every boundary on the way, the
+ * first and last included, so that it can take stock. Returns 0, 1 if
+ * there is none, leaving the machine at the oldest state kept, or -1 as
+ * run_history() does.
+ */
+int
+run_back(history_t * history, history_stop_t stop, void * context)
+{
+    look_on(history);
+    return land(history, search_back(history, stop, context));
+}
+
+typedef struct watched_bytes
+{
+    uint16_t address;
+    uint16_t size;
+    uint8_t * bytes;        // as they were last looked at
+} watched_bytes_t;
+
+static int
+bytes_changed(const cpu_8080_t * cpu, void * context)
+{
+    watched_bytes_t * watch = context;
+
+    if (memcmp(cpu->memory + watch->address, watch->bytes, watch->size) == 0)
+    {
+        return 0;
+    }
+
+    memcpy(watch->bytes, cpu->memory + watch->address, watch->size);
+    return HISTORY_STOP_BEFORE;
+}
+
+/*
+ * Runs backward to just before the last instruction, or interrupt, that
+ * changed any of size bytes from address, so that the program counter is
+ * on the culprit. Returns 0, 1 if nothing in the history changed them, or
+ * -1 as run_history() does, or if out of memory.
+ */
+int
+run_back_to_change(history_t * history, uint16_t address, uint16_t size)
+{
+    watched_bytes_t watch = { address, size, NULL };
+
+    if (size == 0 || address + size > MEMORY_SIZE)
+    {
+        return -1;
+    }
+
+    watch.bytes = malloc(size);
+    if (watch.bytes == NULL)
+    {
+        return -1;
+    }
+
+    int result = run_back(history, bytes_changed, &watch);
+
+    free(watch.bytes);
+    return result;
+}
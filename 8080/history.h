@@ -0,0 +1,111 @@
+#ifndef HISTORY_8080_H_
+#define HISTORY_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emulator.h"
+#include "memory_map.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "snapshot.h"
+
+/*
+ * Reverse execution. A history runs a machine forward while recording it,
+ * see replay.h, and takes a checkpoint every interval cycles. Going back
+ * restores the nearest checkpoint before and plays the recording forward
+ * from there, so the machine goes through the very states it went through
+ * the first time. Past the end of what was recorded it runs live again.
+ *
+ * A checkpoint holds the registers and only the 256-byte pages written
+ * since the checkpoint before, as they were when it was taken. The oldest
+ * checkpoint is a full memory image instead. The pages go into an arena of
+ * a fixed size; once it is full, the oldest checkpoint is folded into the
+ * image to make room, and the history starts later. The arena size bounds
+ * the memory used, and the interval trades how far back it reaches against
+ * how much is replayed per step back.
+ *
+ * Stepping back single-steps the recording from the checkpoint before, so
+ * it costs up to one interval of cycles played an instruction at a time.
+ * A debugger attached to the machine, see debugger.h, stops it going
+ * forward but only looks on going back.
+ *
+ * A machine with a memory map has its banks kept with each checkpoint, see
+ * memory_map.h. The stores of RAM banks are copied outside the arena, and
+ * only for checkpoints after which a bank was written back to its store.
+ *
+ * The machine needs 64 KiB of memory. Devices that change its memory
+ * behind the CPU's back are not tracked.
+ */
+
+// Cycles between checkpoints unless told otherwise.
+#define HISTORY_INTERVAL 1000000
+
+// Bytes of pages kept unless told otherwise. At least 64 KiB are.
+#define HISTORY_ARENA_SIZE (16 * 1024 * 1024)
+
+// Checkpoints kept at most, however few pages they hold.
+#define HISTORY_MAX_CHECKPOINTS 4096
+
+typedef struct history_checkpoint
+{
+    uint64_t cycle;
+    size_t input;           // where the recording's logs stood
+    size_t interrupt;
+    uint8_t registers[SNAPSHOT_HEADER_SIZE];
+    uint8_t pages[256 / 8]; // bitmap of the pages saved
+    size_t offset;          // of the saved pages in the arena
+    size_t size;
+    size_t banks[MAX_BANK_WINDOWS]; // see save_banks()
+    uint64_t bank_writes;
+    uint8_t * bank_stores;  // shared with the checkpoint before if unchanged
+} history_checkpoint_t;
+
+typedef struct history
+{
+    cpu_8080_t * cpu;
+    scheduler_t * scheduler; // runs the machine live, if set
+    replay_t * replay;
+    uint64_t interval;
+    uint64_t present;        // the furthest cycle run to
+    int failed;              // out of memory, or playback diverged
+
+    // An interrupt raised at the present but not yet taken, put back once
+    // the machine gets there again.
+    uint8_t present_pending;
+    uint8_t present_vector;
+
+    // Checkpoints in a ring, numbered from the start. first is the oldest,
+    // whose memory is image, and the machine's dirty pages are counted from
+    // checkpoint at, plus stale.
+    history_checkpoint_t * checkpoints;
+    uint64_t first;
+    uint64_t count;
+    uint64_t at;
+    uint8_t stale[256 / 8];
+    uint8_t * image;
+
+    uint8_t * arena;
+    size_t arena_size;
+    size_t head;             // where the next checkpoint's pages go
+} history_t;
+
+// Says whether to stop at the instruction boundary the machine is on: 0,
+// HISTORY_STOP_HERE, or HISTORY_STOP_BEFORE for the boundary before it,
+// ahead of the step that led here.
+typedef int (*history_stop_t)(const cpu_8080_t * cpu, void * context);
+
+enum {
+    HISTORY_STOP_HERE   = 1,
+    HISTORY_STOP_BEFORE = 2
+};
+
+history_t * create_history(cpu_8080_t * cpu, scheduler_t * scheduler,
+                           uint64_t interval, size_t arena_size);
+void free_history(history_t * history);
+int run_history(history_t * history, uint64_t cycle);
+int seek_history(history_t * history, uint64_t cycle);
+int step_back(history_t * history);
+int run_back(history_t * history, history_stop_t stop, void * context);
+int run_back_to_change(history_t * history, uint16_t address, uint16_t size);
+
+#endif /* !HISTORY_8080_H_ */
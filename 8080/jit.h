@@ -0,0 +1,38 @@
+#ifndef JIT_8080_H_
+#define JIT_8080_H_
+
+#include <stdint.h>
+#include "block_cache.h"
+#include "emulator.h"
+
+// Runs of a block through the block executor before it is compiled.
+#define JIT_THRESHOLD 64
+
+/*
+ * Guest registers as native code sees them: the accumulator in the low byte
+ * of af with the flags byte above it, and each pair with its high register
+ * in the high byte.
+ */
+typedef struct jit_registers
+{
+    uint16_t af;
+    uint16_t bc;
+    uint16_t de;
+    uint16_t hl;
+} jit_registers_t;
+
+typedef struct jit jit_t;
+
+/*
+ * Native code runs a block from its first micro-op and returns the number of
+ * micro-ops it completed in the low byte and the cycles they took above
+ * that. It leaves the rest of the block, I/O, stores to flagged pages and
+ * loads from pages a device answers to the block executor.
+ */
+jit_t * create_jit(void);
+void free_jit(jit_t * jit);
+void reset_jit(jit_t * jit);
+int compile_block(jit_t * jit, block_t * block);
+uint32_t run_native_block(cpu_8080_t * cpu, const block_t * block);
+
+#endif /* !JIT_8080_H_ */
@@ -0,0 +1,688 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+#include "opcodes.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE  (16 * 1024 * 1024)
+#define MAX_NATIVE_BLOCK 4096 // worst case native code for one block
+#define MAX_SIDE_EXITS   (MAX_BLOCK_OPS * 2)
+
+/*
+ * The 8080 registers map onto the 8086 ones it was designed to be
+ * translated to: A is AL with the flags in AH, so LAHF and SAHF move the
+ * flags byte as PUSH PSW lays it out, and BC, DE and HL are BX, CX and DX.
+ * RSI holds the base of guest memory, RDI the CPU, R9 the register block
+ * and RBP is scratch. Nothing touching AH, BH, CH or DH can take a REX
+ * prefix, which is why the scratch register is RBP and not R8.
+ */
+enum {
+    HOST_AL = 0,
+    HOST_CL = 1,
+    HOST_DL = 2,
+    HOST_BL = 3,
+    HOST_AH = 4,
+    HOST_CH = 5,
+    HOST_DH = 6,
+    HOST_BH = 7
+};
+
+// Host byte registers holding B, C, D, E, H, L and A. M has none.
+static const uint8_t host_register[8] = {
+    HOST_BH, HOST_BL, HOST_CH, HOST_CL, HOST_DH, HOST_DL, 0xFF, HOST_AL
+};
+
+// Index registers for BC, DE and HL as encoded in a SIB byte.
+static const uint8_t host_pair[3] = { 3, 1, 2 };
+
+// Host condition codes for NZ, Z, NC, C, PO, PE, P and M.
+static const uint8_t host_condition[8] = {
+    0x5, 0x4, 0x3, 0x2, 0xB, 0xA, 0x9, 0x8
+};
+
+// Register-to-register opcodes of ADD, ADC, SUB, SBB, AND, XOR, OR and CMP.
+static const uint8_t host_alu[8] = {
+    0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38
+};
+
+enum { ADD, ADC, SUB, SBB, ANA, XRA, ORA, CMP };
+
+struct jit
+{
+    uint8_t * buffer;
+    size_t used;
+};
+
+typedef struct side_exit
+{
+    size_t patch;   // offset of the rel32 to point at the exit
+    uint16_t pc;
+    uint32_t result;
+} side_exit_t;
+
+typedef struct compiler
+{
+    uint8_t * code;
+    size_t at;
+    int flags_synced;   // host flags hold what AH does
+    side_exit_t exits[MAX_SIDE_EXITS];
+    int exit_count;
+} compiler_t;
+
+static void
+emit8(compiler_t * c, uint8_t byte)
+{
+    c->code[c->at++] = byte;
+}
+
+static void
+emit16(compiler_t * c, uint16_t value)
+{
+    emit8(c, value & 0xFF);
+    emit8(c, value >> 8);
+}
+
+static void
+emit32(compiler_t * c, uint32_t value)
+{
+    emit16(c, value & 0xFFFF);
+    emit16(c, value >> 16);
+}
+
+static void
+patch32(compiler_t * c, size_t at, uint32_t value)
+{
+    memcpy(&c->code[at], &value, sizeof(value));
+}
+
+static uint32_t
+exit_result(int ops, uint32_t cycles)
+{
+    return (cycles << 8) | ops;
+}
+
+// Stores the registers back, sets the program counter and returns.
+static void
+emit_exit(compiler_t * c, uint16_t pc, uint32_t result)
+{
+    emit8(c, 0x66); emit8(c, 0xC7); emit8(c, 0x87);       // mov word [rdi + pc], imm16
+    emit32(c, offsetof(cpu_8080_t, program_counter));
+    emit16(c, pc);
+    emit8(c, 0x66); emit8(c, 0x41); emit8(c, 0x89);       // mov [r9], ax
+    emit8(c, 0x41); emit8(c, 0x00);
+    emit8(c, 0x66); emit8(c, 0x41); emit8(c, 0x89);       // mov [r9 + 2], bx
+    emit8(c, 0x59); emit8(c, 0x02);
+    emit8(c, 0x66); emit8(c, 0x41); emit8(c, 0x89);       // mov [r9 + 4], cx
+    emit8(c, 0x49); emit8(c, 0x04);
+    emit8(c, 0x66); emit8(c, 0x41); emit8(c, 0x89);       // mov [r9 + 6], dx
+    emit8(c, 0x51); emit8(c, 0x06);
+    emit8(c, 0xB8); emit32(c, result);                    // mov eax, result
+    emit8(c, 0x5D);                                       // pop rbp
+    emit8(c, 0x5B);                                       // pop rbx
+    emit8(c, 0xC3);                                       // ret
+}
+
+// Emits a jump to an exit that is written out after the block.
+static void
+emit_side_exit(compiler_t * c, uint8_t condition, uint16_t pc, uint32_t result)
+{
+    emit8(c, 0x0F); emit8(c, 0x80 | condition);           // jcc rel32
+    c->exits[c->exit_count].patch = c->at;
+    c->exits[c->exit_count].pc = pc;
+    c->exits[c->exit_count].result = result;
+    c->exit_count++;
+    emit32(c, 0);
+}
+
+static void
+emit_prologue(compiler_t * c)
+{
+    emit8(c, 0x53);                                       // push rbx
+    emit8(c, 0x55);                                       // push rbp
+    emit8(c, 0x49); emit8(c, 0x89); emit8(c, 0xF1);       // mov r9, rsi
+    emit8(c, 0x0F); emit8(c, 0xB7); emit8(c, 0x06);       // movzx eax, word [rsi]
+    emit8(c, 0x0F); emit8(c, 0xB7); emit8(c, 0x5E);       // movzx ebx, word [rsi + 2]
+    emit8(c, 0x02);
+    emit8(c, 0x0F); emit8(c, 0xB7); emit8(c, 0x4E);       // movzx ecx, word [rsi + 4]
+    emit8(c, 0x04);
+    emit8(c, 0x0F); emit8(c, 0xB7); emit8(c, 0x56);       // movzx edx, word [rsi + 6]
+    emit8(c, 0x06);
+    emit8(c, 0x48); emit8(c, 0x8B); emit8(c, 0xB7);       // mov rsi, [rdi + memory]
+    emit32(c, offsetof(cpu_8080_t, memory));
+    c->flags_synced = 0;
+}
+
+static void
+emit_sync_flags(compiler_t * c)
+{
+    if (!c->flags_synced)
+    {
+        emit8(c, 0x9E);                                   // sahf
+        c->flags_synced = 1;
+    }
+}
+
+// ModRM and SIB for [rsi + pair].
+static void
+emit_pair_operand(compiler_t * c, uint8_t reg, uint8_t rp)
+{
+    emit8(c, (reg << 3) | 0x04);
+    emit8(c, (host_pair[rp] << 3) | 0x06);
+}
+
+// ModRM and displacement for [rsi + address].
+static void
+emit_address_operand(compiler_t * c, uint8_t reg, uint16_t address)
+{
+    emit8(c, 0x80 | (reg << 3) | 0x06);
+    emit32(c, address);
+}
+
+/*
+ * Stores to a page with any flag set, and loads from one a device answers,
+ * leave through a side exit before the access, so the block executor does
+ * it along with whatever hooks apply. Stores check for flags 0xFF, loads
+ * for PAGE_MMIO_IN.
+ */
+static void
+emit_page_check(compiler_t * c, uint8_t rp, uint8_t flags, uint16_t pc, uint32_t result)
+{
+    static const uint8_t high_register[3] = { HOST_BH, HOST_CH, HOST_DH };
+
+    emit8(c, 0x0F); emit8(c, 0xB6);                       // movzx ebp, high byte
+    emit8(c, 0xE8 | high_register[rp]);
+    emit8(c, 0xF6); emit8(c, 0x84); emit8(c, 0x2F);       // test byte [rdi + rbp + flags], imm8
+    emit32(c, offsetof(cpu_8080_t, page_flags));
+    emit8(c, flags);
+    emit_side_exit(c, 0x5, pc, result);
+    c->flags_synced = 0;
+}
+
+static void
+emit_page_check_at(compiler_t * c, uint16_t address, uint8_t flags, uint16_t pc,
+                   uint32_t result)
+{
+    emit8(c, 0xF6); emit8(c, 0x87);                       // test byte [rdi + flags + page], imm8
+    emit32(c, offsetof(cpu_8080_t, page_flags) + (address >> 8));
+    emit8(c, flags);
+    emit_side_exit(c, 0x5, pc, result);
+    c->flags_synced = 0;
+}
+
+/*
+ * Arithmetic and logic on the accumulator. The source is a register, M when
+ * source is M, or an immediate when immediate is set.
+ */
+static void
+emit_alu(compiler_t * c, int kind, uint8_t source, int immediate, uint8_t value)
+{
+    if (kind == ANA)
+    {
+        // The 8080 sets AC from bit 3 of the operands ORed together.
+        if (immediate)
+        {
+            emit8(c, 0xBD); emit32(c, value);             // mov ebp, imm32
+        }
+        else if (source == M)
+        {
+            emit8(c, 0x0F); emit8(c, 0xB6);               // movzx ebp, byte [rsi + rdx]
+            emit_pair_operand(c, 5, HL);
+        }
+        else
+        {
+            emit8(c, 0x0F); emit8(c, 0xB6);               // movzx ebp, r8
+            emit8(c, 0xE8 | host_register[source]);
+        }
+
+        emit8(c, 0x09); emit8(c, 0xC5);                   // or ebp, eax
+    }
+
+    if (kind == ADC || kind == SBB)
+    {
+        emit_sync_flags(c);
+    }
+
+    if (immediate)
+    {
+        emit8(c, host_alu[kind] + 4);                     // op al, imm8
+        emit8(c, value);
+    }
+    else if (source == M)
+    {
+        emit8(c, host_alu[kind] + 2);                     // op al, [rsi + rdx]
+        emit_pair_operand(c, HOST_AL, HL);
+    }
+    else
+    {
+        emit8(c, host_alu[kind]);                         // op al, r8
+        emit8(c, 0xC0 | (host_register[source] << 3));
+    }
+
+    emit8(c, 0x9F);                                       // lahf
+    c->flags_synced = 1;
+
+    switch(kind)
+    {
+        case SUB:
+        case SBB:
+        case CMP:
+            // The host sets AF on a borrow, the 8080 sets AC on no borrow.
+            emit8(c, 0x80); emit8(c, 0xF4); emit8(c, 0x10); // xor ah, 0x10
+            c->flags_synced = 0;
+            break;
+        case ANA:
+            emit8(c, 0x83); emit8(c, 0xE5); emit8(c, 0x08); // and ebp, 8
+            emit8(c, 0xC1); emit8(c, 0xE5); emit8(c, 0x09); // shl ebp, 9
+            emit8(c, 0x25); emit32(c, 0xFFFFEFFF);          // and eax, ~AC
+            emit8(c, 0x09); emit8(c, 0xE8);                 // or eax, ebp
+            c->flags_synced = 0;
+            break;
+        case XRA:
+        case ORA:
+            emit8(c, 0x80); emit8(c, 0xE4); emit8(c, 0xEF); // and ah, ~AC
+            c->flags_synced = 0;
+            break;
+    }
+}
+
+/*
+ * Compiles one micro-op. Returns zero for instructions left to the block
+ * executor. Jumps write their own exits and return -1.
+ */
+static int
+emit_instruction(compiler_t * c, const micro_op_t * uop, int index, uint32_t cycles)
+{
+    uint8_t opcode = uop->opcode;
+    uint8_t dst = (opcode >> 3) & 0x7;
+    uint8_t src = opcode & 0x7;
+    uint8_t rp = (opcode >> 4) & 0x3;
+    uint16_t operand = uop->operand;
+    uint32_t before = exit_result(index, cycles);
+    uint32_t after = exit_result(index + 1, cycles + opcode_table[opcode].cycles);
+
+    if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76)
+    {
+        if (dst == M)
+        {
+            emit_page_check(c, HL, 0xFF, uop->address, before);
+            emit8(c, 0x88);                               // mov [rsi + rdx], r8
+            emit_pair_operand(c, host_register[src], HL);
+        }
+        else if (src == M)
+        {
+            emit_page_check(c, HL, PAGE_MMIO_IN, uop->address, before);
+            emit8(c, 0x8A);                               // mov r8, [rsi + rdx]
+            emit_pair_operand(c, host_register[dst], HL);
+        }
+        else if (dst != src)
+        {
+            emit8(c, 0x88);                               // mov r8, r8
+            emit8(c, 0xC0 | (host_register[src] << 3) | host_register[dst]);
+        }
+
+        return 1;
+    }
+
+    if (opcode >= 0x80 && opcode < 0xC0)
+    {
+        if (src == M)
+        {
+            emit_page_check(c, HL, PAGE_MMIO_IN, uop->address, before);
+        }
+        emit_alu(c, dst, src, 0, 0);
+        return 1;
+    }
+
+    if ((opcode & 0xC7) == 0xC6)
+    {
+        emit_alu(c, dst, 0, 1, operand & 0xFF);
+        return 1;
+    }
+
+    switch(opcode)
+    {
+        case 0x00: case 0x08: case 0x10: case 0x18:       // NOP
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            return 1;
+
+        case 0x01: case 0x11: case 0x21:                  // LXI
+            emit8(c, 0x66); emit8(c, 0xB8 | host_pair[rp]); // mov r16, imm16
+            emit16(c, operand);
+            return 1;
+        case 0x31:
+            emit8(c, 0x66); emit8(c, 0xC7); emit8(c, 0x87); // mov word [rdi + sp], imm16
+            emit32(c, offsetof(cpu_8080_t, stack_pointer));
+            emit16(c, operand);
+            return 1;
+
+        case 0x03: case 0x13: case 0x23:                  // INX
+        case 0x0B: case 0x1B: case 0x2B:                  // DCX
+            emit8(c, 0x66); emit8(c, 0xFF);               // inc/dec r16
+            emit8(c, ((opcode & 0x08) ? 0xC8 : 0xC0) | host_pair[rp]);
+            c->flags_synced = 0;
+            return 1;
+        case 0x33:
+        case 0x3B:
+            emit8(c, 0x66); emit8(c, 0xFF);               // inc/dec word [rdi + sp]
+            emit8(c, (opcode & 0x08) ? 0x8F : 0x87);
+            emit32(c, offsetof(cpu_8080_t, stack_pointer));
+            c->flags_synced = 0;
+            return 1;
+
+        case 0x09: case 0x19: case 0x29: case 0x39:       // DAD
+            emit8(c, 0x80); emit8(c, 0xE4); emit8(c, 0xFE); // and ah, ~CY
+            if (rp == SP)
+            {
+                emit8(c, 0x66); emit8(c, 0x03); emit8(c, 0x97); // add dx, [rdi + sp]
+                emit32(c, offsetof(cpu_8080_t, stack_pointer));
+            }
+            else
+            {
+                emit8(c, 0x66); emit8(c, 0x01);           // add dx, r16
+                emit8(c, 0xC0 | (host_pair[rp] << 3) | host_pair[HL]);
+            }
+            emit8(c, 0x80); emit8(c, 0xD4); emit8(c, 0x00); // adc ah, 0
+            c->flags_synced = 0;
+            return 1;
+
+        case 0x02: case 0x12:                             // STAX
+            emit_page_check(c, rp, 0xFF, uop->address, before);
+            emit8(c, 0x88);                               // mov [rsi + pair], al
+            emit_pair_operand(c, HOST_AL, rp);
+            return 1;
+        case 0x0A: case 0x1A:                             // LDAX
+            emit_page_check(c, rp, PAGE_MMIO_IN, uop->address, before);
+            emit8(c, 0x8A);                               // mov al, [rsi + pair]
+            emit_pair_operand(c, HOST_AL, rp);
+            return 1;
+
+        case 0x32:                                        // STA
+            emit_page_check_at(c, operand, 0xFF, uop->address, before);
+            emit8(c, 0x88);                               // mov [rsi + a16], al
+            emit_address_operand(c, HOST_AL, operand);
+            return 1;
+        case 0x3A:                                        // LDA
+            emit_page_check_at(c, operand, PAGE_MMIO_IN, uop->address, before);
+            emit8(c, 0x8A);                               // mov al, [rsi + a16]
+            emit_address_operand(c, HOST_AL, operand);
+            return 1;
+
+        case 0x22:                                        // SHLD
+            if (operand == 0xFFFF)
+            {
+                return 0;
+            }
+            emit_page_check_at(c, operand, 0xFF, uop->address, before);
+            emit_page_check_at(c, operand + 1, 0xFF, uop->address, before);
+            emit8(c, 0x66); emit8(c, 0x89);               // mov [rsi + a16], dx
+            emit_address_operand(c, HOST_DL, operand);
+            return 1;
+        case 0x2A:                                        // LHLD
+            if (operand == 0xFFFF)
+            {
+                return 0;
+            }
+            emit_page_check_at(c, operand, PAGE_MMIO_IN, uop->address, before);
+            emit_page_check_at(c, operand + 1, PAGE_MMIO_IN, uop->address, before);
+            emit8(c, 0x66); emit8(c, 0x8B);               // mov dx, [rsi + a16]
+            emit_address_operand(c, HOST_DL, operand);
+            return 1;
+
+        case 0x04: case 0x0C: case 0x14: case 0x1C:       // INR
+        case 0x24: case 0x2C: case 0x34: case 0x3C:
+        case 0x05: case 0x0D: case 0x15: case 0x1D:       // DCR
+        case 0x25: case 0x2D: case 0x35: case 0x3D:
+            if (dst == M)
+            {
+                emit_page_check(c, HL, 0xFF, uop->address, before);
+            }
+            // INC and DEC leave the host carry alone, as the 8080 does.
+            emit_sync_flags(c);
+            emit8(c, 0xFE);
+            if (dst == M)
+            {
+                emit_pair_operand(c, src == 4 ? 0 : 1, HL);
+            }
+            else
+            {
+                emit8(c, (src == 4 ? 0xC0 : 0xC8) | host_register[dst]);
+            }
+            emit8(c, 0x9F);                               // lahf
+            if (src == 5)
+            {
+                emit8(c, 0x80); emit8(c, 0xF4); emit8(c, 0x10); // xor ah, 0x10
+                c->flags_synced = 0;
+            }
+            return 1;
+
+        case 0x06: case 0x0E: case 0x16: case 0x1E:       // MVI
+        case 0x26: case 0x2E: case 0x3E:
+            emit8(c, 0xB0 | host_register[dst]);          // mov r8, imm8
+            emit8(c, operand & 0xFF);
+            return 1;
+        case 0x36:
+            emit_page_check(c, HL, 0xFF, uop->address, before);
+            emit8(c, 0xC6);                               // mov byte [rsi + rdx], imm8
+            emit_pair_operand(c, 0, HL);
+            emit8(c, operand & 0xFF);
+            return 1;
+
+        case 0x07: case 0x0F: case 0x17: case 0x1F:       // RLC, RRC, RAL, RAR
+            emit_sync_flags(c);
+            emit8(c, 0xD0);                               // rol/ror/rcl/rcr al, 1
+            emit8(c, 0xC0 | ((opcode >> 3) << 3));
+            emit8(c, 0x9F);                               // lahf
+            return 1;
+
+        case 0x2F:                                        // CMA
+            emit8(c, 0xF6); emit8(c, 0xD0);               // not al
+            return 1;
+        case 0x37:                                        // STC
+            emit8(c, 0x80); emit8(c, 0xCC); emit8(c, 0x01); // or ah, CY
+            c->flags_synced = 0;
+            return 1;
+        case 0x3F:                                        // CMC
+            emit8(c, 0x80); emit8(c, 0xF4); emit8(c, 0x01); // xor ah, CY
+            c->flags_synced = 0;
+            return 1;
+
+        case 0xEB:                                        // XCHG
+            emit8(c, 0x66); emit8(c, 0x87); emit8(c, 0xCA); // xchg dx, cx
+            return 1;
+
+        case 0xC3: case 0xCB:                             // JMP
+            emit_exit(c, operand, after);
+            return -1;
+
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:       // Jcc
+        case 0xE2: case 0xEA: case 0xF2: case 0xFA:
+            emit_sync_flags(c);
+            emit_side_exit(c, host_condition[dst], operand, after);
+            emit_exit(c, uop->address + 3, after);
+            return -1;
+    }
+
+    return 0;
+}
+
+jit_t *
+create_jit(void)
+{
+    jit_t * jit = calloc(1, sizeof(jit_t));
+    if (jit == NULL)
+    {
+        return NULL;
+    }
+
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void
+free_jit(jit_t * jit)
+{
+    if (jit != NULL)
+    {
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+        free(jit);
+    }
+}
+
+// Throws away all native code. The block cache does this when it flushes
+// or drops native code.
+void
+reset_jit(jit_t * jit)
+{
+    if (jit != NULL)
+    {
+        jit->used = 0;
+    }
+}
+
+/*
+ * Compiles the longest prefix of the block that native code handles. The
+ * buffer is only writable while code is being emitted into it. Returns -1
+ * if the buffer is full, or could not be made executable again, for the
+ * caller to throw away all native code, see drop_native_code().
+ */
+int
+compile_block(jit_t * jit, block_t * block)
+{
+    compiler_t c;
+    uint32_t cycles = 0;
+    int index;
+
+    if (jit->used + MAX_NATIVE_BLOCK > JIT_BUFFER_SIZE)
+    {
+        return -1;
+    }
+
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+        return 0;
+    }
+
+    c.code = jit->buffer + jit->used;
+    c.at = 0;
+    c.exit_count = 0;
+
+    emit_prologue(&c);
+
+    for (index = 0; index < block->count; index++)
+    {
+        const micro_op_t * uop = &block->ops[index];
+        int emitted = emit_instruction(&c, uop, index, cycles);
+
+        if (emitted == 0)
+        {
+            if (index > 0)
+            {
+                emit_exit(&c, uop->address, exit_result(index, cycles));
+            }
+            break;
+        }
+
+        cycles += opcode_table[uop->opcode].cycles;
+
+        if (emitted < 0)
+        {
+            break;
+        }
+    }
+
+    if (index == block->count)
+    {
+        emit_exit(&c, block->start + block->size, exit_result(index, cycles));
+    }
+
+    for (int i = 0; i < c.exit_count; i++)
+    {
+        patch32(&c, c.exits[i].patch, c.at - (c.exits[i].patch + 4));
+        emit_exit(&c, c.exits[i].pc, c.exits[i].result);
+    }
+
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0)
+    {
+        return -1;
+    }
+
+    if (index > 0)
+    {
+        void * code = c.code;
+        memcpy(&block->native, &code, sizeof(block->native));
+        jit->used += (c.at + 15) & ~(size_t)15;
+    }
+
+    return index > 0;
+}
+
+#else
+
+/*
+ * No native code generator for this host. The block executor carries on
+ * without one.
+ */
+
+jit_t *
+create_jit(void)
+{
+    return NULL;
+}
+
+void
+free_jit(jit_t * jit)
+{
+    (void)jit;
+}
+
+void
+reset_jit(jit_t * jit)
+{
+    (void)jit;
+}
+
+int
+compile_block(jit_t * jit, block_t * block)
+{
+    (void)jit;
+    (void)block;
+    return 0;
+}
+
+#endif
+
+uint32_t
+run_native_block(cpu_8080_t * cpu, const block_t * block)
+{
+    jit_registers_t registers;
+
+    registers.af = cpu->a | (pack_condition_codes(cpu) << 8);
+    registers.bc = (cpu->b << 8) | cpu->c;
+    registers.de = (cpu->d << 8) | cpu->e;
+    registers.hl = (cpu->h << 8) | cpu->l;
+
+    uint32_t result = block->native(cpu, &registers);
+
+    cpu->a = registers.af & 0xFF;
+    unpack_condition_codes(cpu, registers.af >> 8);
+    cpu->b = registers.bc >> 8;
+    cpu->c = registers.bc & 0xFF;
+    cpu->d = registers.de >> 8;
+    cpu->e = registers.de & 0xFF;
+    cpu->h = registers.hl >> 8;
+    cpu->l = registers.hl & 0xFF;
+
+    return result;
+}
@@ -0,0 +1,416 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_cache.h"
+#include "emulator.h"
+#include "memory_map.h"
+
+/*
+ * Addresses and sizes are rounded out to whole pages. Mirrored pages form
+ * rings through mirror[], each page pointing at the next with the same
+ * bytes; a page on its own points at itself.
+ */
+
+static int
+first_page(uint16_t address)
+{
+    return address >> 8;
+}
+
+static int
+page_count(uint16_t address, size_t size)
+{
+    size_t end = ((size_t)address + size + 0xFF) >> 8;
+
+    return (end > 256 ? 256 : (int)end) - first_page(address);
+}
+
+/*
+ * Attaches an empty map to the machine: every page plain RAM. Returns it,
+ * or NULL if out of memory.
+ */
+memory_map_t *
+create_memory_map(cpu_8080_t * cpu)
+{
+    memory_map_t * map = calloc(1, sizeof(memory_map_t));
+    if (map == NULL)
+    {
+        return NULL;
+    }
+
+    for (int page = 0; page < 256; page++)
+    {
+        map->mirror[page] = page;
+    }
+
+    cpu->memory_map = map;
+    return map;
+}
+
+// Detaches the machine's map and frees it, leaving every page plain RAM.
+void
+free_memory_map(cpu_8080_t * cpu)
+{
+    for (int page = 0; page < 256; page++)
+    {
+        cpu->page_flags[page] &= ~PAGE_MAPPED;
+    }
+
+    free(cpu->memory_map);
+    cpu->memory_map = NULL;
+}
+
+// Takes a page out of its ring of mirrors.
+static void
+unlink_page(cpu_8080_t * cpu, int page)
+{
+    memory_map_t * map = cpu->memory_map;
+    int before = page;
+
+    while (map->mirror[before] != page)
+    {
+        before = map->mirror[before];
+    }
+
+    map->mirror[before] = map->mirror[page];
+    map->mirror[page] = page;
+    cpu->page_flags[page] &= ~PAGE_MIRROR;
+
+    if (map->mirror[before] == before)
+    {
+        cpu->page_flags[before] &= ~PAGE_MIRROR;
+    }
+}
+
+// Makes pages plain RAM again, unmirrored.
+static void
+reset_pages(cpu_8080_t * cpu, int first, int count)
+{
+    for (int page = first; page < first + count; page++)
+    {
+        unlink_page(cpu, page);
+        cpu->page_flags[page] &= ~PAGE_MAPPED;
+        cpu->memory_map->write[page] = NULL;
+        cpu->memory_map->read[page] = NULL;
+        cpu->memory_map->device[page] = NULL;
+    }
+}
+
+// Does for a page replaced as a whole what a store does for a byte.
+static void
+page_written(cpu_8080_t * cpu, int page)
+{
+    invalidate_page(cpu, page);
+
+    if (cpu->page_flags[page] & PAGE_CLEAN)
+    {
+        cpu->page_flags[page] &= ~PAGE_CLEAN;
+        cpu->dirty_pages[page / 8] |= 1 << (page % 8);
+    }
+}
+
+// Replaces the bytes of a page and of its mirrors.
+static void
+fill_page(cpu_8080_t * cpu, int page, const uint8_t * data)
+{
+    int alias = page;
+
+    do
+    {
+        memcpy(cpu->memory + alias * 256, data, 256);
+        page_written(cpu, alias);
+        alias = cpu->memory_map->mirror[alias];
+    } while (alias != page);
+}
+
+void
+map_ram_pages(cpu_8080_t * cpu, uint16_t address, size_t size)
+{
+    reset_pages(cpu, first_page(address), page_count(address, size));
+}
+
+/*
+ * Makes pages read-only, first copying data into them unless it is NULL.
+ * data holds size bytes.
+ */
+void
+map_rom_pages(cpu_8080_t * cpu, uint16_t address, size_t size, const uint8_t * data)
+{
+    int first = first_page(address);
+    int count = page_count(address, size);
+
+    reset_pages(cpu, first, count);
+
+    if (data != NULL)
+    {
+        memcpy(cpu->memory + address, data, size < 0x10000u - address ? size : 0x10000u - address);
+        for (int page = first; page < first + count; page++)
+        {
+            page_written(cpu, page);
+        }
+    }
+
+    for (int page = first; page < first + count; page++)
+    {
+        cpu->page_flags[page] |= PAGE_ROM;
+    }
+}
+
+/*
+ * Makes pages show the same bytes as the pages at source, as an address
+ * decoder that ignores some lines does. They take on the source pages'
+ * contents and whether those are ROM.
+ */
+void
+map_mirror_pages(cpu_8080_t * cpu, uint16_t address, size_t size, uint16_t source)
+{
+    memory_map_t * map = cpu->memory_map;
+    int first = first_page(address);
+    int count = page_count(address, size);
+
+    for (int i = 0; i < count && first_page(source) + i < 256; i++)
+    {
+        int page = first + i;
+        int original = first_page(source) + i;
+
+        if (page == original)
+        {
+            continue;
+        }
+
+        reset_pages(cpu, page, 1);
+        fill_page(cpu, page, cpu->memory + original * 256);
+
+        map->mirror[page] = map->mirror[original];
+        map->mirror[original] = page;
+        cpu->page_flags[page] |= PAGE_MIRROR | (cpu->page_flags[original] & PAGE_ROM);
+        cpu->page_flags[original] |= PAGE_MIRROR;
+    }
+}
+
+/*
+ * Hands stores to pages to a device. Loads go to read if it is given, and
+ * otherwise read the pages' bytes, which the device is to keep up to date.
+ */
+void
+map_mmio_pages(cpu_8080_t * cpu, uint16_t address, size_t size,
+               mmio_write_t write, mmio_read_t read, void * device)
+{
+    int first = first_page(address);
+    int count = page_count(address, size);
+
+    reset_pages(cpu, first, count);
+
+    for (int page = first; page < first + count; page++)
+    {
+        cpu->memory_map->write[page] = write;
+        cpu->memory_map->read[page] = read;
+        cpu->memory_map->device[page] = device;
+        cpu->page_flags[page] |= read != NULL ? PAGE_MMIO | PAGE_MMIO_IN : PAGE_MMIO;
+    }
+}
+
+static int
+add_window(cpu_8080_t * cpu, uint16_t address, size_t size,
+           const uint8_t * banks, uint8_t * save, size_t bank_count)
+{
+    memory_map_t * map = cpu->memory_map;
+    int first = first_page(address);
+    int count = page_count(address, size);
+
+    if (map->window_count == MAX_BANK_WINDOWS || bank_count == 0)
+    {
+        return -1;
+    }
+
+    bank_window_t * window = &map->windows[map->window_count];
+
+    window->first_page = first;
+    window->pages = count;
+    window->banks = banks;
+    window->save = save;
+    window->bank_count = bank_count;
+    window->bank = 0;
+
+    reset_pages(cpu, first, count);
+    for (int i = 0; i < count; i++)
+    {
+        fill_page(cpu, first + i, banks + i * 256);
+
+        if (save == NULL)
+        {
+            cpu->page_flags[first + i] |= PAGE_ROM;
+        }
+    }
+
+    return map->window_count++;
+}
+
+/*
+ * Maps bank 0 of bank_count ROM banks of size bytes each, a whole number
+ * of pages, into the window at address. Returns the window's number for
+ * switch_bank(), or -1 if there are MAX_BANK_WINDOWS already.
+ */
+int
+map_bank_window(cpu_8080_t * cpu, uint16_t address, size_t size,
+                const uint8_t * banks, size_t bank_count)
+{
+    return add_window(cpu, address, size, banks, NULL, bank_count);
+}
+
+// As map_bank_window(), for banks of RAM.
+int
+map_ram_bank_window(cpu_8080_t * cpu, uint16_t address, size_t size,
+                    uint8_t * banks, size_t bank_count)
+{
+    return add_window(cpu, address, size, banks, banks, bank_count);
+}
+
+/*
+ * Maps another bank into a window. Costs a copy of the window, or two for
+ * RAM, rather than anything on each access.
+ */
+void
+switch_bank(cpu_8080_t * cpu, int window, size_t bank)
+{
+    bank_window_t * w = &cpu->memory_map->windows[window];
+    size_t length = w->pages * 256;
+
+    if (bank >= w->bank_count || bank == w->bank)
+    {
+        return;
+    }
+
+    if (w->save != NULL)
+    {
+        memcpy(w->save + w->bank * length, cpu->memory + w->first_page * 256, length);
+        cpu->memory_map->bank_writes++;
+    }
+
+    for (int i = 0; i < w->pages; i++)
+    {
+        fill_page(cpu, w->first_page + i, w->banks + bank * length + i * 256);
+    }
+
+    w->bank = bank;
+}
+
+// The bytes of all the RAM banks' stores, end to end.
+size_t
+bank_store_size(const memory_map_t * map)
+{
+    size_t size = 0;
+
+    for (int i = 0; i < map->window_count; i++)
+    {
+        const bank_window_t * w = &map->windows[i];
+
+        if (w->save != NULL)
+        {
+            size += w->bank_count * w->pages * 256;
+        }
+    }
+
+    return size;
+}
+
+/*
+ * Copies out which bank each window shows, to MAX_BANK_WINDOWS banks, and
+ * the RAM banks' stores, to bank_store_size() bytes of stores unless it is
+ * NULL. The bytes in the windows themselves are memory, and are not copied.
+ */
+void
+save_banks(const memory_map_t * map, size_t * banks, uint8_t * stores)
+{
+    for (int i = 0; i < map->window_count; i++)
+    {
+        const bank_window_t * w = &map->windows[i];
+
+        banks[i] = w->bank;
+
+        if (w->save != NULL && stores != NULL)
+        {
+            size_t size = w->bank_count * w->pages * 256;
+
+            memcpy(stores, w->save, size);
+            stores += size;
+        }
+    }
+}
+
+/*
+ * Puts back what save_banks() copied out, once the windows' pages of
+ * memory are back as they were too.
+ */
+void
+load_banks(memory_map_t * map, const size_t * banks, const uint8_t * stores)
+{
+    for (int i = 0; i < map->window_count; i++)
+    {
+        bank_window_t * w = &map->windows[i];
+
+        w->bank = banks[i];
+
+        if (w->save != NULL && stores != NULL)
+        {
+            size_t size = w->bank_count * w->pages * 256;
+
+            memcpy(w->save, stores, size);
+            stores += size;
+        }
+    }
+}
+
+/*
+ * Returns a copy of the map, wired to the same devices and ROM banks but
+ * with RAM banks of its own, for another machine to run in. Returns NULL
+ * if out of memory. Free it with free_memory_map_copy().
+ */
+memory_map_t *
+copy_memory_map(const memory_map_t * map)
+{
+    memory_map_t * copy = malloc(sizeof(memory_map_t));
+    size_t size = bank_store_size(map);
+
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+
+    *copy = *map;
+    copy->stores = NULL;
+
+    if (size != 0 && (copy->stores = malloc(size)) == NULL)
+    {
+        free(copy);
+        return NULL;
+    }
+
+    uint8_t * stores = copy->stores;
+
+    for (int i = 0; i < copy->window_count; i++)
+    {
+        bank_window_t * w = &copy->windows[i];
+
+        if (w->save != NULL)
+        {
+            size_t length = w->bank_count * w->pages * 256;
+
+            memcpy(stores, w->save, length);
+            w->banks = w->save = stores;
+            stores += length;
+        }
+    }
+
+    return copy;
+}
+
+void
+free_memory_map_copy(memory_map_t * map)
+{
+    if (map != NULL)
+    {
+        free(map->stores);
+        free(map);
+    }
+}
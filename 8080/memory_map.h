@@ -0,0 +1,81 @@
+#ifndef MEMORY_MAP_8080_H_
+#define MEMORY_MAP_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emulator.h"
+
+#define MAX_BANK_WINDOWS 4
+
+// Called for each store to an MMIO page, in place of the store.
+typedef void (*mmio_write_t)(void * device, uint16_t address, uint8_t value);
+
+// Called for each load from an MMIO page that has one, in place of the
+// load, with the cycle the loading instruction started on.
+typedef uint8_t (*mmio_read_t)(void * device, uint16_t address, uint64_t cycle);
+
+// A run of pages that shows one bank at a time out of a larger store.
+typedef struct bank_window
+{
+    uint8_t first_page;
+    uint16_t pages;
+    const uint8_t * banks;  // bank n is pages * 256 bytes at n * pages * 256
+    uint8_t * save;         // for RAM banks, the same store, written back on a switch
+    size_t bank_count;
+    size_t bank;            // the bank mapped in
+} bank_window_t;
+
+/*
+ * What is behind each 256-byte page of the address space. cpu->memory
+ * stays the CPU's flat view of it, so loads from and stores to plain RAM
+ * are a single indexed access. Pages that are anything else carry a
+ * PAGE_ flag, and only stores to those take the slow path:
+ *
+ *   ROM     stores are dropped
+ *   MMIO    stores go to the device, which keeps the page's bytes, as
+ *           loads see them, up to date; or, given a read handler, loads
+ *           go to the device as well, for registers that change with time
+ *           or clear when read (PAGE_MMIO_IN)
+ *   mirror  pages share their bytes, stores going to every copy
+ *
+ * Instruction fetches always see the page's bytes. Loads a device answers
+ * are recorded by a replay, as IN is.
+ *
+ * Bank windows copy a bank in when it is switched to, copying a RAM bank
+ * back out first, and throw away any code translated from the window.
+ * Which bank each window shows, and the RAM banks' stores, are state like
+ * memory: save_banks() and load_banks() take and put back a copy, and a
+ * copy of the map made with copy_memory_map() has stores of its own.
+ */
+typedef struct memory_map
+{
+    uint8_t mirror[256];        // the next page with the same bytes, or itself
+    mmio_write_t write[256];
+    mmio_read_t read[256];
+    void * device[256];
+    bank_window_t windows[MAX_BANK_WINDOWS];
+    int window_count;
+    uint64_t bank_writes;       // RAM banks written back to their stores so far
+    uint8_t * stores;           // the RAM banks a copy owns, or NULL
+} memory_map_t;
+
+memory_map_t * create_memory_map(cpu_8080_t * cpu);
+void free_memory_map(cpu_8080_t * cpu);
+void map_ram_pages(cpu_8080_t * cpu, uint16_t address, size_t size);
+void map_rom_pages(cpu_8080_t * cpu, uint16_t address, size_t size, const uint8_t * data);
+void map_mirror_pages(cpu_8080_t * cpu, uint16_t address, size_t size, uint16_t source);
+void map_mmio_pages(cpu_8080_t * cpu, uint16_t address, size_t size,
+                    mmio_write_t write, mmio_read_t read, void * device);
+int map_bank_window(cpu_8080_t * cpu, uint16_t address, size_t size,
+                    const uint8_t * banks, size_t bank_count);
+int map_ram_bank_window(cpu_8080_t * cpu, uint16_t address, size_t size,
+                        uint8_t * banks, size_t bank_count);
+void switch_bank(cpu_8080_t * cpu, int window, size_t bank);
+
+size_t bank_store_size(const memory_map_t * map);
+void save_banks(const memory_map_t * map, size_t * banks, uint8_t * stores);
+void load_banks(memory_map_t * map, const size_t * banks, const uint8_t * stores);
+memory_map_t * copy_memory_map(const memory_map_t * map);
+void free_memory_map_copy(memory_map_t * map);
+
+#endif /* !MEMORY_MAP_8080_H_ */
@@ -0,0 +1,332 @@
+#include <stddef.h>
+#include "opcodes.h"
+
+#define ALL  (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_CY)
+#define SZAP (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P)
+#define CY   FLAG_CY
+
+#define TO   FLOW_JUMP
+#define GOTO (FLOW_JUMP | FLOW_END)
+#define END  FLOW_END
+#define RST  FLOW_RESTART
+
+/*
+ * Opcode, mnemonic, operand, states, the flags it changes and where it can
+ * send the program counter. Both tables below are built from this list.
+ *
+ * https://pastraiser.com/cpu/i8080/i8080_opcodes.html
+ */
+#define OPCODES(X)                                \
+    X(0x00, "NOP",       NONE,     4, 0,    0   ) \
+    X(0x01, "LXI\tB",    WORD,    10, 0,    0   ) \
+    X(0x02, "STAX\tB",   NONE,     7, 0,    0   ) \
+    X(0x03, "INX\tB",    NONE,     5, 0,    0   ) \
+    X(0x04, "INR\tB",    NONE,     5, SZAP, 0   ) \
+    X(0x05, "DCR\tB",    NONE,     5, SZAP, 0   ) \
+    X(0x06, "MVI\tB",    BYTE,     7, 0,    0   ) \
+    X(0x07, "RLC",       NONE,     4, CY,   0   ) \
+    X(0x08, "NOP",       NONE,     4, 0,    0   ) \
+    X(0x09, "DAD\tB",    NONE,    10, CY,   0   ) \
+    X(0x0A, "LDAX\tB",   NONE,     7, 0,    0   ) \
+    X(0x0B, "DCX\tB",    NONE,     5, 0,    0   ) \
+    X(0x0C, "INR\tC",    NONE,     5, SZAP, 0   ) \
+    X(0x0D, "DCR\tC",    NONE,     5, SZAP, 0   ) \
+    X(0x0E, "MVI\tC",    BYTE,     7, 0,    0   ) \
+    X(0x0F, "RRC",       NONE,     4, CY,   0   ) \
+                                                  \
+    X(0x10, "NOP",       NONE,     4, 0,    0   ) \
+    X(0x11, "LXI\tD",    WORD,    10, 0,    0   ) \
+    X(0x12, "STAX\tD",   NONE,     7, 0,    0   ) \
+    X(0x13, "INX\tD",    NONE,     5, 0,    0   ) \
+    X(0x14, "INR\tD",    NONE,     5, SZAP, 0   ) \
+    X(0x15, "DCR\tD",    NONE,     5, SZAP, 0   ) \
+    X(0x16, "MVI\tD",    BYTE,     7, 0,    0   ) \
+    X(0x17, "RAL",       NONE,     4, CY,   0   ) \
+    X(0x18, "NOP",       NONE,     4, 0,    0   ) \
+    X(0x19, "DAD\tD",    NONE,    10, CY,   0   ) \
+    X(0x1A, "LDAX\tD",   NONE,     7, 0,    0   ) \
+    X(0x1B, "DCX\tD",    NONE,     5, 0,    0   ) \
+    X(0x1C, "INR\tE",    NONE,     5, SZAP, 0   ) \
+    X(0x1D, "DCR\tE",    NONE,     5, SZAP, 0   ) \
+    X(0x1E, "MVI\tE",    BYTE,     7, 0,    0   ) \
+    X(0x1F, "RAR",       NONE,     4, CY,   0   ) \
+                                                  \
+    X(0x20, "NOP",       NONE,     4, 0,    0   ) \
+    X(0x21, "LXI\tH",    WORD,    10, 0,    0   ) \
+    X(0x22, "SHLD\t",    ADDRESS, 16, 0,    0   ) \
+    X(0x23, "INX\tH",    NONE,     5, 0,    0   ) \
+    X(0x24, "INR\tH",    NONE,     5, SZAP, 0   ) \
+    X(0x25, "DCR\tH",    NONE,     5, SZAP, 0   ) \
+    X(0x26, "MVI\tH",    BYTE,     7, 0,    0   ) \
+    X(0x27, "DAA",       NONE,     4, ALL,  0   ) \
+    X(0x28, "NOP",       NONE,     4, 0,    0   ) \
+    X(0x29, "DAD\tH",    NONE,    10, CY,   0   ) \
+    X(0x2A, "LHLD\t",    ADDRESS, 16, 0,    0   ) \
+    X(0x2B, "DCX\tH",    NONE,     5, 0,    0   ) \
+    X(0x2C, "INR\tL",    NONE,     5, SZAP, 0   ) \
+    X(0x2D, "DCR\tL",    NONE,     5, SZAP, 0   ) \
+    X(0x2E, "MVI\tL",    BYTE,     7, 0,    0   ) \
+    X(0x2F, "CMA",       NONE,     4, 0,    0   ) \
+                                                  \
+    X(0x30, "NOP",       NONE,     4, 0,    0   ) \
+    X(0x31, "LXI\tSP",   WORD,    10, 0,    0   ) \
+    X(0x32, "STA\t",     ADDRESS, 13, 0,    0   ) \
+    X(0x33, "INX\tSP",   NONE,     5, 0,    0   ) \
+    X(0x34, "INR\tM",    NONE,    10, SZAP, 0   ) \
+    X(0x35, "DCR\tM",    NONE,    10, SZAP, 0   ) \
+    X(0x36, "MVI\tM",    BYTE,    10, 0,    0   ) \
+    X(0x37, "STC",       NONE,     4, CY,   0   ) \
+    X(0x38, "NOP",       NONE,     4, 0,    0   ) \
+    X(0x39, "DAD\tSP",   NONE,    10, CY,   0   ) \
+    X(0x3A, "LDA\t",     ADDRESS, 13, 0,    0   ) \
+    X(0x3B, "DCX\tSP",   NONE,     5, 0,    0   ) \
+    X(0x3C, "INR\tA",    NONE,     5, SZAP, 0   ) \
+    X(0x3D, "DCR\tA",    NONE,     5, SZAP, 0   ) \
+    X(0x3E, "MVI\tA",    BYTE,     7, 0,    0   ) \
+    X(0x3F, "CMC",       NONE,     4, CY,   0   ) \
+                                                  \
+    X(0x40, "MOV\tB,B",  NONE,     5, 0,    0   ) \
+    X(0x41, "MOV\tB,C",  NONE,     5, 0,    0   ) \
+    X(0x42, "MOV\tB,D",  NONE,     5, 0,    0   ) \
+    X(0x43, "MOV\tB,E",  NONE,     5, 0,    0   ) \
+    X(0x44, "MOV\tB,H",  NONE,     5, 0,    0   ) \
+    X(0x45, "MOV\tB,L",  NONE,     5, 0,    0   ) \
+    X(0x46, "MOV\tB,M",  NONE,     7, 0,    0   ) \
+    X(0x47, "MOV\tB,A",  NONE,     5, 0,    0   ) \
+    X(0x48, "MOV\tC,B",  NONE,     5, 0,    0   ) \
+    X(0x49, "MOV\tC,C",  NONE,     5, 0,    0   ) \
+    X(0x4A, "MOV\tC,D",  NONE,     5, 0,    0   ) \
+    X(0x4B, "MOV\tC,E",  NONE,     5, 0,    0   ) \
+    X(0x4C, "MOV\tC,H",  NONE,     5, 0,    0   ) \
+    X(0x4D, "MOV\tC,L",  NONE,     5, 0,    0   ) \
+    X(0x4E, "MOV\tC,M",  NONE,     7, 0,    0   ) \
+    X(0x4F, "MOV\tC,A",  NONE,     5, 0,    0   ) \
+                                                  \
+    X(0x50, "MOV\tD,B",  NONE,     5, 0,    0   ) \
+    X(0x51, "MOV\tD,C",  NONE,     5, 0,    0   ) \
+    X(0x52, "MOV\tD,D",  NONE,     5, 0,    0   ) \
+    X(0x53, "MOV\tD,E",  NONE,     5, 0,    0   ) \
+    X(0x54, "MOV\tD,H",  NONE,     5, 0,    0   ) \
+    X(0x55, "MOV\tD,L",  NONE,     5, 0,    0   ) \
+    X(0x56, "MOV\tD,M",  NONE,     7, 0,    0   ) \
+    X(0x57, "MOV\tD,A",  NONE,     5, 0,    0   ) \
+    X(0x58, "MOV\tE,B",  NONE,     5, 0,    0   ) \
+    X(0x59, "MOV\tE,C",  NONE,     5, 0,    0   ) \
+    X(0x5A, "MOV\tE,D",  NONE,     5, 0,    0   ) \
+    X(0x5B, "MOV\tE,E",  NONE,     5, 0,    0   ) \
+    X(0x5C, "MOV\tE,H",  NONE,     5, 0,    0   ) \
+    X(0x5D, "MOV\tE,L",  NONE,     5, 0,    0   ) \
+    X(0x5E, "MOV\tE,M",  NONE,     7, 0,    0   ) \
+    X(0x5F, "MOV\tE,A",  NONE,     5, 0,    0   ) \
+                                                  \
+    X(0x60, "MOV\tH,B",  NONE,     5, 0,    0   ) \
+    X(0x61, "MOV\tH,C",  NONE,     5, 0,    0   ) \
+    X(0x62, "MOV\tH,D",  NONE,     5, 0,    0   ) \
+    X(0x63, "MOV\tH,E",  NONE,     5, 0,    0   ) \
+    X(0x64, "MOV\tH,H",  NONE,     5, 0,    0   ) \
+    X(0x65, "MOV\tH,L",  NONE,     5, 0,    0   ) \
+    X(0x66, "MOV\tH,M",  NONE,     7, 0,    0   ) \
+    X(0x67, "MOV\tH,A",  NONE,     5, 0,    0   ) \
+    X(0x68, "MOV\tL,B",  NONE,     5, 0,    0   ) \
+    X(0x69, "MOV\tL,C",  NONE,     5, 0,    0   ) \
+    X(0x6A, "MOV\tL,D",  NONE,     5, 0,    0   ) \
+    X(0x6B, "MOV\tL,E",  NONE,     5, 0,    0   ) \
+    X(0x6C, "MOV\tL,H",  NONE,     5, 0,    0   ) \
+    X(0x6D, "MOV\tL,L",  NONE,     5, 0,    0   ) \
+    X(0x6E, "MOV\tL,M",  NONE,     7, 0,    0   ) \
+    X(0x6F, "MOV\tL,A",  NONE,     5, 0,    0   ) \
+                                                  \
+    X(0x70, "MOV\tM,B",  NONE,     7, 0,    0   ) \
+    X(0x71, "MOV\tM,C",  NONE,     7, 0,    0   ) \
+    X(0x72, "MOV\tM,D",  NONE,     7, 0,    0   ) \
+    X(0x73, "MOV\tM,E",  NONE,     7, 0,    0   ) \
+    X(0x74, "MOV\tM,H",  NONE,     7, 0,    0   ) \
+    X(0x75, "MOV\tM,L",  NONE,     7, 0,    0   ) \
+    X(0x76, "HLT",       NONE,     7, 0,    0   ) \
+    X(0x77, "MOV\tM,A",  NONE,     7, 0,    0   ) \
+    X(0x78, "MOV\tA,B",  NONE,     5, 0,    0   ) \
+    X(0x79, "MOV\tA,C",  NONE,     5, 0,    0   ) \
+    X(0x7A, "MOV\tA,D",  NONE,     5, 0,    0   ) \
+    X(0x7B, "MOV\tA,E",  NONE,     5, 0,    0   ) \
+    X(0x7C, "MOV\tA,H",  NONE,     5, 0,    0   ) \
+    X(0x7D, "MOV\tA,L",  NONE,     5, 0,    0   ) \
+    X(0x7E, "MOV\tA,M",  NONE,     7, 0,    0   ) \
+    X(0x7F, "MOV\tA,A",  NONE,     5, 0,    0   ) \
+                                                  \
+    X(0x80, "ADD\tB",    NONE,     4, ALL,  0   ) \
+    X(0x81, "ADD\tC",    NONE,     4, ALL,  0   ) \
+    X(0x82, "ADD\tD",    NONE,     4, ALL,  0   ) \
+    X(0x83, "ADD\tE",    NONE,     4, ALL,  0   ) \
+    X(0x84, "ADD\tH",    NONE,     4, ALL,  0   ) \
+    X(0x85, "ADD\tL",    NONE,     4, ALL,  0   ) \
+    X(0x86, "ADD\tM",    NONE,     7, ALL,  0   ) \
+    X(0x87, "ADD\tA",    NONE,     4, ALL,  0   ) \
+    X(0x88, "ADC\tB",    NONE,     4, ALL,  0   ) \
+    X(0x89, "ADC\tC",    NONE,     4, ALL,  0   ) \
+    X(0x8A, "ADC\tD",    NONE,     4, ALL,  0   ) \
+    X(0x8B, "ADC\tE",    NONE,     4, ALL,  0   ) \
+    X(0x8C, "ADC\tH",    NONE,     4, ALL,  0   ) \
+    X(0x8D, "ADC\tL",    NONE,     4, ALL,  0   ) \
+    X(0x8E, "ADC\tM",    NONE,     7, ALL,  0   ) \
+    X(0x8F, "ADC\tA",    NONE,     4, ALL,  0   ) \
+                                                  \
+    X(0x90, "SUB\tB",    NONE,     4, ALL,  0   ) \
+    X(0x91, "SUB\tC",    NONE,     4, ALL,  0   ) \
+    X(0x92, "SUB\tD",    NONE,     4, ALL,  0   ) \
+    X(0x93, "SUB\tE",    NONE,     4, ALL,  0   ) \
+    X(0x94, "SUB\tH",    NONE,     4, ALL,  0   ) \
+    X(0x95, "SUB\tL",    NONE,     4, ALL,  0   ) \
+    X(0x96, "SUB\tM",    NONE,     7, ALL,  0   ) \
+    X(0x97, "SUB\tA",    NONE,     4, ALL,  0   ) \
+    X(0x98, "SBB\tB",    NONE,     4, ALL,  0   ) \
+    X(0x99, "SBB\tC",    NONE,     4, ALL,  0   ) \
+    X(0x9A, "SBB\tD",    NONE,     4, ALL,  0   ) \
+    X(0x9B, "SBB\tE",    NONE,     4, ALL,  0   ) \
+    X(0x9C, "SBB\tH",    NONE,     4, ALL,  0   ) \
+    X(0x9D, "SBB\tL",    NONE,     4, ALL,  0   ) \
+    X(0x9E, "SBB\tM",    NONE,     7, ALL,  0   ) \
+    X(0x9F, "SBB\tA",    NONE,     4, ALL,  0   ) \
+                                                  \
+    X(0xA0, "ANA\tB",    NONE,     4, ALL,  0   ) \
+    X(0xA1, "ANA\tC",    NONE,     4, ALL,  0   ) \
+    X(0xA2, "ANA\tD",    NONE,     4, ALL,  0   ) \
+    X(0xA3, "ANA\tE",    NONE,     4, ALL,  0   ) \
+    X(0xA4, "ANA\tH",    NONE,     4, ALL,  0   ) \
+    X(0xA5, "ANA\tL",    NONE,     4, ALL,  0   ) \
+    X(0xA6, "ANA\tM",    NONE,     7, ALL,  0   ) \
+    X(0xA7, "ANA\tA",    NONE,     4, ALL,  0   ) \
+    X(0xA8, "XRA\tB",    NONE,     4, ALL,  0   ) \
+    X(0xA9, "XRA\tC",    NONE,     4, ALL,  0   ) \
+    X(0xAA, "XRA\tD",    NONE,     4, ALL,  0   ) \
+    X(0xAB, "XRA\tE",    NONE,     4, ALL,  0   ) \
+    X(0xAC, "XRA\tH",    NONE,     4, ALL,  0   ) \
+    X(0xAD, "XRA\tL",    NONE,     4, ALL,  0   ) \
+    X(0xAE, "XRA\tM",    NONE,     7, ALL,  0   ) \
+    X(0xAF, "XRA\tA",    NONE,     4, ALL,  0   ) \
+                                                  \
+    X(0xB0, "ORA\tB",    NONE,     4, ALL,  0   ) \
+    X(0xB1, "ORA\tC",    NONE,     4, ALL,  0   ) \
+    X(0xB2, "ORA\tD",    NONE,     4, ALL,  0   ) \
+    X(0xB3, "ORA\tE",    NONE,     4, ALL,  0   ) \
+    X(0xB4, "ORA\tH",    NONE,     4, ALL,  0   ) \
+    X(0xB5, "ORA\tL",    NONE,     4, ALL,  0   ) \
+    X(0xB6, "ORA\tM",    NONE,     7, ALL,  0   ) \
+    X(0xB7, "ORA\tA",    NONE,     4, ALL,  0   ) \
+    X(0xB8, "CMP\tB",    NONE,     4, ALL,  0   ) \
+    X(0xB9, "CMP\tC",    NONE,     4, ALL,  0   ) \
+    X(0xBA, "CMP\tD",    NONE,     4, ALL,  0   ) \
+    X(0xBB, "CMP\tE",    NONE,     4, ALL,  0   ) \
+    X(0xBC, "CMP\tH",    NONE,     4, ALL,  0   ) \
+    X(0xBD, "CMP\tL",    NONE,     4, ALL,  0   ) \
+    X(0xBE, "CMP\tM",    NONE,     7, ALL,  0   ) \
+    X(0xBF, "CMP\tA",    NONE,     4, ALL,  0   ) \
+                                                  \
+    X(0xC0, "RNZ",       NONE,     5, 0,    0   ) \
+    X(0xC1, "POP\tB",    NONE,    10, 0,    0   ) \
+    X(0xC2, "JNZ\t",     ADDRESS, 10, 0,    TO  ) \
+    X(0xC3, "JMP\t",     ADDRESS, 10, 0,    GOTO) \
+    X(0xC4, "CNZ\t",     ADDRESS, 11, 0,    TO  ) \
+    X(0xC5, "PUSH\tB",   NONE,    11, 0,    0   ) \
+    X(0xC6, "ADI\t",     BYTE,     7, ALL,  0   ) \
+    X(0xC7, "RST\t0",    NONE,    11, 0,    RST ) \
+    X(0xC8, "RZ",        NONE,     5, 0,    0   ) \
+    X(0xC9, "RET",       NONE,    10, 0,    END ) \
+    X(0xCA, "JZ \t",     ADDRESS, 10, 0,    TO  ) \
+    X(0xCB, "JMP\t",     ADDRESS, 10, 0,    GOTO) \
+    X(0xCC, "CZ \t",     ADDRESS, 11, 0,    TO  ) \
+    X(0xCD, "CALL\t",    ADDRESS, 17, 0,    TO  ) \
+    X(0xCE, "ACI\t",     BYTE,     7, ALL,  0   ) \
+    X(0xCF, "RST\t1",    NONE,    11, 0,    RST ) \
+                                                  \
+    X(0xD0, "RNC",       NONE,     5, 0,    0   ) \
+    X(0xD1, "POP\tD",    NONE,    10, 0,    0   ) \
+    X(0xD2, "JNC\t",     ADDRESS, 10, 0,    TO  ) \
+    X(0xD3, "OUT\t",     BYTE,    10, 0,    0   ) \
+    X(0xD4, "CNC\t",     ADDRESS, 11, 0,    TO  ) \
+    X(0xD5, "PUSH\tD",   NONE,    11, 0,    0   ) \
+    X(0xD6, "SUI\t",     BYTE,     7, ALL,  0   ) \
+    X(0xD7, "RST\t2",    NONE,    11, 0,    RST ) \
+    X(0xD8, "RC",        NONE,     5, 0,    0   ) \
+    X(0xD9, "RET",       NONE,    10, 0,    END ) \
+    X(0xDA, "JC \t",     ADDRESS, 10, 0,    TO  ) \
+    X(0xDB, "IN \t",     BYTE,    10, 0,    0   ) \
+    X(0xDC, "CC \t",     ADDRESS, 11, 0,    TO  ) \
+    X(0xDD, "CALL\t",    ADDRESS, 17, 0,    TO  ) \
+    X(0xDE, "SBI\t",     BYTE,     7, ALL,  0   ) \
+    X(0xDF, "RST\t3",    NONE,    11, 0,    RST ) \
+                                                  \
+    X(0xE0, "RPO",       NONE,     5, 0,    0   ) \
+    X(0xE1, "POP\tH",    NONE,    10, 0,    0   ) \
+    X(0xE2, "JPO\t",     ADDRESS, 10, 0,    TO  ) \
+    X(0xE3, "XTHL",      NONE,    18, 0,    0   ) \
+    X(0xE4, "CPO\t",     ADDRESS, 11, 0,    TO  ) \
+    X(0xE5, "PUSH\tH",   NONE,    11, 0,    0   ) \
+    X(0xE6, "ANI\t",     BYTE,     7, ALL,  0   ) \
+    X(0xE7, "RST\t4",    NONE,    11, 0,    RST ) \
+    X(0xE8, "RPE",       NONE,     5, 0,    0   ) \
+    X(0xE9, "PCHL",      NONE,     5, 0,    END ) \
+    X(0xEA, "JPE\t",     ADDRESS, 10, 0,    TO  ) \
+    X(0xEB, "XCHG",      NONE,     4, 0,    0   ) \
+    X(0xEC, "CPE\t",     ADDRESS, 11, 0,    TO  ) \
+    X(0xED, "CALL\t",    ADDRESS, 17, 0,    TO  ) \
+    X(0xEE, "XRI\t",     BYTE,     7, ALL,  0   ) \
+    X(0xEF, "RST\t5",    NONE,    11, 0,    RST ) \
+                                                  \
+    X(0xF0, "RP",        NONE,     5, 0,    0   ) \
+    X(0xF1, "POP\tPSW",  NONE,    10, ALL,  0   ) \
+    X(0xF2, "JP \t",     ADDRESS, 10, 0,    TO  ) \
+    X(0xF3, "DI",        NONE,     4, 0,    0   ) \
+    X(0xF4, "CP \t",     ADDRESS, 11, 0,    TO  ) \
+    X(0xF5, "PUSH\tPSW", NONE,    11, 0,    0   ) \
+    X(0xF6, "ORI\t",     BYTE,     7, ALL,  0   ) \
+    X(0xF7, "RST\t6",    NONE,    11, 0,    RST ) \
+    X(0xF8, "RM",        NONE,     5, 0,    0   ) \
+    X(0xF9, "SPHL",      NONE,     5, 0,    0   ) \
+    X(0xFA, "JM \t",     ADDRESS, 10, 0,    TO  ) \
+    X(0xFB, "EI",        NONE,     4, 0,    0   ) \
+    X(0xFC, "CM \t",     ADDRESS, 11, 0,    TO  ) \
+    X(0xFD, "CALL\t",    ADDRESS, 17, 0,    TO  ) \
+    X(0xFE, "CPI\t",     BYTE,     7, ALL,  0   ) \
+    X(0xFF, "RST\t7",    NONE,    11, 0,    RST )
+
+/*
+ * The mnemonics, packed end to end. Each is a member of a struct of char
+ * arrays, which has no padding, so offsetof() gives its position in the
+ * pool at compile time.
+ */
+#define MNEMONIC_FIELD(op, text, operand, cycles, flags, flow) char text_##op[sizeof(text)];
+#define MNEMONIC_TEXT(op, text, operand, cycles, flags, flow) text,
+
+static const struct mnemonics
+{
+    OPCODES(MNEMONIC_FIELD)
+    char padding[MAX_MNEMONIC_LENGTH];
+} mnemonics = {
+    OPCODES(MNEMONIC_TEXT)
+    ""
+};
+
+const char * const opcode_mnemonics = (const char *)&mnemonics;
+
+#define BYTES_NONE    0
+#define BYTES_BYTE    1
+#define BYTES_WORD    2
+#define BYTES_ADDRESS 2
+
+#define OPCODE_ENTRY(op, text, operand, cycles, flags, flow) \
+    {                                                        \
+        offsetof(struct mnemonics, text_##op),               \
+        sizeof(text) - 1,                                    \
+        1 + BYTES_##operand,                                 \
+        OPERAND_##operand,                                   \
+        cycles,                                              \
+        flags,                                               \
+        flow                                                 \
+    },
+
+const opcode_t opcode_table[256] = {
+    OPCODES(OPCODE_ENTRY)
+};
+
+// Keep the table at eight bytes an entry.
+typedef char opcode_size_check[sizeof(opcode_t) <= 8 ? 1 : -1];
@@ -0,0 +1,53 @@
+#ifndef OPCODES_8080_H_
+#define OPCODES_8080_H_
+
+#include <stdint.h>
+
+// What follows an opcode.
+enum {
+    OPERAND_NONE,
+    OPERAND_BYTE,   // an 8-bit immediate
+    OPERAND_WORD,   // a 16-bit immediate
+    OPERAND_ADDRESS // a 16-bit address
+};
+
+// Flags, as the bits of the byte PUSH PSW pushes.
+enum {
+    FLAG_CY = 0x01,
+    FLAG_P  = 0x04,
+    FLAG_AC = 0x10,
+    FLAG_Z  = 0x40,
+    FLAG_S  = 0x80
+};
+
+// Where an opcode can send the program counter, besides the next opcode.
+enum {
+    FLOW_JUMP    = 1, // to its address operand
+    FLOW_RESTART = 2, // to the RST vector in bits 3-5 of the opcode
+    FLOW_END     = 4  // never on to the next opcode
+};
+
+/*
+ * Everything about an opcode short of running it, in eight bytes, so the
+ * whole table is 2 KiB. The disassembler, the emulator and its engines all
+ * read this one table.
+ */
+typedef struct opcode
+{
+    uint16_t mnemonic;       // offset of the text in opcode_mnemonics
+    uint8_t mnemonic_length;
+    uint8_t size;            // in bytes, with the operand
+    uint8_t operand;         // OPERAND_ kind
+    uint8_t cycles;          // states; conditional calls and returns
+                             // take six more when the condition holds
+    uint8_t flags;           // FLAG_ bits it changes
+    uint8_t flow;            // FLOW_ bits
+} opcode_t;
+
+// The longest mnemonic. opcode_mnemonics can be read this far past any one.
+#define MAX_MNEMONIC_LENGTH 8
+
+extern const opcode_t opcode_table[256];
+extern const char * const opcode_mnemonics;
+
+#endif /* !OPCODES_8080_H_ */
@@ -0,0 +1,100 @@
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "ports.h"
+
+/*
+ * The queue's head and tail only ever grow and are taken modulo its size.
+ * Each is written by one thread and read by the other, with release and
+ * acquire ordering so that an entry is in place before it is seen.
+ */
+
+port_bus_t *
+create_port_bus(void)
+{
+    return calloc(1, sizeof(port_bus_t));
+}
+
+void
+free_port_bus(port_bus_t * bus)
+{
+    free(bus);
+}
+
+/*
+ * Puts a handler, or a latch or part of the shift register, behind an input
+ * port. Returns 0, or -1 if a device port has no handler, leaving the port
+ * as it was.
+ */
+int
+map_port_in(port_bus_t * bus, uint8_t port, port_kind_t kind,
+            port_read_t read, void * device)
+{
+    if (kind == PORT_DEVICE && read == NULL)
+    {
+        return -1;
+    }
+
+    bus->in[port].kind = kind;
+    bus->in[port].read = read;
+    bus->in[port].device = device;
+    return 0;
+}
+
+// The same for an output port, where queued ports need a handler too.
+int
+map_port_out(port_bus_t * bus, uint8_t port, port_kind_t kind,
+             port_write_t write, void * device)
+{
+    if ((kind == PORT_DEVICE || kind == PORT_QUEUED) && write == NULL)
+    {
+        return -1;
+    }
+
+    bus->out[port].kind = kind;
+    bus->out[port].write = write;
+    bus->out[port].device = device;
+    return 0;
+}
+
+/*
+ * Adds an OUT write to the queue, from the CPU thread. If the queue is
+ * full this waits for the device thread to drain some of it.
+ */
+void
+queue_port_write(port_bus_t * bus, uint8_t port, uint8_t value, uint64_t cycle)
+{
+    size_t tail = bus->tail;
+
+    while (tail - __atomic_load_n(&bus->head, __ATOMIC_ACQUIRE) == PORT_QUEUE_SIZE)
+    {
+        sched_yield();
+    }
+
+    bus->queue[tail % PORT_QUEUE_SIZE] = cycle << 16 | port << 8 | value;
+    __atomic_store_n(&bus->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Runs the write handlers for the queued OUT writes, oldest first, from
+ * the device thread. Returns how many there were.
+ */
+size_t
+drain_port_writes(port_bus_t * bus)
+{
+    size_t head = bus->head;
+    size_t tail = __atomic_load_n(&bus->tail, __ATOMIC_ACQUIRE);
+    size_t count = tail - head;
+
+    for (; head != tail; head++)
+    {
+        uint64_t entry = bus->queue[head % PORT_QUEUE_SIZE];
+        uint8_t port = (entry >> 8) & 0xFF;
+        const port_t * out = &bus->out[port];
+
+        out->write(out->device, port, entry & 0xFF, entry >> 16);
+    }
+
+    __atomic_store_n(&bus->head, head, __ATOMIC_RELEASE);
+    return count;
+}
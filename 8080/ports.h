@@ -0,0 +1,110 @@
+#ifndef PORTS_8080_H_
+#define PORTS_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// OUT writes the queue holds before the CPU waits for the device thread.
+// A power of two.
+#define PORT_QUEUE_SIZE 4096
+
+// What is behind a port.
+typedef enum port_kind
+{
+    PORT_UNMAPPED,      // left to cpu->port_in and cpu->port_out
+    PORT_LATCH,         // a byte: IN reads it, OUT sets it
+    PORT_SHIFT_DATA,    // OUT shifts a byte into the top of the shift register
+    PORT_SHIFT_OFFSET,  // OUT sets how far the result is shifted, 0-7
+    PORT_SHIFT_RESULT,  // IN reads the shift register, shifted
+    PORT_DEVICE,        // calls the port's handler
+    PORT_QUEUED         // OUT is queued for drain_port_writes()
+} port_kind_t;
+
+// Handlers get the cycle the IN or OUT instruction started on.
+typedef uint8_t (*port_read_t)(void * device, uint8_t port, uint64_t cycle);
+typedef void (*port_write_t)(void * device, uint8_t port, uint8_t value, uint64_t cycle);
+
+typedef struct port
+{
+    uint8_t kind;
+    uint8_t value;      // the latch
+    port_read_t read;
+    port_write_t write;
+    void * device;
+} port_t;
+
+/*
+ * A table of the 256 input and 256 output ports. Latches and the shift
+ * register, as in Space Invaders' shifter on ports 2, 3 and 4, are served
+ * inline with no call. Devices set input latches and read output ones
+ * straight from the table.
+ *
+ * OUT writes to queued ports go into a single-producer, single-consumer
+ * ring, so that an expensive device model can run on a thread of its own
+ * and the CPU only waits on it when the ring is full.
+ */
+typedef struct port_bus
+{
+    port_t in[256];
+    port_t out[256];
+    uint16_t shift;
+    uint8_t shift_offset;
+
+    size_t tail;        // next write, moved only by the CPU thread
+    uint64_t queue[PORT_QUEUE_SIZE]; // cycle << 16 | port << 8 | value
+    size_t head;        // next write to run, moved only by the device thread
+} port_bus_t;
+
+port_bus_t * create_port_bus(void);
+void free_port_bus(port_bus_t * bus);
+int map_port_in(port_bus_t * bus, uint8_t port, port_kind_t kind,
+                port_read_t read, void * device);
+int map_port_out(port_bus_t * bus, uint8_t port, port_kind_t kind,
+                 port_write_t write, void * device);
+void queue_port_write(port_bus_t * bus, uint8_t port, uint8_t value, uint64_t cycle);
+size_t drain_port_writes(port_bus_t * bus);
+
+static inline uint8_t
+bus_in(port_bus_t * bus, uint8_t port, uint64_t cycle)
+{
+    const port_t * in = &bus->in[port];
+
+    switch(in->kind)
+    {
+        case PORT_LATCH:
+            return in->value;
+        case PORT_SHIFT_RESULT:
+            return (bus->shift >> (8 - bus->shift_offset)) & 0xFF;
+        case PORT_DEVICE:
+            return in->read(in->device, port, cycle);
+        default:
+            return 0;
+    }
+}
+
+static inline void
+bus_out(port_bus_t * bus, uint8_t port, uint8_t value, uint64_t cycle)
+{
+    port_t * out = &bus->out[port];
+
+    switch(out->kind)
+    {
+        case PORT_LATCH:
+            out->value = value;
+            break;
+        case PORT_SHIFT_DATA:
+            bus->shift = (value << 8) | (bus->shift >> 8);
+            break;
+        case PORT_SHIFT_OFFSET:
+            bus->shift_offset = value & 7;
+            break;
+        case PORT_DEVICE:
+            out->write(out->device, port, value, cycle);
+            break;
+        case PORT_QUEUED:
+            queue_port_write(bus, port, value, cycle);
+            break;
+    }
+}
+
+#endif /* !PORTS_8080_H_ */
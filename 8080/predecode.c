@@ -0,0 +1,341 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opcodes.h"
+#include "predecode.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define VECTOR_CLASSIFY 1
+#endif
+
+/*
+ * Finding instruction starts is a chain: each start depends on the length
+ * of the instruction before. The chain is walked a group of eight bytes at
+ * a time. A group is named by eight base-3 digits, one per byte, for
+ * opcodes of one, two and three bytes, and only the 0-2 bytes the last
+ * instruction runs into the next group carry over. For each of those,
+ * the starts and the carry of every group are in a table.
+ */
+
+static void
+classify_scalar(const predecoder_t * predecoder, const uint8_t * block,
+                uint64_t * twos, uint64_t * threes)
+{
+    uint64_t two = 0;
+    uint64_t three = 0;
+
+    (void)predecoder;
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint8_t size = opcode_table[block[i]].size;
+
+        two |= (uint64_t)(size == 2) << i;
+        three |= (uint64_t)(size == 3) << i;
+    }
+
+    *twos = two;
+    *threes = three;
+}
+
+#ifdef VECTOR_CLASSIFY
+
+/*
+ * A byte is in a set of opcodes if the row for its low nibble has the bit
+ * for its high nibble. Rows come from one of two tables, for high nibbles
+ * below and above 8, picked by the byte's sign.
+ */
+
+__attribute__((target("ssse3")))
+static uint64_t
+member_ssse3(__m128i bytes, __m128i low, __m128i bit, const uint8_t rows[2][16])
+{
+    __m128i top = _mm_cmplt_epi8(bytes, _mm_setzero_si128());
+    __m128i below = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)rows[0]), low);
+    __m128i above = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)rows[1]), low);
+    __m128i row = _mm_or_si128(_mm_andnot_si128(top, below), _mm_and_si128(top, above));
+
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
+}
+
+__attribute__((target("ssse3")))
+static void
+classify_ssse3(const predecoder_t * predecoder, const uint8_t * block,
+               uint64_t * twos, uint64_t * threes)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128);
+    uint64_t two = 0;
+    uint64_t three = 0;
+
+    for (int i = 0; i < 64; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i low = _mm_and_si128(bytes, nibble);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+        __m128i bit = _mm_shuffle_epi8(bits, high);
+
+        two |= member_ssse3(bytes, low, bit, predecoder->rows[0]) << i;
+        three |= member_ssse3(bytes, low, bit, predecoder->rows[1]) << i;
+    }
+
+    *twos = two;
+    *threes = three;
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+member_avx2(__m256i bytes, __m256i low, __m256i bit, const uint8_t rows[2][16])
+{
+    __m256i below = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rows[0]));
+    __m256i above = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rows[1]));
+    __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(below, low),
+                                     _mm256_shuffle_epi8(above, low), bytes);
+
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+}
+
+__attribute__((target("avx2")))
+static void
+classify_avx2(const predecoder_t * predecoder, const uint8_t * block,
+              uint64_t * twos, uint64_t * threes)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128);
+    uint64_t two = 0;
+    uint64_t three = 0;
+
+    for (int i = 0; i < 64; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i low = _mm256_and_si256(bytes, nibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+        __m256i bit = _mm256_shuffle_epi8(bits, high);
+
+        two |= member_avx2(bytes, low, bit, predecoder->rows[0]) << i;
+        three |= member_avx2(bytes, low, bit, predecoder->rows[1]) << i;
+    }
+
+    *twos = two;
+    *threes = three;
+}
+
+#endif
+
+predecoder_t *
+create_predecoder(void)
+{
+    predecoder_t * predecoder = calloc(1, sizeof(predecoder_t));
+    if (predecoder == NULL)
+    {
+        return NULL;
+    }
+
+    for (int skip = 0; skip < 3; skip++)
+    {
+        for (int group = 0; group < PREDECODE_GROUPS; group++)
+        {
+            int sizes[8];
+            int position = skip;
+            uint16_t starts = 0;
+
+            for (int i = 0, digits = group; i < 8; i++, digits /= 3)
+            {
+                sizes[i] = 1 + digits % 3;
+            }
+
+            while (position < 8)
+            {
+                starts |= 1 << position;
+                position += sizes[position];
+            }
+
+            predecoder->groups[group] |= (uint64_t)(starts | (position - 8) << 8) << (skip * 16);
+        }
+    }
+
+    for (int byte = 0; byte < 256; byte++)
+    {
+        for (int i = 0, power = 1; i < 8; i++, power *= 3)
+        {
+            predecoder->digits[byte] += (byte >> i & 1) * power;
+        }
+    }
+
+    for (int opcode = 0; opcode < 256; opcode++)
+    {
+        int size = opcode_table[opcode].size;
+
+        if (size > 1)
+        {
+            predecoder->rows[size - 2][opcode >> 7][opcode & 0x0F] |= 1 << (opcode >> 4 & 7);
+        }
+    }
+
+    predecoder->classify = classify_scalar;
+
+#ifdef VECTOR_CLASSIFY
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        predecoder->classify = classify_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        predecoder->classify = classify_ssse3;
+    }
+#endif
+
+    return predecoder;
+}
+
+void
+free_predecoder(predecoder_t * predecoder)
+{
+    free(predecoder);
+}
+
+/*
+ * Walks the chain through a block of 64 bytes, entering it skip bytes in,
+ * and puts the starts in eight bytes of bits. Returns how far the last
+ * instruction runs past the block. The lookups do not depend on the chain,
+ * so only a shift is left on it.
+ */
+static int
+walk_block(const predecoder_t * predecoder, uint64_t twos, uint64_t threes,
+           int skip, uint8_t * starts)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        int group = predecoder->digits[twos >> (i * 8) & 0xFF] +
+                    2 * predecoder->digits[threes >> (i * 8) & 0xFF];
+        uint64_t next = predecoder->groups[group] >> (skip * 16);
+
+        starts[i] = next & 0xFF;
+        skip = next >> 8 & 3;
+    }
+
+    return skip;
+}
+
+/*
+ * Walks the last, partial block. Bytes past the end count as one-byte
+ * opcodes, so the first start at or past the end is where the last real
+ * instruction ends. Returns how far that is past the end.
+ */
+static int
+walk_tail(const predecoder_t * predecoder, const uint8_t * code, size_t size,
+          int skip, uint8_t * starts)
+{
+    uint8_t block[64] = { 0 };
+    uint8_t bits[8];
+    uint64_t twos;
+    uint64_t threes;
+
+    memcpy(block, code, size);
+    classify_scalar(predecoder, block, &twos, &threes);
+    skip = walk_block(predecoder, twos, threes, skip, bits);
+
+    uint64_t all = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        all = all << 8 | bits[i];
+    }
+
+    if (starts != NULL)
+    {
+        uint64_t kept = all & (((uint64_t)1 << size) - 1);
+
+        for (size_t i = 0; i < (size + 7) / 8; i++)
+        {
+            starts[i] = kept >> (i * 8);
+        }
+    }
+
+    all >>= size;
+    if (all == 0)
+    {
+        return skip + 64 - size;
+    }
+
+    int past = 0;
+    while (!(all & 1))
+    {
+        all >>= 1;
+        past++;
+    }
+
+    return past;
+}
+
+/*
+ * Marks where the instructions in code[0, size) start, one bit per byte,
+ * bit n % 8 of starts[n / 8], going from skip, 0 to 2 bytes in. starts
+ * needs (size + 7) / 8 bytes. Returns how far the last instruction runs
+ * past size, the skip for the bytes that follow.
+ */
+int
+find_instruction_starts(const predecoder_t * predecoder, const uint8_t * code,
+                        size_t size, int skip, uint8_t * starts)
+{
+    size_t blocks = size / 64;
+
+    for (size_t block = 0; block < blocks; block++)
+    {
+        uint64_t twos;
+        uint64_t threes;
+
+        predecoder->classify(predecoder, code + block * 64, &twos, &threes);
+        skip = walk_block(predecoder, twos, threes, skip, starts + block * 8);
+    }
+
+    if (size % 64)
+    {
+        skip = walk_tail(predecoder, code + blocks * 64, size % 64, skip, starts + blocks * 8);
+    }
+
+    return skip;
+}
+
+/*
+ * Works out, for each skip of 0, 1 or 2 bytes into code[0, size), how far
+ * the last instruction would run past the end. Pieces of a larger buffer
+ * can do this at the same time, and each then learn its skip from the
+ * exits of the ones before.
+ */
+void
+find_instruction_exits(const predecoder_t * predecoder, const uint8_t * code,
+                       size_t size, int exits[3])
+{
+    size_t blocks = size / 64;
+    uint8_t bits[8];
+
+    exits[0] = 0;
+    exits[1] = 1;
+    exits[2] = 2;
+
+    for (size_t block = 0; block < blocks; block++)
+    {
+        uint64_t twos;
+        uint64_t threes;
+
+        predecoder->classify(predecoder, code + block * 64, &twos, &threes);
+        for (int i = 0; i < 3; i++)
+        {
+            exits[i] = walk_block(predecoder, twos, threes, exits[i], bits);
+        }
+    }
+
+    if (size % 64)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            exits[i] = walk_tail(predecoder, code + blocks * 64, size % 64, exits[i], NULL);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef PREDECODE_8080_H_
+#define PREDECODE_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Ways of filling eight bytes with instructions of one, two and three
+// bytes, as eight base-3 digits.
+#define PREDECODE_GROUPS 6561
+
+/*
+ * Tables for finding where instructions start without decoding them one
+ * at a time. Bytes are sorted into two- and three-byte opcodes with vector
+ * table lookups, and each eight bytes of that is then looked up whole.
+ */
+typedef struct predecoder
+{
+    // For each group, 16 bits for each entry skip of 0, 1 or 2 bytes: the
+    // bits of the instruction starts in the group, and how far the last
+    // runs past it in bits 8-9.
+    uint64_t groups[PREDECODE_GROUPS];
+
+    // The group digits of the bits set in a byte: sum of 3^i for bit i.
+    uint16_t digits[256];
+
+    // For the vector lookups: for two- and three-byte opcodes, by low
+    // nibble, the bits of the high nibbles 0-7 and 8-15 whose opcode it is.
+    uint8_t rows[2][2][16];
+
+    void (*classify)(const struct predecoder * predecoder, const uint8_t * block,
+                     uint64_t * twos, uint64_t * threes);
+} predecoder_t;
+
+predecoder_t * create_predecoder(void);
+void free_predecoder(predecoder_t * predecoder);
+int find_instruction_starts(const predecoder_t * predecoder, const uint8_t * code,
+                            size_t size, int skip, uint8_t * starts);
+void find_instruction_exits(const predecoder_t * predecoder, const uint8_t * code,
+                            size_t size, int exits[3]);
+
+#endif /* !PREDECODE_8080_H_ */
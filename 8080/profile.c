@@ -0,0 +1,426 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disassembler.h"
+#include "emulator.h"
+#include "opcodes.h"
+#include "profile.h"
+
+#define MEMORY_SIZE 0x10000
+
+static uint32_t
+hash_call(uint32_t parent, uint16_t address)
+{
+    uint32_t key = parent << 16 ^ address;
+
+    key ^= key >> 15;
+    key *= 0x2C1B3C6D;
+    key ^= key >> 12;
+
+    return key;
+}
+
+// Puts a node in the index, which has room for it.
+static void
+index_node(profile_t * profile, uint32_t node)
+{
+    uint32_t mask = profile->index_size - 1;
+    uint32_t slot = hash_call(profile->nodes[node].parent,
+                              profile->nodes[node].address) & mask;
+
+    while (profile->index[slot] != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    profile->index[slot] = node + 1;
+}
+
+// Doubles the room for nodes, and the index with it.
+static int
+grow_nodes(profile_t * profile)
+{
+    uint32_t capacity = profile->node_capacity * 2;
+    profile_node_t * nodes = realloc(profile->nodes, capacity * sizeof(profile_node_t));
+    uint32_t * index = calloc(capacity * 2, sizeof(uint32_t));
+
+    if (nodes == NULL || index == NULL)
+    {
+        // realloc() leaves the old nodes be when it fails.
+        if (nodes != NULL)
+        {
+            profile->nodes = nodes;
+        }
+
+        free(index);
+        return -1;
+    }
+
+    free(profile->index);
+    profile->nodes = nodes;
+    profile->node_capacity = capacity;
+    profile->index = index;
+    profile->index_size = capacity * 2;
+
+    for (uint32_t node = 0; node < profile->node_count; node++)
+    {
+        index_node(profile, node);
+    }
+
+    return 0;
+}
+
+// The node for a call to address from parent, made if need be. Returns
+// parent itself if there is no memory for another.
+static uint32_t
+find_call(profile_t * profile, uint32_t parent, uint16_t address)
+{
+    uint32_t mask = profile->index_size - 1;
+    uint32_t slot = hash_call(parent, address) & mask;
+
+    for (; profile->index[slot] != 0; slot = (slot + 1) & mask)
+    {
+        const profile_node_t * node = &profile->nodes[profile->index[slot] - 1];
+
+        if (node->parent == parent && node->address == address)
+        {
+            return profile->index[slot] - 1;
+        }
+    }
+
+    if (profile->node_count == profile->node_capacity)
+    {
+        if (grow_nodes(profile) != 0)
+        {
+            return parent;
+        }
+    }
+
+    uint32_t node = profile->node_count++;
+
+    profile->nodes[node].parent = parent;
+    profile->nodes[node].address = address;
+    profile->nodes[node].samples = 0;
+    profile->nodes[node].cycles = 0;
+    index_node(profile, node);
+
+    return node;
+}
+
+/*
+ * Starts a profile with a sample every period instructions. Returns NULL if
+ * out of memory. Set cpu->profile to the result to start profiling.
+ */
+profile_t *
+create_profile(uint32_t period)
+{
+    profile_t * profile = calloc(1, sizeof(profile_t));
+    if (profile == NULL)
+    {
+        return NULL;
+    }
+
+    profile->period = period ? period : 1;
+    profile->countdown = 1;
+    profile->node_count = 1;
+    profile->node_capacity = 256;
+    profile->nodes = calloc(profile->node_capacity, sizeof(profile_node_t));
+    profile->index_size = profile->node_capacity * 2;
+    profile->index = calloc(profile->index_size, sizeof(uint32_t));
+    profile->depth = 1;
+
+    if (profile->nodes == NULL || profile->index == NULL)
+    {
+        free_profile(profile);
+        return NULL;
+    }
+
+    // The root is left out of the index, as nothing calls it.
+    return profile;
+}
+
+void
+free_profile(profile_t * profile)
+{
+    if (profile != NULL)
+    {
+        free(profile->memory);
+        free(profile->index);
+        free(profile->nodes);
+        free(profile);
+    }
+}
+
+/*
+ * Charges the cycles since the last sample to the instruction before this
+ * one, and to the routine it ran in. Called by profile_instruction().
+ */
+void
+sample_profile(profile_t * profile, uint64_t cycle, uint16_t address)
+{
+    profile->countdown = profile->period;
+
+    if (!profile->started)
+    {
+        profile->started = 1;
+        profile->sampled = cycle;
+        profile->nodes[0].address = address;
+        return;
+    }
+
+    uint64_t cycles = cycle - profile->sampled;
+    profile_node_t * node = &profile->nodes[profile->frames[profile->depth - 1].node];
+
+    profile->sampled = cycle;
+    profile->address_samples[profile->last_address]++;
+    profile->address_cycles[profile->last_address] += cycles;
+    profile->opcode_samples[profile->last_opcode]++;
+    profile->opcode_cycles[profile->last_opcode] += cycles;
+    node->samples++;
+    node->cycles += cycles;
+}
+
+// The instruction before called address, pushing its return address to
+// just below stack_pointer.
+void
+follow_call(profile_t * profile, uint16_t address, uint16_t stack_pointer)
+{
+    if (profile->depth == PROFILE_MAX_DEPTH)
+    {
+        return;
+    }
+
+    profile_frame_t * frame = &profile->frames[profile->depth];
+
+    frame->node = find_call(profile, profile->frames[profile->depth - 1].node, address);
+    frame->stack_pointer = stack_pointer;
+    profile->depth++;
+}
+
+// The instruction before returned, leaving the stack at stack_pointer.
+// Every call whose return address that popped has returned too, which
+// also unwinds routines that threw their return address away.
+void
+follow_return(profile_t * profile, uint16_t stack_pointer)
+{
+    while (profile->depth > 1 &&
+           profile->frames[profile->depth - 1].stack_pointer < stack_pointer)
+    {
+        profile->depth--;
+    }
+}
+
+/*
+ * Charges what ran since the last sample, and keeps a copy of the machine's
+ * memory to disassemble in the report. Call it once the run is over.
+ */
+void
+finish_profile(profile_t * profile, const cpu_8080_t * cpu)
+{
+    if (profile->started && cpu->cycles > profile->sampled)
+    {
+        sample_profile(profile, cpu->cycles, cpu->program_counter);
+    }
+
+    if (profile->memory == NULL)
+    {
+        profile->memory = malloc(MEMORY_SIZE + MAX_INSTRUCTION_SIZE - 1);
+    }
+
+    if (profile->memory != NULL)
+    {
+        memcpy(profile->memory, cpu->memory, MEMORY_SIZE);
+        memset(profile->memory + MEMORY_SIZE, 0, MAX_INSTRUCTION_SIZE - 1);
+    }
+
+    profile->cycles = cpu->cycles;
+}
+
+// qsort() takes no context, so the table being sorted is left here.
+static const uint64_t * sort_cycles;
+
+// Most cycles first, then the lowest index.
+static int
+compare_cycles(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    if (sort_cycles[x] != sort_cycles[y])
+    {
+        return sort_cycles[x] < sort_cycles[y] ? 1 : -1;
+    }
+
+    return x < y ? -1 : x > y;
+}
+
+// Fills order with the entries of cycles that have any, most first, and
+// returns how many there are.
+static uint32_t
+sort_by_cycles(const uint64_t * cycles, uint32_t count, uint32_t * order)
+{
+    uint32_t used = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (cycles[i] != 0)
+        {
+            order[used++] = i;
+        }
+    }
+
+    sort_cycles = cycles;
+    qsort(order, used, sizeof(uint32_t), compare_cycles);
+
+    return used;
+}
+
+static double
+percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0;
+}
+
+/*
+ * Writes where the time went: the busiest addresses with their
+ * instructions, every opcode run and the busiest routines. Returns 0, or -1
+ * if the file could not be written or out of memory.
+ */
+int
+write_profile_report(const profile_t * profile, FILE * file)
+{
+    uint64_t * routine_cycles = calloc(0x10000, sizeof(uint64_t));
+    uint64_t * routine_samples = calloc(0x10000, sizeof(uint64_t));
+    uint32_t * order = malloc(0x10000 * sizeof(uint32_t));
+    uint64_t total = 0;
+    uint64_t samples = 0;
+
+    if (routine_cycles == NULL || routine_samples == NULL || order == NULL)
+    {
+        free(routine_cycles);
+        free(routine_samples);
+        free(order);
+        return -1;
+    }
+
+    for (uint32_t opcode = 0; opcode < 256; opcode++)
+    {
+        total += profile->opcode_cycles[opcode];
+        samples += profile->opcode_samples[opcode];
+    }
+
+    fprintf(file, "%llu cycles, %llu samples, one every %u instructions\n",
+            (unsigned long long)profile->cycles, (unsigned long long)samples,
+            profile->period);
+
+    fprintf(file, "\n%12s %6s %12s  address\n", "cycles", "%", "samples");
+    uint32_t used = sort_by_cycles(profile->address_cycles, 0x10000, order);
+    for (uint32_t i = 0; i < used && i < PROFILE_REPORT_ADDRESSES; i++)
+    {
+        uint16_t address = order[i];
+        char text[MAX_TEXT_SIZE + 1] = "";
+
+        if (profile->memory != NULL)
+        {
+            disassemble(profile->memory, text, address);
+        }
+
+        fprintf(file, "%12llu %6.2f %12llu  %04X  %s\n",
+                (unsigned long long)profile->address_cycles[address],
+                percent(profile->address_cycles[address], total),
+                (unsigned long long)profile->address_samples[address],
+                address, text);
+    }
+
+    fprintf(file, "\n%12s %6s %12s  opcode\n", "cycles", "%", "samples");
+    used = sort_by_cycles(profile->opcode_cycles, 256, order);
+    for (uint32_t i = 0; i < used; i++)
+    {
+        const opcode_t * opcode = &opcode_table[order[i]];
+        char text[MAX_MNEMONIC_LENGTH + 1];
+        int length = 0;
+
+        // "MVI\tB" as "MVI B", and "JMP\t" as "JMP".
+        for (int c = 0; c < opcode->mnemonic_length; c++)
+        {
+            char ch = opcode_mnemonics[opcode->mnemonic + c];
+            text[length++] = ch == '\t' ? ' ' : ch;
+        }
+
+        while (length > 0 && text[length - 1] == ' ')
+        {
+            length--;
+        }
+
+        fprintf(file, "%12llu %6.2f %12llu  %02X  %.*s\n",
+                (unsigned long long)profile->opcode_cycles[order[i]],
+                percent(profile->opcode_cycles[order[i]], total),
+                (unsigned long long)profile->opcode_samples[order[i]],
+                order[i], length, text);
+    }
+
+    // Routines by the cycles run in them, however they were reached.
+    for (uint32_t node = 0; node < profile->node_count; node++)
+    {
+        routine_cycles[profile->nodes[node].address] += profile->nodes[node].cycles;
+        routine_samples[profile->nodes[node].address] += profile->nodes[node].samples;
+    }
+
+    fprintf(file, "\n%12s %6s %12s  routine\n", "cycles", "%", "samples");
+    used = sort_by_cycles(routine_cycles, 0x10000, order);
+    for (uint32_t i = 0; i < used && i < PROFILE_REPORT_ADDRESSES; i++)
+    {
+        fprintf(file, "%12llu %6.2f %12llu  %04X\n",
+                (unsigned long long)routine_cycles[order[i]],
+                percent(routine_cycles[order[i]], total),
+                (unsigned long long)routine_samples[order[i]], order[i]);
+    }
+
+    free(routine_cycles);
+    free(routine_samples);
+    free(order);
+
+    return ferror(file) ? -1 : 0;
+}
+
+/*
+ * Writes the call tree as folded stacks, one line per chain of calls that
+ * ran any cycles: the routine addresses from the root down, separated by
+ * semicolons, then the cycles run in the last. flamegraph.pl and most
+ * other flame graph tools read this. Returns 0, or -1 if the file could not
+ * be written.
+ */
+int
+write_profile_stacks(const profile_t * profile, FILE * file)
+{
+    uint16_t chain[PROFILE_MAX_DEPTH];
+
+    for (uint32_t node = 0; node < profile->node_count; node++)
+    {
+        if (profile->nodes[node].cycles == 0)
+        {
+            continue;
+        }
+
+        int depth = 0;
+        for (uint32_t at = node; ; at = profile->nodes[at].parent)
+        {
+            chain[depth++] = profile->nodes[at].address;
+
+            if (at == 0)
+            {
+                break;
+            }
+        }
+
+        while (depth-- > 0)
+        {
+            fprintf(file, depth > 0 ? "%04X;" : "%04X", chain[depth]);
+        }
+
+        fprintf(file, " %llu\n", (unsigned long long)profile->nodes[node].cycles);
+    }
+
+    return ferror(file) ? -1 : 0;
+}
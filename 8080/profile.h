@@ -0,0 +1,122 @@
+#ifndef PROFILE_8080_H_
+#define PROFILE_8080_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct cpu;
+
+/*
+ * Execution profiling. An emulator built with EMULATOR_8080_PROFILE counts
+ * the instructions a CPU with cpu->profile set runs, and the cycles they
+ * take, per address and per opcode. Without it cpu->profile is ignored and
+ * the dispatch loops carry no profiling code at all.
+ *
+ * Every period-th instruction is a sample. A sample charges the cycles run
+ * since the sample before to the instruction before it, so with a period of
+ * one every instruction is counted with exactly the cycles it took, and with
+ * a longer one the cycles are shared out in proportion to where the time
+ * went. An interrupt counts as its RST, at the address it interrupted.
+ *
+ * Samples are also charged to the routine being run, in a tree of the calls
+ * that led to it, kept by watching the stack pointer across CALLs, RSTs and
+ * returns. write_profile_stacks() writes the tree out as folded stacks for
+ * flame graph tools.
+ */
+
+// Calls deeper than this are charged to the routine that made them.
+#define PROFILE_MAX_DEPTH 256
+
+// Addresses listed by write_profile_report().
+#define PROFILE_REPORT_ADDRESSES 40
+
+// A routine as reached through one chain of calls.
+typedef struct profile_node
+{
+    uint32_t parent;       // the root is its own parent
+    uint16_t address;      // of the routine; the root's is where the run started
+    uint64_t samples;
+    uint64_t cycles;       // run in the routine itself, not in its calls
+} profile_node_t;
+
+typedef struct profile_frame
+{
+    uint32_t node;
+    uint16_t stack_pointer; // just after the call pushed its return address
+} profile_frame_t;
+
+typedef struct profile
+{
+    uint64_t address_samples[0x10000];
+    uint64_t address_cycles[0x10000];
+    uint64_t opcode_samples[256];
+    uint64_t opcode_cycles[256];
+
+    uint32_t period;
+    uint32_t countdown;    // instructions to the next sample
+    int started;
+    uint64_t sampled;      // the cycle of the last sample
+
+    // The instruction before the one being run.
+    uint16_t last_address;
+    uint16_t last_stack_pointer;
+    uint8_t last_opcode;
+
+    // The call tree, and the calls being run.
+    profile_node_t * nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    uint32_t * index;      // (parent, address) hashed to a node + 1, or 0
+    uint32_t index_size;
+    profile_frame_t frames[PROFILE_MAX_DEPTH];
+    unsigned depth;
+
+    uint8_t * memory;      // a copy of the machine's, for the report
+    uint64_t cycles;       // when the run finished
+} profile_t;
+
+profile_t * create_profile(uint32_t period);
+void free_profile(profile_t * profile);
+void sample_profile(profile_t * profile, uint64_t cycle, uint16_t address);
+void follow_call(profile_t * profile, uint16_t address, uint16_t stack_pointer);
+void follow_return(profile_t * profile, uint16_t stack_pointer);
+void finish_profile(profile_t * profile, const struct cpu * cpu);
+int write_profile_report(const profile_t * profile, FILE * file);
+int write_profile_stacks(const profile_t * profile, FILE * file);
+
+/*
+ * Counts an instruction about to run at address. Called by the emulator
+ * before every instruction of a profiled CPU.
+ */
+static inline void
+profile_instruction(profile_t * profile, uint64_t cycle, uint16_t address,
+                    uint8_t opcode, uint16_t stack_pointer)
+{
+    if (--profile->countdown == 0)
+    {
+        sample_profile(profile, cycle, address);
+    }
+
+    // A call taken pushed two bytes; a return taken popped some.
+    uint8_t last = profile->last_opcode;
+
+    if ((last & 0xC0) == 0xC0)
+    {
+        if (stack_pointer == (uint16_t)(profile->last_stack_pointer - 2) &&
+            ((last & 0x07) == 0x04 || (last & 0x07) == 0x07 || (last & 0xCF) == 0xCD))
+        {
+            follow_call(profile, address, stack_pointer);
+        }
+        else if (stack_pointer > profile->last_stack_pointer &&
+                 ((last & 0x07) == 0x00 || (last & 0xEF) == 0xC9))
+        {
+            follow_return(profile, stack_pointer);
+        }
+    }
+
+    profile->last_address = address;
+    profile->last_stack_pointer = stack_pointer;
+    profile->last_opcode = opcode;
+}
+
+#endif /* !PROFILE_8080_H_ */
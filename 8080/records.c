@@ -0,0 +1,186 @@
+#include <stdint.h>
+#include <string.h>
+#include "opcodes.h"
+#include "records.h"
+#include "rom.h"
+
+// Keep records at sixteen bytes so they stay aligned in a mapped file.
+typedef char record_size_check[sizeof(record_t) == 16 && sizeof(records_header_t) == 16 ? 1 : -1];
+
+/*
+ * Mnemonics are identified by the documented opcode that has them, so the
+ * undocumented duplicates of NOP, JMP, RET and CALL share an id with the
+ * real ones.
+ */
+static uint8_t
+mnemonic_id(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case 0x08: case 0x10: case 0x18: case 0x20:
+        case 0x28: case 0x30: case 0x38:
+            return 0x00;
+        case 0xCB:
+            return 0xC3;
+        case 0xD9:
+            return 0xC9;
+        case 0xDD: case 0xED: case 0xFD:
+            return 0xCD;
+        default:
+            return opcode;
+    }
+}
+
+void
+records_header(records_header_t * header)
+{
+    memcpy(header->magic, RECORDS_MAGIC, sizeof(header->magic));
+    header->byte_order = RECORDS_BYTE_ORDER;
+    header->version = RECORDS_VERSION;
+    header->record_size = sizeof(record_t);
+}
+
+/*
+ * Fills in the record for the instruction at code and returns its size in
+ * bytes. code must be readable MAX_INSTRUCTION_SIZE bytes on.
+ */
+int
+format_record(const unsigned char * code, uint64_t address, record_t * record)
+{
+    const opcode_t * opcode = &opcode_table[code[0]];
+
+    record->address = address;
+    record->opcode = code[0];
+    record->operands[0] = opcode->size > 1 ? code[1] : 0;
+    record->operands[1] = opcode->size > 2 ? code[2] : 0;
+    record->size = opcode->size;
+    record->operand = opcode->operand;
+    record->mnemonic = mnemonic_id(code[0]);
+    record->reserved[0] = 0;
+    record->reserved[1] = 0;
+
+    return opcode->size;
+}
+
+/*
+ * Decodes the instructions in code[0, size), numbering them from address,
+ * into at most capacity records, and returns how many it wrote. Nothing is
+ * read past size: an instruction that would run past it is left undecoded.
+ * *used gets the number of bytes decoded, where the next call should
+ * carry on.
+ */
+size_t
+decode_records(const uint8_t * code, size_t size, uint64_t address,
+               record_t * records, size_t capacity, size_t * used)
+{
+    size_t offset = 0;
+    size_t count = 0;
+
+    // While three bytes are left the operands can be read unconditionally,
+    // and masked off, rather than branched over.
+    while (count < capacity && size - offset >= 3)
+    {
+        const opcode_t * opcode = &opcode_table[code[offset]];
+        record_t * record = &records[count++];
+
+        record->address = address + offset;
+        record->opcode = code[offset];
+        record->operands[0] = code[offset + 1] & -(opcode->size > 1);
+        record->operands[1] = code[offset + 2] & -(opcode->size > 2);
+        record->size = opcode->size;
+        record->operand = opcode->operand;
+        record->mnemonic = mnemonic_id(code[offset]);
+        record->reserved[0] = 0;
+        record->reserved[1] = 0;
+
+        offset += opcode->size;
+    }
+
+    while (count < capacity && offset < size &&
+           opcode_table[code[offset]].size <= size - offset)
+    {
+        offset += format_record(code + offset, address + offset, &records[count++]);
+    }
+
+    *used = offset;
+    return count;
+}
+
+/*
+ * Maps a file of records for reading. Returns 0, or -1 if it can't be read,
+ * is not a record file or was written in the other byte order.
+ */
+int
+open_records(record_file_t * file, const char * filename)
+{
+    if (open_dump(&file->view, filename) != ROM_OK)
+    {
+        return -1;
+    }
+
+    const records_header_t * header = (const records_header_t *)file->view.data;
+    size_t size = file->view.size;
+
+    if (size < sizeof(records_header_t) ||
+        memcmp(header->magic, RECORDS_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byte_order != RECORDS_BYTE_ORDER ||
+        header->version != RECORDS_VERSION ||
+        header->record_size != sizeof(record_t) ||
+        (size - sizeof(records_header_t)) % sizeof(record_t) != 0)
+    {
+        close_rom(&file->view);
+        return -1;
+    }
+
+    file->records = (const record_t *)(header + 1);
+    file->count = (size - sizeof(records_header_t)) / sizeof(record_t);
+
+    return 0;
+}
+
+void
+close_records(record_file_t * file)
+{
+    close_rom(&file->view);
+    file->records = NULL;
+    file->count = 0;
+}
+
+// Returns the record of the instruction at address, or NULL if none starts there.
+const record_t *
+find_record(const record_file_t * file, uint64_t address)
+{
+    size_t low = 0;
+    size_t high = file->count;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if (file->records[middle].address < address)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if (low < file->count && file->records[low].address == address)
+    {
+        return &file->records[low];
+    }
+
+    return NULL;
+}
+
+// Returns the text of a record's mnemonic, which is not NUL-terminated.
+const char *
+record_mnemonic(const record_t * record, int * length)
+{
+    const opcode_t * opcode = &opcode_table[record->mnemonic];
+
+    *length = opcode->mnemonic_length;
+    return opcode_mnemonics + opcode->mnemonic;
+}
@@ -0,0 +1,62 @@
+#ifndef RECORDS_8080_H_
+#define RECORDS_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rom.h"
+
+/*
+ * Binary disassembly: a 16-byte header followed by one 16-byte record per
+ * instruction, in address order. The records are laid out as record_t in
+ * the byte order of the host that wrote them, so a mapped file can be read
+ * in place. The header says which order that was, and a file from a host
+ * of the other order is refused.
+ */
+#define RECORDS_MAGIC      "8080DASM"
+#define RECORDS_VERSION    2
+#define RECORDS_BYTE_ORDER 0x01020304
+
+typedef struct records_header
+{
+    char magic[8];         // RECORDS_MAGIC, no NUL
+    uint32_t byte_order;   // RECORDS_BYTE_ORDER, as the writer stored it
+    uint16_t version;      // RECORDS_VERSION
+    uint16_t record_size;  // sizeof(record_t)
+} records_header_t;
+
+typedef struct record
+{
+    uint64_t address;      // of the instruction in the input
+    uint8_t opcode;
+    uint8_t operands[2];   // zero past the instruction
+    uint8_t size;          // in bytes
+    uint8_t operand;       // OPERAND_ kind
+    uint8_t mnemonic;      // see record_mnemonic()
+    uint8_t reserved[2];
+} record_t;
+
+// A file of records mapped for reading.
+typedef struct record_file
+{
+    const record_t * records;
+    size_t count;
+    rom_t view;
+} record_file_t;
+
+void records_header(records_header_t * header);
+int format_record(const unsigned char * code, uint64_t address, record_t * record);
+
+/*
+ * Batch decoding for callers in other languages: one call fills an array
+ * the caller owns, with no text, no allocation and no pointers in the
+ * results.
+ */
+size_t decode_records(const uint8_t * code, size_t size, uint64_t address,
+                      record_t * records, size_t capacity, size_t * used);
+
+int open_records(record_file_t * file, const char * filename);
+void close_records(record_file_t * file);
+const record_t * find_record(const record_file_t * file, uint64_t address);
+const char * record_mnemonic(const record_t * record, int * length);
+
+#endif /* !RECORDS_8080_H_ */
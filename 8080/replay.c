@@ -0,0 +1,676 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debugger.h"
+#include "emulator.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "snapshot.h"
+
+#define REPLAY_MAGIC   "8080RPLY"
+#define REPLAY_VERSION 1
+
+// Makes room for needed items of size bytes in an array, doubling it as
+// need be. Returns the array, moved or not, or NULL if out of memory,
+// leaving the array as it was.
+static void *
+reserve(void * items, size_t * capacity, size_t needed, size_t size)
+{
+    size_t grown = *capacity ? *capacity : 256;
+
+    while (grown < needed)
+    {
+        grown *= 2;
+    }
+
+    if (grown == *capacity)
+    {
+        return items;
+    }
+
+    void * moved = realloc(items, grown * size);
+    if (moved != NULL)
+    {
+        *capacity = grown;
+    }
+
+    return moved;
+}
+
+static void
+drop_keyframes(replay_t * replay)
+{
+    for (size_t i = 0; i < replay->keyframe_count; i++)
+    {
+        free(replay->keyframes[i].bank_stores);
+    }
+
+    replay->keyframe_count = 0;
+    replay->snapshot_size = 0;
+}
+
+// Recording stops at the first allocation that fails.
+static void
+recording_failed(replay_t * replay)
+{
+    replay->failed = 1;
+    replay->state = REPLAY_IDLE;
+    replay->next_keyframe = UINT64_MAX;
+}
+
+/*
+ * Makes an empty recording that takes a keyframe every interval cycles, or
+ * every REPLAY_INTERVAL if interval is 0, or only the first if it is
+ * UINT64_MAX. Returns NULL if out of memory.
+ */
+replay_t *
+create_replay(uint64_t interval)
+{
+    replay_t * replay = calloc(1, sizeof(replay_t));
+    if (replay == NULL)
+    {
+        return NULL;
+    }
+
+    replay->interval = interval ? interval : REPLAY_INTERVAL;
+    replay->next_keyframe = UINT64_MAX;
+
+    return replay;
+}
+
+void
+free_replay(replay_t * replay)
+{
+    if (replay != NULL)
+    {
+        drop_keyframes(replay);
+        free(replay->inputs);
+        free(replay->interrupts);
+        free(replay->keyframes);
+        free(replay->snapshots);
+        free(replay);
+    }
+}
+
+/*
+ * Starts recording the machine from the state it is in, attaching the
+ * recording to it. Returns 0, or -1 if out of memory.
+ */
+int
+start_recording(replay_t * replay, cpu_8080_t * cpu)
+{
+    replay->state = REPLAY_RECORDING;
+    replay->failed = 0;
+    replay->mapped = cpu->memory_map != NULL;
+    replay->input_count = 0;
+    replay->interrupt_count = 0;
+    drop_keyframes(replay);
+
+    take_keyframe(replay, cpu);
+    replay->end = cpu->cycles;
+    cpu->replay = replay;
+
+    return replay->failed ? -1 : 0;
+}
+
+// Detaches the recording from the machine, which ends it.
+void
+stop_recording(replay_t * replay, cpu_8080_t * cpu)
+{
+    if (replay->state == REPLAY_RECORDING)
+    {
+        replay->end = cpu->cycles;
+    }
+
+    replay->state = REPLAY_IDLE;
+    replay->next_keyframe = UINT64_MAX;
+    cpu->replay = NULL;
+}
+
+// Saves which pages are mapped and the banks. Returns 0, or -1 if out of
+// memory.
+static int
+save_map(replay_keyframe_t * keyframe, const cpu_8080_t * cpu)
+{
+    const memory_map_t * map = cpu->memory_map;
+
+    for (int page = 0; page < 256; page++)
+    {
+        keyframe->mapped[page] = cpu->page_flags[page] & PAGE_MAPPED;
+    }
+
+    keyframe->bank_stores = NULL;
+
+    if (map == NULL)
+    {
+        return 0;
+    }
+
+    size_t size = bank_store_size(map);
+
+    if (size != 0 && (keyframe->bank_stores = malloc(size)) == NULL)
+    {
+        return -1;
+    }
+
+    save_banks(map, keyframe->banks, keyframe->bank_stores);
+    return 0;
+}
+
+// Whether the machine's pages are mapped as they were at a keyframe.
+static int
+same_map(const replay_t * replay, const replay_keyframe_t * keyframe,
+         const cpu_8080_t * cpu)
+{
+    if (replay->mapped != (cpu->memory_map != NULL))
+    {
+        return 0;
+    }
+
+    for (int page = 0; page < 256; page++)
+    {
+        if ((cpu->page_flags[page] & PAGE_MAPPED) != keyframe->mapped[page])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Snapshots the machine between instructions. Called by the emulator as it
+ * starts running once the cycle of the next keyframe has come.
+ */
+void
+take_keyframe(replay_t * replay, const cpu_8080_t * cpu)
+{
+    replay_keyframe_t * keyframes = reserve(replay->keyframes, &replay->keyframe_capacity,
+                                            replay->keyframe_count + 1,
+                                            sizeof(replay_keyframe_t));
+    if (keyframes == NULL)
+    {
+        recording_failed(replay);
+        return;
+    }
+
+    replay->keyframes = keyframes;
+
+    uint8_t * snapshots = reserve(replay->snapshots, &replay->snapshot_capacity,
+                                  replay->snapshot_size + SNAPSHOT_MAX_SIZE, 1);
+    if (snapshots == NULL)
+    {
+        recording_failed(replay);
+        return;
+    }
+
+    replay->snapshots = snapshots;
+    replay_keyframe_t * keyframe = &replay->keyframes[replay->keyframe_count];
+
+    if (save_map(keyframe, cpu) != 0)
+    {
+        recording_failed(replay);
+        return;
+    }
+
+    replay->keyframe_count++;
+    keyframe->cycle = cpu->cycles;
+    keyframe->input = replay->input_count;
+    keyframe->interrupt = replay->interrupt_count;
+    keyframe->offset = replay->snapshot_size;
+    keyframe->size = save_snapshot(cpu, replay->snapshots + replay->snapshot_size);
+
+    replay->snapshot_size += keyframe->size;
+    replay->next_keyframe = replay->interval < UINT64_MAX - cpu->cycles ?
+                            cpu->cycles + replay->interval : UINT64_MAX;
+}
+
+static void
+add_input(replay_t * replay, uint64_t cycle, uint16_t port, uint8_t value, uint8_t load)
+{
+    if (replay->state != REPLAY_RECORDING)
+    {
+        return;
+    }
+
+    replay_input_t * inputs = reserve(replay->inputs, &replay->input_capacity,
+                                      replay->input_count + 1, sizeof(replay_input_t));
+    if (inputs == NULL)
+    {
+        recording_failed(replay);
+        return;
+    }
+
+    replay->inputs = inputs;
+
+    replay_input_t * input = &inputs[replay->input_count++];
+    input->cycle = cycle;
+    input->port = port;
+    input->value = value;
+    input->load = load;
+}
+
+// What an IN read, while recording.
+void
+record_input(replay_t * replay, uint64_t cycle, uint8_t port, uint8_t value)
+{
+    add_input(replay, cycle, port, value, 0);
+}
+
+// What a load from an MMIO page read, while recording.
+void
+record_load(replay_t * replay, uint64_t cycle, uint16_t address, uint8_t value)
+{
+    add_input(replay, cycle, address, value, 1);
+}
+
+// An interrupt taken, while recording.
+void
+record_interrupt(replay_t * replay, uint64_t cycle, uint8_t vector)
+{
+    if (replay->state != REPLAY_RECORDING)
+    {
+        return;
+    }
+
+    replay_interrupt_t * interrupts = reserve(replay->interrupts, &replay->interrupt_capacity,
+                                              replay->interrupt_count + 1,
+                                              sizeof(replay_interrupt_t));
+    if (interrupts == NULL)
+    {
+        recording_failed(replay);
+        return;
+    }
+
+    replay->interrupts = interrupts;
+
+    replay_interrupt_t * interrupt = &interrupts[replay->interrupt_count++];
+    interrupt->cycle = cycle;
+    interrupt->vector = vector;
+}
+
+static uint8_t
+next_input(replay_t * replay, uint64_t cycle, uint16_t port, uint8_t load)
+{
+    if (replay->next_input < replay->input_count)
+    {
+        const replay_input_t * input = &replay->inputs[replay->next_input];
+
+        if (input->cycle == cycle && input->port == port && input->load == load)
+        {
+            replay->next_input++;
+            return input->value;
+        }
+    }
+
+    replay->diverged = 1;
+    return 0;
+}
+
+/*
+ * What an IN reads during playback. If it is not the IN that was recorded
+ * next, playback has diverged and this reads zero.
+ */
+uint8_t
+play_input(replay_t * replay, uint64_t cycle, uint8_t port)
+{
+    return next_input(replay, cycle, port, 0);
+}
+
+// The same for a load from an MMIO page.
+uint8_t
+play_load(replay_t * replay, uint64_t cycle, uint16_t address)
+{
+    return next_input(replay, cycle, address, 1);
+}
+
+// The last keyframe at or before cycle, or the first.
+static const replay_keyframe_t *
+find_keyframe(const replay_t * replay, uint64_t cycle)
+{
+    size_t low = 0;
+    size_t high = replay->keyframe_count;
+
+    while (high - low > 1)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if (replay->keyframes[middle].cycle <= cycle)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return &replay->keyframes[low];
+}
+
+/*
+ * Puts the machine where the recording was at the first instruction
+ * boundary at or past cycle, and attaches the recording to it for
+ * playback. The machine needs 64 KiB of memory, and its pages mapped as
+ * they were recorded. It starts from the nearest keyframe before, unless it
+ * is already playing back from between that keyframe and cycle. Returns 0,
+ * or -1 if there is nothing recorded, the machine is mapped otherwise or
+ * playback diverged.
+ */
+int
+seek_replay(replay_t * replay, cpu_8080_t * cpu, uint64_t cycle)
+{
+    if (replay->keyframe_count == 0 || replay->state == REPLAY_RECORDING)
+    {
+        return -1;
+    }
+
+    const replay_keyframe_t * keyframe = find_keyframe(replay, cycle);
+
+    if (replay->state != REPLAY_PLAYING || cpu->replay != replay ||
+        replay->diverged || cpu->cycles > cycle || cpu->cycles < keyframe->cycle)
+    {
+        if (!same_map(replay, keyframe, cpu) ||
+            load_snapshot(cpu, replay->snapshots + keyframe->offset, keyframe->size) != 0)
+        {
+            return -1;
+        }
+
+        if (cpu->memory_map != NULL)
+        {
+            load_banks(cpu->memory_map, keyframe->banks, keyframe->bank_stores);
+        }
+
+        // Interrupts come from the recording alone.
+        cpu->interrupt_pending = 0;
+        cpu->replay = replay;
+        replay->state = REPLAY_PLAYING;
+        replay->diverged = 0;
+        replay->next_input = keyframe->input;
+        replay->next_interrupt = keyframe->interrupt;
+    }
+
+    return play_replay(replay, cpu, cycle);
+}
+
+/*
+ * Plays back from where the machine is to the first instruction boundary
+ * at or past cycle, or to where recording stopped. Interrupts are raised
+ * on the cycles they were taken on. Returns 0, or -1 if playback diverged.
+ */
+int
+play_replay(replay_t * replay, cpu_8080_t * cpu, uint64_t cycle)
+{
+    uint64_t until = cycle < replay->end ? cycle : replay->end;
+
+    while (cpu->cycles < until && !replay->diverged && !DEBUG_STOPPED(cpu))
+    {
+        const replay_interrupt_t * interrupt = NULL;
+        uint64_t deadline = until;
+
+        if (replay->next_interrupt < replay->interrupt_count)
+        {
+            interrupt = &replay->interrupts[replay->next_interrupt];
+            if (interrupt->cycle < deadline)
+            {
+                deadline = interrupt->cycle;
+            }
+        }
+
+        run_until(cpu, deadline);
+
+        if (interrupt != NULL && cpu->cycles >= interrupt->cycle)
+        {
+            // It was taken right on an instruction boundary, so it can only
+            // be missed by going astray.
+            if (cpu->cycles != interrupt->cycle || cpu->interrupt_enabled == INTERRUPTS_OFF)
+            {
+                replay->diverged = 1;
+                break;
+            }
+
+            cpu->interrupt_pending = 1;
+            cpu->interrupt_vector = interrupt->vector;
+            replay->next_interrupt++;
+        }
+    }
+
+    return replay->diverged ? -1 : 0;
+}
+
+static int
+write_words(FILE * file, const uint64_t * words, int count)
+{
+    uint8_t bytes[8];
+
+    for (int n = 0; n < count; n++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            bytes[i] = (words[n] >> (i * 8)) & 0xFF;
+        }
+
+        if (fwrite(bytes, sizeof(bytes), 1, file) != 1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+read_words(FILE * file, uint64_t * words, int count)
+{
+    uint8_t bytes[8];
+
+    for (int n = 0; n < count; n++)
+    {
+        if (fread(bytes, sizeof(bytes), 1, file) != 1)
+        {
+            return -1;
+        }
+
+        words[n] = 0;
+        for (int i = 7; i >= 0; i--)
+        {
+            words[n] = (words[n] << 8) | bytes[i];
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * A recording file is REPLAY_MAGIC and then, as little-endian 64-bit
+ * words, the version, the keyframe interval, the cycle recording stopped
+ * on, and the numbers of inputs, interrupts, keyframes and bytes of
+ * snapshots. The inputs follow as their cycle, port and value, the
+ * interrupts as their cycle and vector, the keyframes as their five words,
+ * and last the snapshots. A recording of a machine with a memory map is
+ * not saved, as its devices and banks cannot be.
+ */
+
+int
+save_replay(const replay_t * replay, const char * filename)
+{
+    if (replay->mapped)
+    {
+        return -1;
+    }
+
+    FILE * file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    uint64_t header[7] = {
+        REPLAY_VERSION, replay->interval, replay->end, replay->input_count,
+        replay->interrupt_count, replay->keyframe_count, replay->snapshot_size
+    };
+    int failed = fwrite(REPLAY_MAGIC, 8, 1, file) != 1 || write_words(file, header, 7) != 0;
+
+    for (size_t i = 0; i < replay->input_count && !failed; i++)
+    {
+        const replay_input_t * input = &replay->inputs[i];
+        uint8_t bytes[2] = { (uint8_t)input->port, input->value };
+
+        failed = write_words(file, &input->cycle, 1) != 0 ||
+                 fwrite(bytes, sizeof(bytes), 1, file) != 1;
+    }
+
+    for (size_t i = 0; i < replay->interrupt_count && !failed; i++)
+    {
+        const replay_interrupt_t * interrupt = &replay->interrupts[i];
+
+        failed = write_words(file, &interrupt->cycle, 1) != 0 ||
+                 fwrite(&interrupt->vector, 1, 1, file) != 1;
+    }
+
+    for (size_t i = 0; i < replay->keyframe_count && !failed; i++)
+    {
+        const replay_keyframe_t * keyframe = &replay->keyframes[i];
+        uint64_t words[5] = {
+            keyframe->cycle, keyframe->input, keyframe->interrupt,
+            keyframe->offset, keyframe->size
+        };
+
+        failed = write_words(file, words, 5) != 0;
+    }
+
+    if (!failed && replay->snapshot_size > 0)
+    {
+        failed = fwrite(replay->snapshots, replay->snapshot_size, 1, file) != 1;
+    }
+
+    failed |= fclose(file) != 0;
+    return failed ? -1 : 0;
+}
+
+// Allocates count zeroed items of size bytes, failing rather than
+// overflowing.
+static void *
+allocate(uint64_t count, size_t size)
+{
+    if (count > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+
+    return calloc(count ? count : 1, size);
+}
+
+static int
+read_replay(replay_t * replay, FILE * file)
+{
+    char magic[8];
+    uint64_t header[7];
+
+    if (fread(magic, sizeof(magic), 1, file) != 1 ||
+        memcmp(magic, REPLAY_MAGIC, sizeof(magic)) != 0 ||
+        read_words(file, header, 7) != 0 || header[0] != REPLAY_VERSION ||
+        header[5] == 0)
+    {
+        return -1;
+    }
+
+    replay->interval = header[1];
+    replay->end = header[2];
+    replay->inputs = allocate(header[3], sizeof(replay_input_t));
+    replay->interrupts = allocate(header[4], sizeof(replay_interrupt_t));
+    replay->keyframes = allocate(header[5], sizeof(replay_keyframe_t));
+    replay->snapshots = allocate(header[6], 1);
+
+    if (replay->inputs == NULL || replay->interrupts == NULL ||
+        replay->keyframes == NULL || replay->snapshots == NULL)
+    {
+        return -1;
+    }
+
+    replay->input_count = replay->input_capacity = header[3];
+    replay->interrupt_count = replay->interrupt_capacity = header[4];
+    replay->keyframe_count = replay->keyframe_capacity = header[5];
+    replay->snapshot_size = replay->snapshot_capacity = header[6];
+
+    for (size_t i = 0; i < replay->input_count; i++)
+    {
+        replay_input_t * input = &replay->inputs[i];
+        uint8_t bytes[2];
+
+        if (read_words(file, &input->cycle, 1) != 0 ||
+            fread(bytes, sizeof(bytes), 1, file) != 1)
+        {
+            return -1;
+        }
+
+        input->port = bytes[0];
+        input->value = bytes[1];
+    }
+
+    for (size_t i = 0; i < replay->interrupt_count; i++)
+    {
+        replay_interrupt_t * interrupt = &replay->interrupts[i];
+
+        if (read_words(file, &interrupt->cycle, 1) != 0 ||
+            fread(&interrupt->vector, 1, 1, file) != 1)
+        {
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < replay->keyframe_count; i++)
+    {
+        replay_keyframe_t * keyframe = &replay->keyframes[i];
+        uint64_t words[5];
+
+        if (read_words(file, words, 5) != 0 ||
+            words[1] > replay->input_count || words[2] > replay->interrupt_count ||
+            words[3] > replay->snapshot_size ||
+            words[4] > replay->snapshot_size - words[3] ||
+            (i > 0 && words[0] < keyframe[-1].cycle))
+        {
+            return -1;
+        }
+
+        keyframe->cycle = words[0];
+        keyframe->input = words[1];
+        keyframe->interrupt = words[2];
+        keyframe->offset = words[3];
+        keyframe->size = words[4];
+    }
+
+    if (replay->snapshot_size > 0 &&
+        fread(replay->snapshots, replay->snapshot_size, 1, file) != 1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads a recording saved by save_replay(), ready to seek. Returns NULL if
+ * the file cannot be read or is not a recording.
+ */
+replay_t *
+load_replay(const char * filename)
+{
+    replay_t * replay = create_replay(0);
+    FILE * file = fopen(filename, "rb");
+
+    if (replay == NULL || file == NULL || read_replay(replay, file) != 0)
+    {
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+
+        free_replay(replay);
+        return NULL;
+    }
+
+    fclose(file);
+    return replay;
+}
@@ -0,0 +1,108 @@
+#ifndef REPLAY_8080_H_
+#define REPLAY_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emulator.h"
+#include "memory_map.h"
+
+/*
+ * Record and replay. Given the same starting state, a machine only does
+ * something different because of what comes in from outside: the values
+ * IN and loads from device registers read, and when interrupts are taken. A recording keeps just those,
+ * each with the cycle it happened on, and a snapshot to start from, see
+ * snapshot.h. Played back, it runs the machine through the same states,
+ * bit for bit, with no devices attached.
+ *
+ * A recording also takes a keyframe, a snapshot and where the logs stood,
+ * every interval cycles or so, so that seeking to any cycle replays at
+ * most one interval. The first keyframe is the starting state.
+ *
+ * Keyframes hold the CPU and its memory, and for a machine with a memory
+ * map, see memory_map.h, which pages are mapped and its banks. Such a
+ * recording plays back only on the same machine, map and devices and all,
+ * and cannot be saved to a file. Devices that change the memory behind the
+ * CPU's back, or whose state a bank switch depends on, are not recorded.
+ */
+
+// Cycles between keyframes unless told otherwise.
+#define REPLAY_INTERVAL 100000000
+
+typedef struct replay_input
+{
+    uint64_t cycle;         // the IN, or loading, instruction started
+    uint16_t port;          // or the address of a load
+    uint8_t value;
+    uint8_t load;           // a load from an MMIO page, see memory_map.h
+} replay_input_t;
+
+typedef struct replay_interrupt
+{
+    uint64_t cycle;         // the RST was run
+    uint8_t vector;
+} replay_interrupt_t;
+
+typedef struct replay_keyframe
+{
+    uint64_t cycle;
+    size_t input;           // the first input past it
+    size_t interrupt;       // likewise
+    size_t offset;          // of its snapshot in snapshots
+    size_t size;
+    uint8_t mapped[256];    // each page's PAGE_MAPPED flags
+    size_t banks[MAX_BANK_WINDOWS]; // see save_banks()
+    uint8_t * bank_stores;  // or NULL
+} replay_keyframe_t;
+
+typedef enum replay_state
+{
+    REPLAY_IDLE,
+    REPLAY_RECORDING,
+    REPLAY_PLAYING
+} replay_state_t;
+
+typedef struct replay
+{
+    replay_state_t state;
+    int failed;             // out of memory while recording
+    int diverged;           // playback did not go as recorded
+    int mapped;             // the machine recorded has a memory map
+    uint64_t interval;
+    uint64_t next_keyframe; // cycle of the next keyframe to take
+    uint64_t end;           // the cycle recording stopped on
+
+    replay_input_t * inputs;
+    size_t input_count;
+    size_t input_capacity;
+    size_t next_input;      // played back so far
+
+    replay_interrupt_t * interrupts;
+    size_t interrupt_count;
+    size_t interrupt_capacity;
+    size_t next_interrupt;
+
+    replay_keyframe_t * keyframes;
+    size_t keyframe_count;
+    size_t keyframe_capacity;
+
+    uint8_t * snapshots;
+    size_t snapshot_size;
+    size_t snapshot_capacity;
+} replay_t;
+
+replay_t * create_replay(uint64_t interval);
+void free_replay(replay_t * replay);
+int start_recording(replay_t * replay, cpu_8080_t * cpu);
+void stop_recording(replay_t * replay, cpu_8080_t * cpu);
+void take_keyframe(replay_t * replay, const cpu_8080_t * cpu);
+void record_input(replay_t * replay, uint64_t cycle, uint8_t port, uint8_t value);
+void record_interrupt(replay_t * replay, uint64_t cycle, uint8_t vector);
+uint8_t play_input(replay_t * replay, uint64_t cycle, uint8_t port);
+void record_load(replay_t * replay, uint64_t cycle, uint16_t address, uint8_t value);
+uint8_t play_load(replay_t * replay, uint64_t cycle, uint16_t address);
+int seek_replay(replay_t * replay, cpu_8080_t * cpu, uint64_t cycle);
+int play_replay(replay_t * replay, cpu_8080_t * cpu, uint64_t cycle);
+int save_replay(const replay_t * replay, const char * filename);
+replay_t * load_replay(const char * filename);
+
+#endif /* !REPLAY_8080_H_ */
@@ -0,0 +1,299 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rom.h"
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MEMORY_SIZE 0x10000
+
+static const char * status_names[] = {
+    "loaded",
+    "could not be opened",
+    "could not be read",
+    "does not fit in memory",
+    "out of memory"
+};
+
+const char *
+rom_status_name(rom_status_t status)
+{
+    return status_names[status];
+}
+
+#if defined(__unix__)
+
+static size_t
+round_to_page(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// Opens a regular file of at most limit bytes.
+static rom_status_t
+open_file(const char * filename, size_t limit, int * fd, size_t * size)
+{
+    struct stat st;
+
+    *fd = open(filename, O_RDONLY);
+    if (*fd < 0)
+    {
+        return ROM_CANNOT_OPEN;
+    }
+
+    if (fstat(*fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(*fd);
+        return ROM_CANNOT_READ;
+    }
+
+    if ((uintmax_t)st.st_size > limit)
+    {
+        close(*fd);
+        return ROM_TOO_LARGE;
+    }
+
+    *size = st.st_size;
+    return ROM_OK;
+}
+
+static int
+read_fully(int fd, uint8_t * buffer, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t count = pread(fd, buffer + done, size - done, done);
+        if (count <= 0)
+        {
+            return 0;
+        }
+
+        done += count;
+    }
+
+    return 1;
+}
+
+/*
+ * The file is mapped privately over the start of a zeroed anonymous region,
+ * so nothing is copied, writes never reach the file, and reads past the end
+ * of the file find zeros instead of faulting.
+ */
+static int
+overlay_file(uint8_t * at, int fd, size_t size, int protection)
+{
+    return size == 0 ||
+        mmap(at, size, protection, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+}
+
+static rom_status_t
+open_view(rom_t * rom, const char * filename, size_t limit)
+{
+    int fd;
+    size_t size;
+    rom_status_t status = open_file(filename, limit, &fd, &size);
+
+    if (status != ROM_OK)
+    {
+        return status;
+    }
+
+    size_t mapped = round_to_page(size + ROM_PADDING);
+    uint8_t * data = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return ROM_OUT_OF_MEMORY;
+    }
+
+    if (!overlay_file(data, fd, size, PROT_READ))
+    {
+        munmap(data, mapped);
+        close(fd);
+        return ROM_CANNOT_READ;
+    }
+
+    close(fd);
+    rom->data = data;
+    rom->size = size;
+    rom->mapped = mapped;
+
+    return ROM_OK;
+}
+
+void
+close_rom(rom_t * rom)
+{
+    munmap((void *)rom->data, rom->mapped);
+    rom->data = NULL;
+    rom->size = 0;
+}
+
+/*
+ * Returns 64 KiB of writable memory holding the ROM at origin and zeros
+ * elsewhere, for a machine to run in. The ROM's pages are shared with the
+ * page cache until written to when origin is page-aligned, and copied in
+ * otherwise. Free the memory with unmap_rom().
+ */
+rom_status_t
+map_rom(const char * filename, uint16_t origin, uint8_t ** memory, size_t * size)
+{
+    int fd;
+    rom_status_t status = open_file(filename, MEMORY_SIZE - origin, &fd, size);
+
+    if (status != ROM_OK)
+    {
+        return status;
+    }
+
+    uint8_t * data = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return ROM_OUT_OF_MEMORY;
+    }
+
+    int loaded = origin % sysconf(_SC_PAGESIZE) == 0
+        ? overlay_file(data + origin, fd, *size, PROT_READ | PROT_WRITE)
+        : read_fully(fd, data + origin, *size);
+
+    close(fd);
+    if (!loaded)
+    {
+        munmap(data, MEMORY_SIZE);
+        return ROM_CANNOT_READ;
+    }
+
+    *memory = data;
+    return ROM_OK;
+}
+
+void
+unmap_rom(uint8_t * memory)
+{
+    munmap(memory, MEMORY_SIZE);
+}
+
+#else
+
+// Without mmap the file is read into memory from the heap instead.
+
+static rom_status_t
+read_file(const char * filename, size_t limit, size_t offset, size_t total,
+          uint8_t ** buffer, size_t * size)
+{
+    FILE * fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        return ROM_CANNOT_OPEN;
+    }
+
+    long fsize = -1;
+    if (fseek(fp, 0L, SEEK_END) == 0)
+    {
+        fsize = ftell(fp);
+    }
+
+    if (fsize < 0 || fseek(fp, 0L, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return ROM_CANNOT_READ;
+    }
+
+    if ((unsigned long)fsize > limit)
+    {
+        fclose(fp);
+        return ROM_TOO_LARGE;
+    }
+
+    if (total == 0)
+    {
+        total = fsize + ROM_PADDING;
+    }
+
+    uint8_t * data = calloc(1, total);
+    if (data == NULL)
+    {
+        fclose(fp);
+        return ROM_OUT_OF_MEMORY;
+    }
+
+    if (fread(data + offset, 1, fsize, fp) != (size_t)fsize)
+    {
+        free(data);
+        fclose(fp);
+        return ROM_CANNOT_READ;
+    }
+
+    fclose(fp);
+    *buffer = data;
+    *size = fsize;
+
+    return ROM_OK;
+}
+
+static rom_status_t
+open_view(rom_t * rom, const char * filename, size_t limit)
+{
+    uint8_t * data;
+    size_t size;
+    rom_status_t status = read_file(filename, limit, 0, 0, &data, &size);
+
+    if (status == ROM_OK)
+    {
+        rom->data = data;
+        rom->size = size;
+        rom->mapped = 0;
+    }
+
+    return status;
+}
+
+void
+close_rom(rom_t * rom)
+{
+    free((void *)rom->data);
+    rom->data = NULL;
+    rom->size = 0;
+}
+
+rom_status_t
+map_rom(const char * filename, uint16_t origin, uint8_t ** memory, size_t * size)
+{
+    return read_file(filename, MEMORY_SIZE - origin, origin, MEMORY_SIZE, memory, size);
+}
+
+void
+unmap_rom(uint8_t * memory)
+{
+    free(memory);
+}
+
+#endif
+
+/*
+ * Opens a ROM file read-only. Returns ROM_OK and fills in rom, or another
+ * status and leaves it alone. Close it with close_rom().
+ */
+rom_status_t
+open_rom(rom_t * rom, const char * filename)
+{
+    return open_view(rom, filename, ROM_MAX_SIZE);
+}
+
+// Opens a file of any size read-only, such as a memory dump.
+rom_status_t
+open_dump(rom_t * rom, const char * filename)
+{
+    return open_view(rom, filename, SIZE_MAX - ROM_PADDING);
+}
@@ -0,0 +1,40 @@
+#ifndef ROM_8080_H_
+#define ROM_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROM_MAX_SIZE 0x10000 // the whole address space
+
+// Zero bytes that always follow an open ROM's data, so a decoder can read
+// the operands of a truncated last instruction without a bounds check.
+#define ROM_PADDING 16
+
+typedef enum rom_status
+{
+    ROM_OK,
+    ROM_CANNOT_OPEN,  // no such file, or no permission
+    ROM_CANNOT_READ,  // not a regular file, or an I/O error
+    ROM_TOO_LARGE,    // does not fit in the address space at its origin
+    ROM_OUT_OF_MEMORY
+} rom_status_t;
+
+// A read-only view of a ROM file, mapped rather than copied where possible.
+typedef struct rom
+{
+    const uint8_t * data; // size bytes, then ROM_PADDING zero bytes
+    size_t size;
+    size_t mapped;        // length of the mapping, 0 if data was malloc'd
+} rom_t;
+
+const char * rom_status_name(rom_status_t status);
+
+rom_status_t open_rom(rom_t * rom, const char * filename);
+rom_status_t open_dump(rom_t * rom, const char * filename);
+void close_rom(rom_t * rom);
+
+rom_status_t map_rom(const char * filename, uint16_t origin,
+                     uint8_t ** memory, size_t * size);
+void unmap_rom(uint8_t * memory);
+
+#endif /* !ROM_8080_H_ */
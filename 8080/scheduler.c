@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <string.h>
+#include "block_cache.h"
+#include "debugger.h"
+#include "emulator.h"
+#include "scheduler.h"
+
+void
+init_scheduler(scheduler_t * scheduler, cpu_8080_t * cpu)
+{
+    memset(scheduler, 0, sizeof(scheduler_t));
+    scheduler->cpu = cpu;
+}
+
+static int
+fires_before(const timed_event_t * a, const timed_event_t * b)
+{
+    return a->when < b->when || (a->when == b->when && a->order < b->order);
+}
+
+static void
+sift_up(timed_event_t * events, int slot)
+{
+    timed_event_t event = events[slot];
+
+    while (slot > 0 && fires_before(&event, &events[(slot - 1) / 2]))
+    {
+        events[slot] = events[(slot - 1) / 2];
+        slot = (slot - 1) / 2;
+    }
+
+    events[slot] = event;
+}
+
+static void
+sift_down(timed_event_t * events, int count, int slot)
+{
+    timed_event_t event = events[slot];
+
+    for (;;)
+    {
+        int child = 2 * slot + 1;
+
+        if (child >= count)
+        {
+            break;
+        }
+
+        if (child + 1 < count && fires_before(&events[child + 1], &events[child]))
+        {
+            child++;
+        }
+
+        if (!fires_before(&events[child], &event))
+        {
+            break;
+        }
+
+        events[slot] = events[child];
+        slot = child;
+    }
+
+    events[slot] = event;
+}
+
+/*
+ * Adds an event that fires once the machine has run to cycle when, and
+ * every period cycles after that if period is not 0. Returns 0, or -1 if
+ * MAX_EVENTS are already waiting.
+ */
+int
+schedule_event(scheduler_t * scheduler, uint64_t when, uint64_t period,
+               scheduler_event_t fire, void * context)
+{
+    if (scheduler->count == MAX_EVENTS)
+    {
+        return -1;
+    }
+
+    timed_event_t * event = &scheduler->events[scheduler->count];
+
+    event->when = when;
+    event->period = period;
+    event->order = scheduler->scheduled++;
+    event->fire = fire;
+    event->context = context;
+    sift_up(scheduler->events, scheduler->count++);
+
+    return 0;
+}
+
+static void
+fire_interrupt(cpu_8080_t * cpu, void * context)
+{
+    raise_interrupt(cpu, (uint8_t)(uintptr_t)context);
+}
+
+// Raises an interrupt with RST vector at when, and every period after.
+int
+schedule_interrupt(scheduler_t * scheduler, uint64_t when, uint64_t period,
+                   uint8_t vector)
+{
+    return schedule_event(scheduler, when, period, fire_interrupt,
+                          (void *)(uintptr_t)vector);
+}
+
+// Removes every waiting event with this callback and context.
+void
+cancel_events(scheduler_t * scheduler, scheduler_event_t fire, void * context)
+{
+    int kept = 0;
+
+    for (int i = 0; i < scheduler->count; i++)
+    {
+        const timed_event_t * event = &scheduler->events[i];
+
+        if (event->fire != fire || event->context != context)
+        {
+            scheduler->events[kept++] = *event;
+        }
+    }
+
+    scheduler->count = kept;
+    for (int i = kept / 2 - 1; i >= 0; i--)
+    {
+        sift_down(scheduler->events, kept, i);
+    }
+}
+
+// Makes run_scheduler() return once the event being fired is done.
+void
+stop_scheduler(scheduler_t * scheduler)
+{
+    scheduler->stopped = 1;
+}
+
+/*
+ * Runs the machine to the first instruction boundary at or past deadline.
+ * The block executor only checks its budget between blocks, so it is
+ * stopped a block short and the rest is run an instruction at a time. A
+ * halted machine just lets the time pass, unless it is about to take an
+ * interrupt. A debugger that stops the machine stops it short.
+ */
+void
+run_until(cpu_8080_t * cpu, uint64_t deadline)
+{
+    while (cpu->cycles < deadline && !DEBUG_STOPPED(cpu))
+    {
+        uint64_t left = deadline - cpu->cycles;
+
+        if (cpu->halted && !(cpu->interrupt_pending && cpu->interrupt_enabled))
+        {
+            cpu->cycles = deadline;
+        }
+        else if (left > MAX_BLOCK_CYCLES)
+        {
+            process_blocks(cpu, left - MAX_BLOCK_CYCLES);
+        }
+        else
+        {
+            process_instructions(cpu, left);
+        }
+    }
+}
+
+/*
+ * Runs the machine for cycles, firing each event as its time comes. Time
+ * is kept as absolute cycle counts, so running over a deadline by part of
+ * an instruction never adds up to drift. Interrupts raised by an event are
+ * taken as the machine starts again. Returns the cycles run.
+ */
+uint64_t
+run_scheduler(scheduler_t * scheduler, uint64_t cycles)
+{
+    cpu_8080_t * cpu = scheduler->cpu;
+    timed_event_t * events = scheduler->events;
+    uint64_t start = cpu->cycles;
+    uint64_t end = start + cycles;
+
+    scheduler->stopped = 0;
+
+    while (cpu->cycles < end && !scheduler->stopped && !DEBUG_STOPPED(cpu))
+    {
+        uint64_t deadline = end;
+
+        if (scheduler->count > 0 && events[0].when < deadline)
+        {
+            deadline = events[0].when;
+        }
+
+        run_until(cpu, deadline);
+
+        while (scheduler->count > 0 && events[0].when <= cpu->cycles)
+        {
+            timed_event_t event = events[0];
+
+            // A periodic event goes back in place of itself, as if
+            // scheduled anew.
+            if (event.period)
+            {
+                events[0].when += event.period;
+                events[0].order = scheduler->scheduled++;
+            }
+            else
+            {
+                events[0] = events[--scheduler->count];
+            }
+
+            sift_down(events, scheduler->count, 0);
+            event.fire(cpu, event.context);
+        }
+    }
+
+    return cpu->cycles - start;
+}
@@ -0,0 +1,46 @@
+#ifndef SCHEDULER_8080_H_
+#define SCHEDULER_8080_H_
+
+#include <stdint.h>
+#include "emulator.h"
+
+#define MAX_EVENTS 64
+
+typedef void (*scheduler_event_t)(cpu_8080_t * cpu, void * context);
+
+// Something to do when the machine's cycle count reaches a point.
+typedef struct timed_event
+{
+    uint64_t when;          // fires at the first instruction boundary at or past this
+    uint64_t period;        // cycles until it fires again, 0 to fire once
+    uint64_t order;         // breaks ties between events due at once
+    scheduler_event_t fire;
+    void * context;
+} timed_event_t;
+
+/*
+ * Runs a machine in quanta that end at its timed events, so that each
+ * event sees the machine exactly where the real one would be. Events wait
+ * in a binary min-heap by cycle; ties fire in the order they were
+ * scheduled.
+ */
+typedef struct scheduler
+{
+    cpu_8080_t * cpu;
+    timed_event_t events[MAX_EVENTS];
+    int count;
+    uint64_t scheduled;     // events scheduled so far
+    int stopped;
+} scheduler_t;
+
+void init_scheduler(scheduler_t * scheduler, cpu_8080_t * cpu);
+int schedule_event(scheduler_t * scheduler, uint64_t when, uint64_t period,
+                   scheduler_event_t fire, void * context);
+int schedule_interrupt(scheduler_t * scheduler, uint64_t when, uint64_t period,
+                       uint8_t vector);
+void cancel_events(scheduler_t * scheduler, scheduler_event_t fire, void * context);
+void stop_scheduler(scheduler_t * scheduler);
+uint64_t run_scheduler(scheduler_t * scheduler, uint64_t cycles);
+void run_until(cpu_8080_t * cpu, uint64_t deadline);
+
+#endif /* !SCHEDULER_8080_H_ */
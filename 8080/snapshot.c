@@ -0,0 +1,520 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // memfd_create
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_cache.h"
+#include "emulator.h"
+#include "snapshot.h"
+
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define MEMORY_SIZE 0x10000
+
+static void
+put_word(uint8_t * p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static uint16_t
+get_word(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+// Copies everything but the memory, the block cache and the page flags.
+static void
+copy_registers(cpu_8080_t * to, const cpu_8080_t * from)
+{
+    to->a = from->a;
+    to->b = from->b;
+    to->c = from->c;
+    to->d = from->d;
+    to->e = from->e;
+    to->h = from->h;
+    to->l = from->l;
+    to->stack_pointer = from->stack_pointer;
+    to->program_counter = from->program_counter;
+    to->condition_codes = from->condition_codes;
+    to->flag_result = from->flag_result;
+    to->flag_aux = from->flag_aux;
+    to->flags_lazy = from->flags_lazy;
+    to->interrupt_enabled = from->interrupt_enabled;
+    to->halted = from->halted;
+    to->cycles = from->cycles;
+    to->interrupt_pending = from->interrupt_pending;
+    to->interrupt_vector = from->interrupt_vector;
+}
+
+// Copies what the machine is wired to: its ports and its memory map.
+static void
+copy_devices(cpu_8080_t * to, const cpu_8080_t * from)
+{
+    to->ports = from->ports;
+    to->port_in = from->port_in;
+    to->port_out = from->port_out;
+    to->memory_map = from->memory_map;
+
+    for (int page = 0; page < 256; page++)
+    {
+        to->page_flags[page] = (to->page_flags[page] & ~PAGE_MAPPED) |
+                               (from->page_flags[page] & PAGE_MAPPED);
+    }
+}
+
+// Saves the memory map's banks as the machine has them. Returns 0, or -1
+// if out of memory.
+static int
+save_map(checkpoint_t * checkpoint, const cpu_8080_t * cpu)
+{
+    if (cpu->memory_map == NULL)
+    {
+        return 0;
+    }
+
+    size_t size = bank_store_size(cpu->memory_map);
+
+    if (size != 0 && (checkpoint->bank_stores = malloc(size)) == NULL)
+    {
+        return -1;
+    }
+
+    save_banks(cpu->memory_map, checkpoint->banks, checkpoint->bank_stores);
+    return 0;
+}
+
+// Whatever was translated from the old memory no longer holds.
+static void
+memory_replaced(cpu_8080_t * cpu)
+{
+    if (cpu->block_cache != NULL)
+    {
+        flush_block_cache(cpu);
+    }
+}
+
+/*
+ * Writes the header of a snapshot, everything but the memory, to
+ * SNAPSHOT_HEADER_SIZE bytes.
+ */
+void
+save_registers(const cpu_8080_t * cpu, uint8_t * header)
+{
+    uint8_t * p = header;
+
+    memcpy(p, "8080", 4);
+    p[4] = SNAPSHOT_VERSION;
+    p[5] = cpu->a;
+    p[6] = cpu->b;
+    p[7] = cpu->c;
+    p[8] = cpu->d;
+    p[9] = cpu->e;
+    p[10] = cpu->h;
+    p[11] = cpu->l;
+    p[12] = pack_condition_codes(cpu);
+    put_word(p + 13, cpu->stack_pointer);
+    put_word(p + 15, cpu->program_counter);
+    p[17] = cpu->interrupt_enabled;
+    p[18] = cpu->halted;
+
+    for (int i = 0; i < 8; i++)
+    {
+        p[19 + i] = (cpu->cycles >> (i * 8)) & 0xFF;
+    }
+
+    p[27] = cpu->interrupt_pending << 7 | cpu->interrupt_vector;
+}
+
+// Loads the registers from a header written by save_registers().
+void
+load_registers(cpu_8080_t * cpu, const uint8_t * header)
+{
+    cpu->a = header[5];
+    cpu->b = header[6];
+    cpu->c = header[7];
+    cpu->d = header[8];
+    cpu->e = header[9];
+    cpu->h = header[10];
+    cpu->l = header[11];
+    unpack_condition_codes(cpu, header[12]);
+    cpu->stack_pointer = get_word(header + 13);
+    cpu->program_counter = get_word(header + 15);
+    cpu->interrupt_enabled = header[17];
+    cpu->halted = header[18];
+
+    cpu->cycles = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        cpu->cycles = (cpu->cycles << 8) | header[19 + i];
+    }
+
+    cpu->interrupt_pending = header[27] >> 7;
+    cpu->interrupt_vector = header[27] & 7;
+}
+
+/*
+ * Writes a snapshot of the machine to a buffer of at least
+ * SNAPSHOT_MAX_SIZE bytes and returns its length.
+ */
+size_t
+save_snapshot(const cpu_8080_t * cpu, uint8_t * buffer)
+{
+    uint8_t * p = buffer;
+
+    save_registers(cpu, p);
+
+    uint8_t * bitmap = p + SNAPSHOT_HEADER_SIZE;
+    uint8_t * pages = bitmap + 32;
+
+    memset(bitmap, 0, 32);
+    for (int page = 0; page < 256; page++)
+    {
+        const uint8_t * data = cpu->memory + page * 256;
+
+        // A page is zero if its first byte is and it matches itself
+        // shifted by one.
+        if (data[0] == 0 && memcmp(data, data + 1, 255) == 0)
+        {
+            continue;
+        }
+
+        bitmap[page / 8] |= 1 << (page % 8);
+        memcpy(pages, data, 256);
+        pages += 256;
+    }
+
+    return pages - buffer;
+}
+
+/*
+ * Loads a snapshot into a machine with 64 KiB of memory. Returns 0, or -1
+ * if the buffer does not hold a snapshot, leaving the machine untouched.
+ */
+int
+load_snapshot(cpu_8080_t * cpu, const uint8_t * buffer, size_t size)
+{
+    const uint8_t * bitmap = buffer + SNAPSHOT_HEADER_SIZE;
+    size_t expected = SNAPSHOT_HEADER_SIZE + 32;
+
+    if (size < expected || memcmp(buffer, "8080", 4) != 0 ||
+        buffer[4] != SNAPSHOT_VERSION)
+    {
+        return -1;
+    }
+
+    for (int page = 0; page < 256; page++)
+    {
+        expected += (bitmap[page / 8] >> (page % 8) & 1) * 256;
+    }
+
+    if (size != expected)
+    {
+        return -1;
+    }
+
+    load_registers(cpu, buffer);
+
+    const uint8_t * pages = bitmap + 32;
+    for (int page = 0; page < 256; page++)
+    {
+        uint8_t * data = cpu->memory + page * 256;
+
+        if (bitmap[page / 8] >> (page % 8) & 1)
+        {
+            memcpy(data, pages, 256);
+            pages += 256;
+        }
+        else
+        {
+            memset(data, 0, 256);
+        }
+    }
+
+    memory_replaced(cpu);
+    return 0;
+}
+
+/*
+ * Forks start with every page PAGE_CLEAN. The first store to a page marks
+ * it in dirty_pages, and restoring copies back just those pages, so the
+ * cost of a restore follows what the fork wrote rather than the size of
+ * memory. Blocks translated from a restored page are thrown away; the rest
+ * of the block cache survives.
+ */
+
+static void
+track_pages(cpu_8080_t * cpu)
+{
+    for (int page = 0; page < 256; page++)
+    {
+        cpu->page_flags[page] |= PAGE_CLEAN;
+    }
+
+    memset(cpu->dirty_pages, 0, sizeof(cpu->dirty_pages));
+}
+
+static void
+restore_pages(cpu_8080_t * cpu, const uint8_t * image)
+{
+    for (int page = 0; page < 256; page++)
+    {
+        if (!(cpu->dirty_pages[page / 8] >> (page % 8) & 1))
+        {
+            continue;
+        }
+
+        memcpy(cpu->memory + page * 256, image + page * 256, 256);
+
+        invalidate_page(cpu, page);
+    }
+
+    track_pages(cpu);
+}
+
+static cpu_8080_t *
+new_fork(const checkpoint_t * checkpoint, uint8_t * memory)
+{
+    cpu_8080_t * cpu = calloc(1, sizeof(cpu_8080_t));
+    if (cpu == NULL)
+    {
+        return NULL;
+    }
+
+    cpu->memory = memory;
+    copy_registers(cpu, &checkpoint->cpu);
+    copy_devices(cpu, &checkpoint->cpu);
+    track_pages(cpu);
+
+    if (cpu->memory_map != NULL)
+    {
+        cpu->memory_map = copy_memory_map(cpu->memory_map);
+        if (cpu->memory_map == NULL)
+        {
+            free(cpu);
+            return NULL;
+        }
+
+        load_banks(cpu->memory_map, checkpoint->banks, checkpoint->bank_stores);
+    }
+
+    return cpu;
+}
+
+/*
+ * Puts a fork of the checkpoint back in the checkpoint's state. Changes
+ * made through cpu->memory rather than by the program are not tracked.
+ */
+void
+restore_checkpoint(cpu_8080_t * cpu, const checkpoint_t * checkpoint)
+{
+    restore_pages(cpu, checkpoint->image);
+    copy_registers(cpu, &checkpoint->cpu);
+
+    if (cpu->memory_map != NULL)
+    {
+        load_banks(cpu->memory_map, checkpoint->banks, checkpoint->bank_stores);
+    }
+}
+
+#if defined(__unix__)
+
+/*
+ * The checkpoint's memory lives in a file that forks map privately, so the
+ * kernel shares each 4 KiB page between them until one writes to it.
+ */
+
+static int
+memory_file(void)
+{
+#if defined(__linux__)
+    return memfd_create("8080-checkpoint", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/8080-checkpoint-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd >= 0)
+    {
+        unlink(path);
+    }
+
+    return fd;
+#endif
+}
+
+checkpoint_t *
+create_checkpoint(const cpu_8080_t * cpu)
+{
+    checkpoint_t * checkpoint = calloc(1, sizeof(checkpoint_t));
+    if (checkpoint == NULL)
+    {
+        return NULL;
+    }
+
+    checkpoint->image = MAP_FAILED;
+    checkpoint->fd = memory_file();
+    if (checkpoint->fd < 0 ||
+        pwrite(checkpoint->fd, cpu->memory, MEMORY_SIZE, 0) != MEMORY_SIZE)
+    {
+        free_checkpoint(checkpoint);
+        return NULL;
+    }
+
+    checkpoint->image = mmap(NULL, MEMORY_SIZE, PROT_READ, MAP_SHARED,
+                             checkpoint->fd, 0);
+    if (checkpoint->image == MAP_FAILED)
+    {
+        free_checkpoint(checkpoint);
+        return NULL;
+    }
+
+    copy_registers(&checkpoint->cpu, cpu);
+    copy_devices(&checkpoint->cpu, cpu);
+
+    if (save_map(checkpoint, cpu) != 0)
+    {
+        free_checkpoint(checkpoint);
+        return NULL;
+    }
+
+    return checkpoint;
+}
+
+void
+free_checkpoint(checkpoint_t * checkpoint)
+{
+    if (checkpoint != NULL)
+    {
+        if (checkpoint->image != MAP_FAILED)
+        {
+            munmap(checkpoint->image, MEMORY_SIZE);
+        }
+
+        if (checkpoint->fd >= 0)
+        {
+            close(checkpoint->fd);
+        }
+
+        free(checkpoint->bank_stores);
+        free(checkpoint);
+    }
+}
+
+/*
+ * Returns a new machine in the checkpoint's state, with the checkpoint's
+ * port handlers, a copy of its memory map and no block cache. Free it with
+ * free_fork().
+ */
+cpu_8080_t *
+fork_checkpoint(const checkpoint_t * checkpoint)
+{
+    uint8_t * memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE, checkpoint->fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    cpu_8080_t * cpu = new_fork(checkpoint, memory);
+    if (cpu == NULL)
+    {
+        munmap(memory, MEMORY_SIZE);
+    }
+
+    return cpu;
+}
+
+void
+free_fork(cpu_8080_t * cpu)
+{
+    if (cpu != NULL)
+    {
+        munmap(cpu->memory, MEMORY_SIZE);
+        free_memory_map_copy(cpu->memory_map);
+        free(cpu);
+    }
+}
+
+#else
+
+// Without mmap every fork gets its own copy of the memory.
+
+checkpoint_t *
+create_checkpoint(const cpu_8080_t * cpu)
+{
+    checkpoint_t * checkpoint = calloc(1, sizeof(checkpoint_t));
+    if (checkpoint == NULL)
+    {
+        return NULL;
+    }
+
+    checkpoint->fd = -1;
+    checkpoint->image = malloc(MEMORY_SIZE);
+    if (checkpoint->image == NULL)
+    {
+        free(checkpoint);
+        return NULL;
+    }
+
+    memcpy(checkpoint->image, cpu->memory, MEMORY_SIZE);
+    copy_registers(&checkpoint->cpu, cpu);
+    copy_devices(&checkpoint->cpu, cpu);
+
+    if (save_map(checkpoint, cpu) != 0)
+    {
+        free_checkpoint(checkpoint);
+        return NULL;
+    }
+
+    return checkpoint;
+}
+
+void
+free_checkpoint(checkpoint_t * checkpoint)
+{
+    if (checkpoint != NULL)
+    {
+        free(checkpoint->image);
+        free(checkpoint->bank_stores);
+        free(checkpoint);
+    }
+}
+
+cpu_8080_t *
+fork_checkpoint(const checkpoint_t * checkpoint)
+{
+    uint8_t * memory = malloc(MEMORY_SIZE);
+    if (memory == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(memory, checkpoint->image, MEMORY_SIZE);
+
+    cpu_8080_t * cpu = new_fork(checkpoint, memory);
+    if (cpu == NULL)
+    {
+        free(memory);
+    }
+
+    return cpu;
+}
+
+void
+free_fork(cpu_8080_t * cpu)
+{
+    if (cpu != NULL)
+    {
+        free(cpu->memory);
+        free_memory_map_copy(cpu->memory_map);
+        free(cpu);
+    }
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SNAPSHOT_8080_H_
+#define SNAPSHOT_8080_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emulator.h"
+#include "memory_map.h"
+
+/*
+ * Snapshots are a small header followed by a bitmap of the 256-byte pages
+ * of memory that are not all zero, and then those pages:
+ *
+ *   "8080" version  A B C D E H L flags  SP PC  IE halted  cycles  interrupt
+ *   page bitmap (32 bytes)  pages (256 bytes each)
+ *
+ * Words are little-endian and flags is the byte PUSH PSW would push.
+ * interrupt has the raised interrupt's RST in bits 0-2 and bit 7 set if
+ * it is still waiting.
+ */
+#define SNAPSHOT_VERSION     2
+#define SNAPSHOT_HEADER_SIZE 28
+#define SNAPSHOT_MAX_SIZE    (SNAPSHOT_HEADER_SIZE + 32 + 0x10000)
+
+void save_registers(const cpu_8080_t * cpu, uint8_t * header);
+void load_registers(cpu_8080_t * cpu, const uint8_t * header);
+size_t save_snapshot(const cpu_8080_t * cpu, uint8_t * buffer);
+int load_snapshot(cpu_8080_t * cpu, const uint8_t * buffer, size_t size);
+
+/*
+ * A checkpoint holds a machine state that any number of forks can start
+ * from. Forks share the checkpoint's memory copy-on-write, and restoring a
+ * fork copies back only the 256-byte pages it wrote to. A machine with a
+ * memory map has its banks saved too, see memory_map.h, and each fork gets
+ * a copy of the map to switch banks in on its own.
+ */
+typedef struct checkpoint
+{
+    cpu_8080_t cpu;  // registers; memory and block_cache are unused
+    int fd;          // file holding the memory image, or -1
+    uint8_t * image; // the memory image
+    size_t banks[MAX_BANK_WINDOWS]; // see save_banks()
+    uint8_t * bank_stores;
+} checkpoint_t;
+
+checkpoint_t * create_checkpoint(const cpu_8080_t * cpu);
+void free_checkpoint(checkpoint_t * checkpoint);
+cpu_8080_t * fork_checkpoint(const checkpoint_t * checkpoint);
+void restore_checkpoint(cpu_8080_t * cpu, const checkpoint_t * checkpoint);
+void free_fork(cpu_8080_t * cpu);
+
+#endif /* !SNAPSHOT_8080_H_ */
@@ -0,0 +1,423 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opcodes.h"
+#include "trace.h"
+
+// The most bytes a frame of TRACE_CHUNK_SIZE records takes: two bytes of
+// counts and three whole words a record.
+#define MAX_FRAME_SIZE (TRACE_CHUNK_SIZE * (2 + TRACE_RECORD_SIZE))
+
+// Words are written a whole eight bytes at a time, past the end of the
+// bytes that are kept.
+#define FRAME_SLACK 8
+
+typedef char trace_header_size_check[sizeof(trace_header_t) == 16 ? 1 : -1];
+
+// Bits of the second word that belong to an instruction of each size.
+static const uint64_t code_masks[4] = {
+    0xFFFFFF0000FFFFFFull,
+    0xFFFFFF0000FFFFFFull,
+    0xFFFFFF00FFFFFFFFull,
+    0xFFFFFFFFFFFFFFFFull
+};
+
+static void
+put_word32(uint8_t * p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+static uint32_t
+get_word32(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Stores all eight bytes of a word, of which the caller keeps the low ones.
+static void
+put_word64(uint8_t * p, uint64_t value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(p, &value, sizeof(value));
+#else
+    for (int i = 0; i < 8; i++)
+    {
+        p[i] = (value >> (i * 8)) & 0xFF;
+    }
+#endif
+}
+
+static void
+pack_record(const trace_record_t * record, uint64_t * words)
+{
+    words[0] = record->cycle;
+    words[1] = record->address |
+               (uint64_t)record->code[0] << 16 |
+               (uint64_t)record->code[1] << 24 |
+               (uint64_t)record->code[2] << 32 |
+               (uint64_t)record->flags << 40 |
+               (uint64_t)record->lazy << 48 |
+               (uint64_t)record->a << 56;
+    words[2] = record->b |
+               (uint64_t)record->c << 8 |
+               (uint64_t)record->d << 16 |
+               (uint64_t)record->e << 24 |
+               (uint64_t)record->h << 32 |
+               (uint64_t)record->l << 40 |
+               (uint64_t)record->stack_pointer << 48;
+}
+
+static void
+unpack_record(const uint64_t * words, trace_record_t * record)
+{
+    record->cycle = words[0];
+    record->address = words[1] & 0xFFFF;
+    record->code[0] = words[1] >> 16;
+    record->code[1] = words[1] >> 24;
+    record->code[2] = words[1] >> 32;
+    record->flags = words[1] >> 40;
+    record->lazy = words[1] >> 48;
+    record->a = words[1] >> 56;
+    record->b = words[2];
+    record->c = words[2] >> 8;
+    record->d = words[2] >> 16;
+    record->e = words[2] >> 24;
+    record->h = words[2] >> 32;
+    record->l = words[2] >> 40;
+    record->stack_pointer = words[2] >> 48;
+}
+
+// The bytes of word up to the last one that is not zero.
+static unsigned
+significant_bytes(uint64_t word)
+{
+#if defined(__GNUC__)
+    return word ? 8 - __builtin_clzll(word) / 8 : 0;
+#else
+    unsigned bytes = 0;
+
+    for (; word != 0; word >>= 8)
+    {
+        bytes++;
+    }
+
+    return bytes;
+#endif
+}
+
+// Compresses records into frame and returns the length of the frame.
+static size_t
+encode_frame(const trace_record_t * records, size_t count, uint8_t * frame)
+{
+    uint64_t previous[3] = { 0, 0, 0 };
+    uint8_t * p = frame + 8;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t words[3];
+
+        pack_record(&records[i], words);
+        words[1] &= code_masks[opcode_table[records[i].code[0]].size];
+
+        uint64_t cycles = words[0] - previous[0];
+        uint64_t low = words[1] ^ previous[1];
+        uint64_t high = words[2] ^ previous[2];
+        unsigned sizes[3] = {
+            significant_bytes(cycles),
+            significant_bytes(low),
+            significant_bytes(high)
+        };
+
+        memcpy(previous, words, sizeof(previous));
+
+        p[0] = sizes[0] | sizes[1] << 4;
+        p[1] = sizes[2];
+        p += 2;
+        put_word64(p, cycles);
+        p += sizes[0];
+        put_word64(p, low);
+        p += sizes[1];
+        put_word64(p, high);
+        p += sizes[2];
+    }
+
+    put_word32(frame, count);
+    put_word32(frame + 4, p - frame - 8);
+
+    return p - frame;
+}
+
+static void *
+spill(void * argument)
+{
+    trace_t * trace = argument;
+
+    pthread_mutex_lock(&trace->lock);
+    for (;;)
+    {
+        while (trace->tail == trace->head && !trace->closing)
+        {
+            pthread_cond_wait(&trace->ready, &trace->lock);
+        }
+
+        if (trace->tail == trace->head)
+        {
+            break;
+        }
+
+        size_t tail = trace->tail;
+        size_t head = trace->head;
+        pthread_mutex_unlock(&trace->lock);
+
+        // Chunks start on a multiple of TRACE_CHUNK_SIZE, so none wraps
+        // around the end of the ring.
+        size_t count = head - tail < TRACE_CHUNK_SIZE ? head - tail : TRACE_CHUNK_SIZE;
+        size_t size = encode_frame(&trace->ring[tail & (TRACE_RING_SIZE - 1)],
+                                   count, trace->frame);
+        int failed = fwrite(trace->frame, 1, size, trace->file) != size;
+
+        pthread_mutex_lock(&trace->lock);
+        trace->tail = tail + count;
+        trace->failed |= failed;
+        pthread_cond_signal(&trace->space);
+    }
+    pthread_mutex_unlock(&trace->lock);
+
+    return NULL;
+}
+
+/*
+ * Hands the records so far to the spill thread and waits, if need be, for
+ * room in the ring for the next chunk. Called by trace_record().
+ */
+void
+spill_trace(trace_t * trace)
+{
+    pthread_mutex_lock(&trace->lock);
+    trace->head = trace->next;
+    pthread_cond_signal(&trace->ready);
+
+    while (trace->next + TRACE_CHUNK_SIZE - trace->tail > TRACE_RING_SIZE)
+    {
+        pthread_cond_wait(&trace->space, &trace->lock);
+    }
+    pthread_mutex_unlock(&trace->lock);
+
+    trace->limit = trace->next + TRACE_CHUNK_SIZE;
+}
+
+static void
+free_trace(trace_t * trace)
+{
+    if (trace->file != NULL)
+    {
+        fclose(trace->file);
+    }
+
+    free(trace->frame);
+    free(trace->ring);
+    free(trace);
+}
+
+/*
+ * Creates the trace file and starts its spill thread. Returns NULL if
+ * either cannot be done. Set cpu->trace to the result to start tracing.
+ */
+trace_t *
+open_trace(const char * filename)
+{
+    trace_t * trace = calloc(1, sizeof(trace_t));
+    if (trace == NULL)
+    {
+        return NULL;
+    }
+
+    trace->ring = malloc(TRACE_RING_SIZE * sizeof(trace_record_t));
+    trace->frame = malloc(8 + MAX_FRAME_SIZE + FRAME_SLACK);
+    trace->file = fopen(filename, "wb");
+    trace->limit = TRACE_CHUNK_SIZE;
+
+    uint8_t header[sizeof(trace_header_t)];
+    memcpy(header, TRACE_MAGIC, 8);
+    put_word32(header + 8, TRACE_VERSION);
+    put_word32(header + 12, TRACE_RECORD_SIZE);
+
+    if (trace->ring == NULL || trace->frame == NULL || trace->file == NULL ||
+        fwrite(header, sizeof(header), 1, trace->file) != 1)
+    {
+        free_trace(trace);
+        return NULL;
+    }
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->ready, NULL);
+    pthread_cond_init(&trace->space, NULL);
+
+    if (pthread_create(&trace->thread, NULL, spill, trace) != 0)
+    {
+        pthread_cond_destroy(&trace->space);
+        pthread_cond_destroy(&trace->ready);
+        pthread_mutex_destroy(&trace->lock);
+        free_trace(trace);
+        return NULL;
+    }
+
+    return trace;
+}
+
+/*
+ * Writes out what is left in the ring and closes the trace. Detach it from
+ * its CPU first. Returns 0, or -1 if any of the file could not be written.
+ */
+int
+close_trace(trace_t * trace)
+{
+    pthread_mutex_lock(&trace->lock);
+    trace->head = trace->next;
+    trace->closing = 1;
+    pthread_cond_signal(&trace->ready);
+    pthread_mutex_unlock(&trace->lock);
+
+    pthread_join(trace->thread, NULL);
+    pthread_cond_destroy(&trace->space);
+    pthread_cond_destroy(&trace->ready);
+    pthread_mutex_destroy(&trace->lock);
+
+    int failed = trace->failed;
+    failed |= fclose(trace->file) != 0;
+    trace->file = NULL;
+    free_trace(trace);
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * Opens a trace file for reading. Returns 0, or -1 if it cannot be opened
+ * or is not a trace.
+ */
+int
+open_trace_reader(trace_reader_t * reader, const char * filename)
+{
+    uint8_t header[sizeof(trace_header_t)];
+
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(filename, "rb");
+    reader->frame = malloc(MAX_FRAME_SIZE);
+
+    if (reader->file == NULL || reader->frame == NULL ||
+        fread(header, sizeof(header), 1, reader->file) != 1 ||
+        memcmp(header, TRACE_MAGIC, 8) != 0 ||
+        get_word32(header + 8) != TRACE_VERSION ||
+        get_word32(header + 12) != TRACE_RECORD_SIZE)
+    {
+        close_trace_reader(reader);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The flags PUSH PSW would push, from the flags as the CPU had them.
+static uint8_t
+packed_flags(uint8_t flags, uint8_t lazy)
+{
+    if (!(lazy & 0x80))
+    {
+        return flags;
+    }
+
+    uint8_t parity = flags ^ (flags >> 4);
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+
+    return (flags & FLAG_S) | (flags == 0 ? FLAG_Z : 0) |
+           (lazy & (FLAG_AC | FLAG_CY)) | (parity & 1 ? 0 : FLAG_P) | 0x02;
+}
+
+/*
+ * Reads the next record. Returns 1, 0 at the end of the trace, or -1 if
+ * the file is cut short or corrupt.
+ */
+int
+read_trace(trace_reader_t * reader, trace_record_t * record)
+{
+    if (reader->count == 0)
+    {
+        uint8_t words[8];
+        size_t got = fread(words, 1, sizeof(words), reader->file);
+
+        if (got == 0)
+        {
+            return 0;
+        }
+
+        reader->count = get_word32(words);
+        reader->size = get_word32(words + 4);
+        reader->offset = 0;
+        memset(reader->last, 0, sizeof(reader->last));
+
+        if (got != sizeof(words) || reader->count == 0 ||
+            reader->count > TRACE_CHUNK_SIZE || reader->size > MAX_FRAME_SIZE ||
+            fread(reader->frame, 1, reader->size, reader->file) != reader->size)
+        {
+            reader->count = 0;
+            return -1;
+        }
+    }
+
+    const uint8_t * p = reader->frame + reader->offset;
+    const uint8_t * end = reader->frame + reader->size;
+
+    if (end - p < 2)
+    {
+        return -1;
+    }
+
+    unsigned sizes[3] = { p[0] & 0xF, p[0] >> 4, p[1] };
+    p += 2;
+
+    for (int n = 0; n < 3; n++)
+    {
+        uint64_t sent = 0;
+
+        if (sizes[n] > 8 || (size_t)(end - p) < sizes[n])
+        {
+            return -1;
+        }
+
+        for (unsigned i = 0; i < sizes[n]; i++)
+        {
+            sent |= (uint64_t)p[i] << (i * 8);
+        }
+
+        p += sizes[n];
+        reader->last[n] = n == 0 ? reader->last[n] + sent : reader->last[n] ^ sent;
+    }
+
+    unpack_record(reader->last, record);
+    record->flags = packed_flags(record->flags, record->lazy);
+    record->lazy = 0;
+
+    reader->offset = p - reader->frame;
+    reader->count--;
+
+    return 1;
+}
+
+void
+close_trace_reader(trace_reader_t * reader)
+{
+    if (reader->file != NULL)
+    {
+        fclose(reader->file);
+    }
+
+    free(reader->frame);
+    memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,128 @@
+#ifndef TRACE_8080_H_
+#define TRACE_8080_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Instruction tracing. An emulator built with EMULATOR_8080_TRACE records
+ * every instruction a CPU with cpu->trace set runs, and every interrupt it
+ * takes, as a trace_record_t in the trace's ring. Without it cpu->trace is
+ * ignored and the dispatch loops carry no trace code at all.
+ *
+ * The ring is filled by the CPU's thread alone and handed over a chunk at a
+ * time to a spill thread, which compresses the records into the trace file.
+ * The CPU only waits when the spill thread falls a whole ring behind.
+ */
+
+// Records in the ring. A power of two.
+#define TRACE_RING_SIZE 0x10000
+
+// Records handed to the spill thread at a time, and in each frame of the
+// file. Divides TRACE_RING_SIZE.
+#define TRACE_CHUNK_SIZE 0x1000
+
+/*
+ * A trace file is a 16-byte header followed by frames. Each frame is the
+ * number of records in it and its length in bytes, as two 32-bit words,
+ * then the records. A record is sent as its three 64-bit words: the cycle
+ * less the cycle of the record before, then the other two XORed with the
+ * record before. Each word is cut down to its low bytes up to the last one
+ * that is not zero, and their counts go first, in the low and high nibble
+ * of a byte for the first two and a byte of its own for the third. Frames
+ * start from a record of zeroes, so each can be decoded on its own. Words
+ * and the header's fields are little-endian. The first word is the cycle,
+ * the second the address, the code, flags, lazy and A from its low byte up,
+ * and the third B, C, D, E, H, L and the stack pointer likewise.
+ */
+#define TRACE_MAGIC   "8080TRCE"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_SIZE 24 // three words
+
+typedef struct trace_header
+{
+    char magic[8];         // TRACE_MAGIC, no NUL
+    uint32_t version;      // TRACE_VERSION
+    uint32_t record_size;  // TRACE_RECORD_SIZE
+} trace_header_t;
+
+// The machine as an instruction starts.
+typedef struct trace_record
+{
+    uint64_t cycle;        // cpu->cycles when it started
+    uint16_t address;
+    uint8_t code[3];       // the instruction, or the RST an interrupt ran
+    uint8_t flags;         // as PUSH PSW pushes them, once read back
+    uint8_t lazy;          // zero once read back, see below
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint8_t d;
+    uint8_t e;
+    uint8_t h;
+    uint8_t l;
+    uint16_t stack_pointer;
+} trace_record_t;
+
+/*
+ * Records in the ring and in the file leave the flags as the CPU had them:
+ * while they are lazy, see emulator.h, bit 7 of lazy is set and flags holds
+ * the low byte of their result, with the carry in bit 0 of lazy and the
+ * auxiliary carry in bit 4. read_trace() works out the flags PUSH PSW would
+ * push.
+ */
+
+typedef struct trace
+{
+    // Used by the CPU's thread alone.
+    trace_record_t * ring;
+    size_t next;           // the next record to fill
+    size_t limit;          // where the chunk being filled ends
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;  // more records, or the trace is closing
+    pthread_cond_t space;  // the spill thread has caught up some
+    size_t head;           // records handed to the spill thread
+    size_t tail;           // records it has written out
+    int closing;
+    int failed;
+
+    FILE * file;
+    pthread_t thread;
+    uint8_t * frame;       // the frame being compressed
+} trace_t;
+
+trace_t * open_trace(const char * filename);
+int close_trace(trace_t * trace);
+void spill_trace(trace_t * trace);
+
+// Appends a record to the ring for the emulator to fill in.
+static inline trace_record_t *
+trace_record(trace_t * trace)
+{
+    if (trace->next == trace->limit)
+    {
+        spill_trace(trace);
+    }
+
+    return &trace->ring[trace->next++ & (TRACE_RING_SIZE - 1)];
+}
+
+// A trace file being read back, a record at a time.
+typedef struct trace_reader
+{
+    FILE * file;
+    uint8_t * frame;
+    size_t size;           // bytes in the frame
+    size_t offset;         // of the next record in it
+    uint32_t count;        // records left in the frame
+    uint64_t last[3];      // the words of the record before
+} trace_reader_t;
+
+int open_trace_reader(trace_reader_t * reader, const char * filename);
+int read_trace(trace_reader_t * reader, trace_record_t * record);
+void close_trace_reader(trace_reader_t * reader);
+
+#endif /* !TRACE_8080_H_ */
@@ -1,47 +1,621 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "8080/disassembler.h"
+#include "8080/opcodes.h"
+#include "8080/predecode.h"
+#include "8080/records.h"
+#include "8080/rom.h"
+#include "8080/trace.h"
 
-int
-main(int argc, char const * argv[])
+// Bytes read from a stream at a time.
+#define CHUNK_SIZE 0x10000
+
+// Text written to standard output at a time.
+#define OUTPUT_SIZE 0x40000
+
+// An address, a space, an instruction and a newline.
+#define MAX_LINE_SIZE (2 * MAX_TEXT_SIZE + 2)
+
+// Bytes of a large file disassembled by each thread at a time.
+#define SEGMENT_SIZE 0x40000
+
+#define MAX_THREADS 256
+
+// Entry points that can be given for recursive disassembly.
+#define MAX_ENTRIES 256
+
+static char output[OUTPUT_SIZE];
+static size_t output_length;
+static int output_failed;
+
+// Write records, see records.h, rather than text.
+static int binary;
+
+static void
+flush_output(void)
+{
+    size_t done = 0;
+
+    while (done < output_length && !output_failed)
+    {
+        ssize_t count = write(STDOUT_FILENO, output + done, output_length - done);
+        if (count < 0)
+        {
+            output_failed = 1;
+            break;
+        }
+
+        done += count;
+    }
+
+    output_length = 0;
+}
+
+// Formats one instruction as a line of text, or a record.
+static int
+format_line(char * line, const unsigned char * buf, size_t offset,
+            size_t address, int * size)
+{
+    if (binary)
+    {
+        record_t record;
+
+        *size = format_record(buf + offset, address + offset, &record);
+        memcpy(line, &record, sizeof(record));
+        return sizeof(record);
+    }
+
+    int length = format_address(line, address + offset);
+
+    line[length++] = ' ';
+    length += disassemble_text(buf + offset, line + length, size);
+    line[length++] = '\n';
+
+    return length;
+}
+
+/*
+ * Prints the instructions that start in buf[offset, end), numbering them
+ * from address, and returns the offset just past the last one. With
+ * partial set, an instruction that runs past end is left for the next
+ * call; otherwise it is printed with zeros for its missing bytes, which
+ * must be readable.
+ */
+static size_t
+print_instructions(const unsigned char * buf, size_t offset, size_t end,
+                   size_t address, int partial)
+{
+    while (offset < end)
+    {
+        if (partial && offset + instruction_size(buf[offset]) > end)
+        {
+            break;
+        }
+
+        if (output_length > OUTPUT_SIZE - MAX_LINE_SIZE)
+        {
+            flush_output();
+        }
+
+        int size;
+
+        output_length += format_line(output + output_length, buf, offset, address, &size);
+        offset += size;
+    }
+
+    return offset;
+}
+
+/*
+ * Disassembles a stream of any length a chunk at a time. The bytes of an
+ * instruction split across two chunks are carried over to the next.
+ */
+static int
+disassemble_stream(FILE * fp)
+{
+    static unsigned char buf[MAX_INSTRUCTION_SIZE - 1 + CHUNK_SIZE + MAX_INSTRUCTION_SIZE - 1];
+    size_t address = 0;  // of buf[0]
+    size_t carried = 0;
+
+    for (;;)
+    {
+        size_t count = fread(buf + carried, 1, CHUNK_SIZE, fp);
+
+        size_t end = carried + count;
+        if (count < CHUNK_SIZE)
+        {
+            // The end of the stream.
+            memset(buf + end, 0, MAX_INSTRUCTION_SIZE - 1);
+            print_instructions(buf, 0, end, address, 0);
+            break;
+        }
+
+        size_t offset = print_instructions(buf, 0, end, address, 1);
+
+        carried = end - offset;
+        memmove(buf, buf + offset, carried);
+        address += offset;
+    }
+
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * A run of a large file disassembled on a thread of its own. The
+ * instruction before it may run into it, by up to two bytes. Each segment
+ * works out where it would end for each of those, and then learns how far
+ * it starts in from the segment before, so no instruction is decoded twice.
+ */
+typedef struct segment
+{
+    pthread_t thread;
+    const unsigned char * data;
+    const predecoder_t * predecoder;
+    size_t start;
+    size_t end;
+    int exits[3];            // how far past end it runs, by skip
+    struct segment * next;   // the one to hand its exit to, or NULL
+
+    pthread_mutex_t lock;
+    pthread_cond_t handed;
+    int skip;                // bytes in from start, -1 until handed over
+
+    char * text;             // the lines, SEGMENT_SIZE * MAX_LINE_SIZE
+    size_t length;
+} segment_t;
+
+static void
+hand_over(segment_t * segment, int skip)
+{
+    pthread_mutex_lock(&segment->lock);
+    segment->skip = skip;
+    pthread_cond_signal(&segment->handed);
+    pthread_mutex_unlock(&segment->lock);
+}
+
+static void *
+disassemble_segment(void * argument)
 {
-    if (argc < 2)
+    segment_t * segment = argument;
+
+    find_instruction_exits(segment->predecoder, segment->data + segment->start,
+                           segment->end - segment->start, segment->exits);
+
+    pthread_mutex_lock(&segment->lock);
+    while (segment->skip < 0)
+    {
+        pthread_cond_wait(&segment->handed, &segment->lock);
+    }
+    pthread_mutex_unlock(&segment->lock);
+
+    if (segment->next != NULL)
     {
-        fprintf(stderr, "Please supply an 8080 ROM.\n");
+        hand_over(segment->next, segment->exits[segment->skip]);
+    }
+
+    size_t offset = segment->start + segment->skip;
+
+    segment->length = 0;
+    while (offset < segment->end)
+    {
+        int size;
+
+        segment->length += format_line(segment->text + segment->length,
+                                       segment->data, offset, 0, &size);
+        offset += size;
+    }
+
+    return NULL;
+}
+
+static void
+write_pieces(struct iovec * pieces, int count)
+{
+    while (count > 0 && !output_failed)
+    {
+        ssize_t written = writev(STDOUT_FILENO, pieces, count);
+        if (written < 0)
+        {
+            output_failed = 1;
+            break;
+        }
+
+        for (; count > 0 && (size_t)written >= pieces->iov_len; pieces++, count--)
+        {
+            written -= pieces->iov_len;
+        }
+
+        if (count > 0)
+        {
+            pieces->iov_base = (char *)pieces->iov_base + written;
+            pieces->iov_len -= written;
+        }
+    }
+}
+
+/*
+ * Disassembles a mapped file on several threads, a segment each, a round
+ * of segments at a time, their text written out in order.
+ */
+static int
+disassemble_parallel(const rom_t * rom, int threads)
+{
+    segment_t * segments = calloc(threads, sizeof(segment_t));
+    struct iovec * pieces = calloc(threads, sizeof(struct iovec));
+    predecoder_t * predecoder = create_predecoder();
+    int ready = 0;
+    int failed = segments == NULL || pieces == NULL || predecoder == NULL;
+
+    for (; ready < threads && !failed; ready++)
+    {
+        segments[ready].data = rom->data;
+        segments[ready].predecoder = predecoder;
+        segments[ready].text = malloc(SEGMENT_SIZE * MAX_LINE_SIZE);
+        failed = segments[ready].text == NULL;
+        pthread_mutex_init(&segments[ready].lock, NULL);
+        pthread_cond_init(&segments[ready].handed, NULL);
+    }
+
+    // Anything already buffered, such as a header, goes first.
+    flush_output();
+
+    size_t start = 0;
+    int skip = 0;
+    while (start < rom->size && !failed)
+    {
+        int count = 0;
+
+        for (size_t from = start; from < rom->size && count < threads; from += SEGMENT_SIZE)
+        {
+            segments[count].start = from;
+            segments[count].end = rom->size - from > SEGMENT_SIZE ? from + SEGMENT_SIZE : rom->size;
+            segments[count].skip = -1;
+            segments[count].next = &segments[count + 1];
+            count++;
+        }
+
+        segments[0].skip = skip;
+        segments[count - 1].next = NULL;
+
+        // The calling thread runs the first segment, which does not wait,
+        // and then any that a thread could not be started for.
+        int started = 1;
+        while (started < count &&
+               pthread_create(&segments[started].thread, NULL, disassemble_segment, &segments[started]) == 0)
+        {
+            started++;
+        }
+
+        disassemble_segment(&segments[0]);
+        for (int i = started; i < count; i++)
+        {
+            disassemble_segment(&segments[i]);
+        }
+
+        for (int i = 1; i < started; i++)
+        {
+            pthread_join(segments[i].thread, NULL);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            pieces[i].iov_base = segments[i].text;
+            pieces[i].iov_len = segments[i].length;
+        }
+
+        write_pieces(pieces, count);
+
+        start = segments[count - 1].end;
+        skip = segments[count - 1].exits[segments[count - 1].skip];
+    }
+
+    for (int i = 0; i < ready; i++)
+    {
+        free(segments[i].text);
+        pthread_mutex_destroy(&segments[i].lock);
+        pthread_cond_destroy(&segments[i].handed);
+    }
+
+    free(segments);
+    free(pieces);
+    free_predecoder(predecoder);
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * Prints a bank of up to 64 KiB traced by trace_code(), numbering it from
+ * address: a label before each jump target, the instructions reached, and
+ * DB lines for the bytes that were not.
+ */
+static void
+print_traced(const unsigned char * buf, size_t size, size_t address,
+             const code_map_t * map)
+{
+    size_t offset = 0;
+
+    while (offset < size)
+    {
+        if (output_length > OUTPUT_SIZE - 2 * MAX_LINE_SIZE)
+        {
+            flush_output();
+        }
+
+        char * line = output + output_length;
+        int length = 0;
+        int count = 1;
+
+        if (CODE_MAP_BIT(map->starts, offset))
+        {
+            if (CODE_MAP_BIT(map->labels, offset))
+            {
+                line[length++] = 'L';
+                length += format_address(line + length, address + offset);
+                line[length++] = ':';
+                line[length++] = '\n';
+            }
+
+            int size;
+            length += format_line(line + length, buf, offset, address, &size);
+        }
+        else if (!CODE_MAP_BIT(map->code, offset))
+        {
+            while (count < MAX_DATA_BYTES && offset + count < size &&
+                   !CODE_MAP_BIT(map->code, offset + count))
+            {
+                count++;
+            }
+
+            length = format_address(line, address + offset);
+            line[length++] = ' ';
+            length += format_data(buf + offset, count, line + length);
+            line[length++] = '\n';
+        }
+
+        // Operands are skipped, but an instruction jumped into the middle
+        // of is printed too.
+        output_length += length;
+        offset += count;
+    }
+}
+
+/*
+ * Disassembles each 64 KiB bank of a file by following the flow of control
+ * from the entry points, which are addresses within the bank.
+ */
+static int
+disassemble_recursive(const rom_t * rom, const uint16_t * entries, int count)
+{
+    code_map_t * map = malloc(sizeof(code_map_t));
+    int failed = map == NULL;
+
+    for (size_t bank = 0; bank < rom->size && !failed; bank += 0x10000)
+    {
+        size_t size = rom->size - bank < 0x10000 ? rom->size - bank : 0x10000;
+
+        failed = trace_code(rom->data + bank, size, entries, count, map) != 0;
+        if (!failed)
+        {
+            print_traced(rom->data + bank, size, bank, map);
+        }
+    }
+
+    flush_output();
+    free(map);
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * Prints a trace written by the emulator, see trace.h, one instruction a
+ * line: the cycle it started on, the instruction as the disassembler shows
+ * it, and the registers and flags it started with.
+ */
+static int
+print_trace(const char * filename)
+{
+    trace_reader_t reader;
+    trace_record_t record;
+    int result;
+
+    if (open_trace_reader(&reader, filename) != 0)
+    {
+        fprintf(stderr, "%s is not an 8080 trace.\n", filename);
         return 1;
     }
 
-    FILE * fp = fopen(argv[1], "rb");
-    if (fp == NULL)
+    while ((result = read_trace(&reader, &record)) > 0)
     {
-        printf("Couldn't open %s\n", argv[1]);
-        return(1);
+        static const uint8_t flag_bits[5] = { FLAG_S, FLAG_Z, FLAG_AC, FLAG_P, FLAG_CY };
+        char flags[6] = "SZAPC";
+        int size;
+
+        if (output_length > OUTPUT_SIZE - MAX_LINE_SIZE - 64)
+        {
+            flush_output();
+        }
+
+        for (int i = 0; i < 5; i++)
+        {
+            if (!(record.flags & flag_bits[i]))
+            {
+                flags[i] = '.';
+            }
+        }
+
+        output_length += sprintf(output + output_length, "%llu ",
+                                 (unsigned long long)record.cycle);
+        output_length += format_address(output + output_length, record.address);
+        output[output_length++] = ' ';
+        output_length += disassemble_text(record.code, output + output_length, &size);
+        output_length += sprintf(output + output_length,
+                                 "\tA=%02X BC=%02X%02X DE=%02X%02X HL=%02X%02X SP=%04X %s\n",
+                                 record.a, record.b, record.c, record.d, record.e,
+                                 record.h, record.l, record.stack_pointer, flags);
     }
 
-    fseek(fp, 0L, SEEK_END);
-    int fsize = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
+    flush_output();
+    close_trace_reader(&reader);
 
-    void * buf = malloc(fsize);
+    if (result < 0)
+    {
+        fprintf(stderr, "The trace %s is cut short or corrupt.\n", filename);
+        return 1;
+    }
+
+    return output_failed;
+}
+
+/*
+ * Disassembles a ROM file, or standard input given "-". Files that cannot
+ * be mapped, such as pipes, or that are larger than the address space, such
+ * as memory dumps, are streamed. With more than one thread, files of any
+ * size are mapped and split between the threads. With -r, the code is found
+ * by following jumps and calls from address 0 and any -e entry points.
+ * With -b, the output is binary records rather than text. With -t, the
+ * file is an emulator trace to print instead.
+ */
+int
+main(int argc, char * argv[])
+{
+    int threads = 1;
+    int recursive = 0;
+    int trace = 0;
+    uint16_t entries[MAX_ENTRIES] = { 0 };
+    int entry_count = 1;
+    unsigned long address;
+    char * end;
+    int bad_usage = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "bj:re:t")) != -1)
+    {
+        switch(option)
+        {
+            case 'b': binary = 1; break;
+            case 'j': threads = atoi(optarg); break;
+            case 'r': recursive = 1; break;
+            case 't': trace = 1; break;
+            case 'e':
+                // Addresses that do not parse or do not fit, or one too
+                // many, are a usage error like an unknown option.
+                address = strtoul(optarg, &end, 0);
+                if (end == optarg || *end != '\0' || address > 0xFFFF ||
+                    entry_count == MAX_ENTRIES)
+                {
+                    bad_usage = 1;
+                    break;
+                }
+                entries[entry_count++] = address;
+                break;
+            default: bad_usage = 1; break;
+        }
+    }
 
-    if (fread((unsigned char *)buf, fsize, 1, fp) != 1)
+    if (bad_usage || optind != argc - 1 || (binary && recursive) || (trace && (binary || recursive)) ||
+        (entry_count > 1 && !recursive))
     {
-        printf("Failed to read data.\n");
+        fprintf(stderr, "usage: %s [-b] [-j threads] rom|-\n"
+                        "       %s -r [-e address]... rom\n"
+                        "       %s -t trace\n", argv[0], argv[0], argv[0]);
         return 1;
     }
 
-    fclose(fp);
+    if (trace)
+    {
+        return print_trace(argv[optind]);
+    }
+
+    if (binary)
+    {
+        records_header_t header;
+
+        records_header(&header);
+        memcpy(output, &header, sizeof(header));
+        output_length = sizeof(header);
+    }
+
+    const char * filename = argv[optind];
+    rom_t rom;
+    rom_status_t status = ROM_OK;
+    FILE * fp = recursive ? NULL : stdin;
+
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+
+    if (threads > MAX_THREADS)
+    {
+        threads = MAX_THREADS;
+    }
+
+    if (strcmp(filename, "-") != 0)
+    {
+        status = threads > 1 || recursive ? open_dump(&rom, filename) : open_rom(&rom, filename);
+        if (status == ROM_OK)
+        {
+            // The zero padding after the ROM covers the operands of a
+            // truncated last instruction.
+            int result = 0;
+
+            if (recursive)
+            {
+                result = disassemble_recursive(&rom, entries, entry_count);
+            }
+            else if (threads > 1)
+            {
+                result = disassemble_parallel(&rom, threads);
+            }
+            else
+            {
+                print_instructions(rom.data, 0, rom.size, 0, 0);
+                flush_output();
+            }
+
+            close_rom(&rom);
+            if (result != 0)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                return 1;
+            }
+
+            return output_failed;
+        }
+
+        if (!recursive && (status == ROM_CANNOT_READ || status == ROM_TOO_LARGE))
+        {
+            fp = fopen(filename, "rb");
+        }
+        else
+        {
+            fp = NULL;
+        }
+    }
+
+    if (fp == NULL && status == ROM_OK)
+    {
+        fprintf(stderr, "Recursive disassembly needs a file, not a stream.\n");
+        return 1;
+    }
 
-    char disassembled[255];
+    if (fp == NULL)
+    {
+        fprintf(stderr, "The 8080 ROM %s %s.\n", filename, rom_status_name(status));
+        return 1;
+    }
 
-    int offset = 0;
-    while (offset < fsize)
+    if (disassemble_stream(fp) != 0)
     {
-        printf("%04X ", offset);
-        offset += disassemble((unsigned char *)buf, disassembled, offset);
-        printf("%s\n", disassembled);
+        flush_output();
+        fprintf(stderr, "Could not read %s.\n", filename);
+        return 1;
     }
 
-    free(buf);
-    return 0;
+    flush_output();
+    return output_failed;
 }
@@ -0,0 +1,176 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "batch.h"
+#include "emulator.h"
+
+/*
+ * Differential check of the batch engine against the interpreter. Each
+ * lane of a batch and a machine of its own start out the same and run the
+ * same cycles, round after round, and must match after every round. One
+ * batch runs random bytes, so its lanes soon go their own ways; the other
+ * runs one program of register-only opcodes and branches in every lane, so
+ * lanes stay together and go through the vector kernels.
+ *
+ *   test-batch [seed]
+ *
+ * Without a seed one is picked and printed, to run a failure again.
+ */
+
+#define LANES  96
+#define ROUNDS 200
+#define BUDGET 300
+
+static uint64_t state;
+
+static unsigned
+random_number(void)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)(state >> 33);
+}
+
+static const uint8_t register_only[] = {
+    0x00, 0x01, 0x03, 0x04, 0x05, 0x06, 0x07, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x11, 0x13, 0x14, 0x17, 0x1F, 0x21, 0x23, 0x26, 0x2B, 0x2E, 0x2F, 0x31,
+    0x33, 0x37, 0x3B, 0x3C, 0x3D, 0x3F, 0x41, 0x47, 0x78, 0x80, 0x81, 0x87,
+    0x88, 0x8F, 0x90, 0x97, 0x98, 0x9A, 0xA0, 0xA8, 0xB0, 0xB8, 0xBF, 0xC6,
+    0xCE, 0xD6, 0xDE, 0xE6, 0xEE, 0xF6, 0xFE
+};
+
+static int
+same_machine(const cpu_8080_t * x, const cpu_8080_t * y)
+{
+    return x->a == y->a && x->b == y->b && x->c == y->c && x->d == y->d &&
+           x->e == y->e && x->h == y->h && x->l == y->l &&
+           x->stack_pointer == y->stack_pointer &&
+           x->program_counter == y->program_counter &&
+           x->cycles == y->cycles && x->halted == y->halted &&
+           pack_condition_codes(x) == pack_condition_codes(y) &&
+           memcmp(x->memory, y->memory, BATCH_MEMORY_SIZE) == 0;
+}
+
+// Runs one batch against its machines. Returns the lanes that differed.
+static int
+check_batch(int shared)
+{
+    batch_t * batch = create_batch(LANES);
+    cpu_8080_t * machines = calloc(LANES, sizeof(cpu_8080_t));
+    uint8_t * program = malloc(BATCH_MEMORY_SIZE);
+    int failures = 0;
+
+    if (batch == NULL || machines == NULL || program == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+
+    for (int i = 0; i < BATCH_MEMORY_SIZE; i++)
+    {
+        if (!shared)
+        {
+            program[i] = random_number();
+        }
+        else if (random_number() % 100 < 8)
+        {
+            program[i] = 0xC2 | (random_number() % 8) << 3; // Jcc
+        }
+        else
+        {
+            program[i] = register_only[random_number() % sizeof(register_only)];
+        }
+    }
+
+    for (size_t lane = 0; lane < LANES; lane++)
+    {
+        uint8_t * memory = batch_memory(batch, lane);
+        cpu_8080_t * cpu = &machines[lane];
+
+        memcpy(memory, program, BATCH_MEMORY_SIZE);
+        if (!shared)
+        {
+            for (int i = 0; i < 64; i++)
+            {
+                memory[random_number() & 0xFFFF] = random_number();
+            }
+        }
+
+        cpu->a = random_number();
+        cpu->b = random_number();
+        cpu->c = random_number();
+        cpu->d = random_number();
+        cpu->e = random_number();
+        cpu->h = random_number();
+        cpu->l = random_number();
+        cpu->stack_pointer = random_number();
+        cpu->program_counter = shared ? 0 : random_number();
+        unpack_condition_codes(cpu, random_number());
+        set_batch_lane(batch, lane, cpu);
+
+        cpu->memory = malloc(BATCH_MEMORY_SIZE);
+        if (cpu->memory == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(2);
+        }
+        memcpy(cpu->memory, memory, BATCH_MEMORY_SIZE);
+    }
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        run_batch(batch, BUDGET);
+
+        for (size_t lane = 0; lane < LANES; lane++)
+        {
+            cpu_8080_t * cpu = &machines[lane];
+            uint64_t spent = 0;
+            cpu_8080_t lane_state;
+
+            while (spent < BUDGET && !cpu->halted)
+            {
+                spent += process_instructions(cpu, BUDGET - spent);
+            }
+
+            get_batch_lane(batch, lane, &lane_state);
+            if (!same_machine(&lane_state, cpu))
+            {
+                printf("%s batch: lane %zu differs after round %d, pc %04x against %04x\n",
+                       shared ? "shared" : "random", lane, round,
+                       lane_state.program_counter, cpu->program_counter);
+                failures++;
+
+                // Carry on from the machine's state, so one bug is one failure.
+                set_batch_lane(batch, lane, cpu);
+                memcpy(lane_state.memory, cpu->memory, BATCH_MEMORY_SIZE);
+            }
+        }
+    }
+
+    for (size_t lane = 0; lane < LANES; lane++)
+    {
+        free(machines[lane].memory);
+    }
+    free(machines);
+    free(program);
+    free_batch(batch);
+
+    return failures;
+}
+
+int
+main(int argc, char * argv[])
+{
+    unsigned long seed = argc > 1 ? strtoul(argv[1], NULL, 0) : (unsigned long)time(NULL);
+    int failures;
+
+    printf("test-batch: seed %lu\n", seed);
+    state = seed;
+
+    failures = check_batch(0);
+    failures += check_batch(1);
+
+    printf("test-batch: %d lane rounds differed\n", failures);
+    return failures != 0;
+}
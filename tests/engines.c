@@ -0,0 +1,304 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "block_cache.h"
+#include "emulator.h"
+#include "jit.h"
+#include "memory_map.h"
+
+/*
+ * Differential check of the ways to run a machine: the block executor,
+ * with and without native code, against the interpreter. Random programs
+ * run in slices of random length, each slice followed by the interpreter
+ * running the same cycles on a copy, and after every slice the two must
+ * match. The programs loop, so blocks get hot enough to compile, store
+ * into their own code, and load from a page a device answers.
+ *
+ *   test-engines [seed]
+ *
+ * Without a seed one is picked and printed, to run a failure again.
+ */
+
+#define PROGRAMS 200
+#define SLICES   50
+#define BUDGET   2000
+
+#define CODE_SIZE 0x200
+#define DATA      0x4000
+#define DEVICE    0x4100
+#define STACK     0x8000
+
+static uint64_t state;
+
+static unsigned
+random_number(void)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (unsigned)state;
+}
+
+// Registers whose value shows its clock, and stores that go nowhere.
+static uint8_t
+device_read(void * device, uint16_t address, uint64_t cycle)
+{
+    (void)device;
+    return (uint8_t)(address ^ cycle ^ (cycle >> 8));
+}
+
+static void
+device_write(void * device, uint16_t address, uint8_t value)
+{
+    (void)device;
+    (void)address;
+    (void)value;
+}
+
+// An address for a load or store: mostly data, some device, some code.
+static uint16_t
+random_address(void)
+{
+    switch (random_number() % 8)
+    {
+        case 0:
+            return random_number() % CODE_SIZE;
+        case 1:
+            return DEVICE + random_number() % 0x100;
+    }
+
+    return DATA + random_number() % 0x100;
+}
+
+// Whether a random opcode is left out of the straight-line filler.
+static int
+left_out(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case 0x76:                                  // HLT
+        case 0xC3: case 0xCB:                       // JMP
+        case 0x22: case 0x2A: case 0x32: case 0x3A: // SHLD, LHLD, STA, LDA
+        case 0x31: case 0x33: case 0x3B:            // LXI SP, INX SP, DCX SP
+        case 0xE9: case 0xF9: case 0xE3:            // PCHL, SPHL, XTHL
+        case 0xC9: case 0xD9:                       // RET
+        case 0xCD: case 0xDD: case 0xED: case 0xFD: // CALL
+            return 1;
+    }
+
+    return (opcode & 0xC7) == 0xC2 ||               // Jcc
+           (opcode & 0xC7) == 0xC4 ||               // Ccc
+           (opcode & 0xC7) == 0xC0 ||               // Rcc
+           (opcode & 0xC7) == 0xC7 ||               // RST
+           (opcode & 0xCF) == 0x01;                 // LXI
+}
+
+/*
+ * Code in the first CODE_SIZE bytes, random bytes everywhere else. The
+ * code is straight-line filler broken up by jumps back into itself and by
+ * loads and stores through random addresses.
+ */
+static void
+random_program(uint8_t * memory)
+{
+    int pc = 0;
+
+    for (int i = 0; i < 0x10000; i++)
+    {
+        memory[i] = random_number();
+    }
+
+    while (pc < CODE_SIZE - 0x10)
+    {
+        unsigned kind = random_number() % 100;
+        uint16_t target = random_number() % (CODE_SIZE - 0x10);
+        uint8_t opcode;
+
+        if (kind < 7)
+        {
+            opcode = kind < 5 ? 0xC2 | (random_number() % 8) << 3 : 0xC3;
+        }
+        else if (kind < 10)
+        {
+            opcode = 0x01 | (random_number() % 3) << 4;
+            target = random_address();
+        }
+        else if (kind < 14)
+        {
+            static const uint8_t direct[4] = { 0x22, 0x2A, 0x32, 0x3A };
+
+            opcode = direct[random_number() % 4];
+            target = random_address();
+        }
+        else
+        {
+            do
+            {
+                opcode = random_number();
+            } while (left_out(opcode));
+
+            memory[pc++] = opcode;
+            if ((opcode & 0xC7) == 0x06 || (opcode & 0xC7) == 0xC6 ||
+                opcode == 0xD3 || opcode == 0xDB)
+            {
+                memory[pc++] = random_number();
+            }
+            continue;
+        }
+
+        memory[pc++] = opcode;
+        memory[pc++] = target & 0xFF;
+        memory[pc++] = target >> 8;
+    }
+
+    memset(memory + pc, 0, CODE_SIZE - 3 - pc);
+    memory[CODE_SIZE - 3] = 0xC3;
+    memory[CODE_SIZE - 2] = 0x00;
+    memory[CODE_SIZE - 1] = 0x00;
+}
+
+static cpu_8080_t *
+create_machine(const uint8_t * memory, const cpu_8080_t * registers)
+{
+    cpu_8080_t * cpu = calloc(1, sizeof(cpu_8080_t));
+    uint8_t * copy = malloc(0x10000);
+
+    if (cpu == NULL || copy == NULL || create_memory_map(cpu) == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+
+    memcpy(copy, memory, 0x10000);
+    cpu->memory = copy;
+    cpu->a = registers->a;
+    cpu->b = registers->b;
+    cpu->c = registers->c;
+    cpu->d = registers->d;
+    cpu->e = registers->e;
+    cpu->h = registers->h;
+    cpu->l = registers->l;
+    cpu->stack_pointer = registers->stack_pointer;
+    unpack_condition_codes(cpu, pack_condition_codes(registers));
+
+    map_mmio_pages(cpu, DEVICE, 0x100, device_write, device_read, NULL);
+
+    return cpu;
+}
+
+static void
+free_machine(cpu_8080_t * cpu)
+{
+    if (cpu->block_cache != NULL)
+    {
+        free_block_cache(cpu->block_cache);
+    }
+
+    free_memory_map(cpu);
+    free(cpu->memory);
+    free(cpu);
+}
+
+static int
+same_machine(const cpu_8080_t * x, const cpu_8080_t * y)
+{
+    return x->a == y->a && x->b == y->b && x->c == y->c && x->d == y->d &&
+           x->e == y->e && x->h == y->h && x->l == y->l &&
+           x->stack_pointer == y->stack_pointer &&
+           x->program_counter == y->program_counter &&
+           x->cycles == y->cycles && x->halted == y->halted &&
+           x->interrupt_enabled == y->interrupt_enabled &&
+           pack_condition_codes(x) == pack_condition_codes(y) &&
+           memcmp(x->memory, y->memory, 0x10000) == 0;
+}
+
+/*
+ * Runs one program on the block executor, with native code if jit is
+ * set, and on the interpreter. Returns 0 if they never differed.
+ */
+static int
+check_program(const uint8_t * memory, const cpu_8080_t * registers, int jit,
+              unsigned long program)
+{
+    cpu_8080_t * blocks = create_machine(memory, registers);
+    cpu_8080_t * reference = create_machine(memory, registers);
+    int failed = 0;
+
+    blocks->block_cache = create_block_cache();
+    if (blocks->block_cache == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+
+    if (jit)
+    {
+        blocks->block_cache->jit = create_jit();
+    }
+
+    for (int slice = 0; slice < SLICES && !blocks->halted; slice++)
+    {
+        uint64_t cycles = process_blocks(blocks, BUDGET + random_number() % BUDGET);
+
+        process_instructions(reference, cycles);
+
+        if (!same_machine(blocks, reference))
+        {
+            printf("program %lu%s: slice %d differs, pc %04x against %04x\n",
+                   program, jit ? " with native code" : "", slice,
+                   blocks->program_counter, reference->program_counter);
+            failed = 1;
+            break;
+        }
+    }
+
+    free_machine(blocks);
+    free_machine(reference);
+
+    return failed;
+}
+
+int
+main(int argc, char * argv[])
+{
+    unsigned long seed = argc > 1 ? strtoul(argv[1], NULL, 0) : (unsigned long)time(NULL);
+    uint8_t * memory = malloc(0x10000);
+    int failures = 0;
+
+    if (memory == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    printf("test-engines: seed %lu\n", seed);
+
+    for (unsigned long program = 0; program < PROGRAMS; program++)
+    {
+        cpu_8080_t registers;
+
+        state = 88172645463325252ULL + seed * 7919 + program;
+
+        random_program(memory);
+        memset(&registers, 0, sizeof(registers));
+        registers.a = random_number();
+        registers.b = random_number();
+        registers.c = random_number();
+        registers.d = random_number();
+        registers.e = random_number();
+        registers.h = DATA >> 8;
+        registers.l = random_number();
+        registers.stack_pointer = STACK;
+        unpack_condition_codes(&registers, random_number());
+
+        failures += check_program(memory, &registers, 0, program);
+        failures += check_program(memory, &registers, 1, program);
+    }
+
+    free(memory);
+
+    printf("test-engines: %d of %d runs differed\n", failures, PROGRAMS * 2);
+    return failures != 0;
+}
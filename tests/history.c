@@ -0,0 +1,218 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "block_cache.h"
+#include "emulator.h"
+#include "history.h"
+#include "jit.h"
+#include "memory_map.h"
+#include "ports.h"
+#include "scheduler.h"
+#include "snapshot.h"
+
+/*
+ * A round trip through a history, see history.h. A machine running random
+ * code, with input ports and a device page that read random values and
+ * interrupts raised on a timer, runs forward under a history with a small
+ * arena, so old checkpoints get folded, and is snapshotted along the way.
+ * Seeking back to each snapshot still in the history must give the same
+ * machine, as must seeking to the present again at the end.
+ *
+ *   test-history [seed]
+ *
+ * Without a seed one is picked and printed, to run a failure again.
+ */
+
+#define CYCLES      3000000
+#define INTERVAL    10000
+#define ARENA       (64 * 1024)
+#define SNAPSHOTS   64
+
+// Device registers over a quarter of memory, so random code loads from them.
+#define DEVICE      0x8000
+#define DEVICE_SIZE 0x4000
+
+// Where the interrupt state sits in a snapshot header, see snapshot.h.
+#define INTERRUPT_BYTE 27
+
+static uint64_t state;
+
+typedef struct capture
+{
+    uint64_t cycle;
+    size_t size;
+    uint8_t snapshot[SNAPSHOT_MAX_SIZE];
+} capture_t;
+
+static capture_t captures[SNAPSHOTS];
+static int capture_count;
+static uint8_t buffer[SNAPSHOT_MAX_SIZE];
+
+static unsigned
+random_number(void)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)(state >> 33);
+}
+
+// Devices that read something new every time, which a history has to replay.
+static uint8_t
+port_read(void * device, uint8_t port, uint64_t cycle)
+{
+    (void)device;
+    (void)port;
+    (void)cycle;
+    return random_number();
+}
+
+static uint8_t
+device_read(void * device, uint16_t address, uint64_t cycle)
+{
+    (void)device;
+    (void)address;
+    (void)cycle;
+    return random_number();
+}
+
+static void
+device_write(void * device, uint16_t address, uint8_t value)
+{
+    (void)device;
+    (void)address;
+    (void)value;
+}
+
+/*
+ * Snapshots with the interrupt state left out: an interrupt raised on the
+ * same cycle as the snapshot may or may not have been raised yet.
+ */
+static size_t
+take_snapshot(const cpu_8080_t * cpu, uint8_t * snapshot)
+{
+    size_t size = save_snapshot(cpu, snapshot);
+
+    snapshot[INTERRUPT_BYTE] = 0;
+    return size;
+}
+
+static void
+capture(cpu_8080_t * cpu, void * context)
+{
+    (void)context;
+
+    if (capture_count < SNAPSHOTS)
+    {
+        capture_t * entry = &captures[capture_count++];
+
+        entry->cycle = cpu->cycles;
+        entry->size = take_snapshot(cpu, entry->snapshot);
+    }
+}
+
+static int
+same_as(const cpu_8080_t * cpu, uint64_t cycle, const uint8_t * snapshot, size_t size)
+{
+    return cpu->cycles == cycle && take_snapshot(cpu, buffer) == size &&
+           memcmp(buffer, snapshot, size) == 0;
+}
+
+int
+main(int argc, char * argv[])
+{
+    unsigned long seed = argc > 1 ? strtoul(argv[1], NULL, 0) : (unsigned long)time(NULL);
+    cpu_8080_t cpu;
+    scheduler_t scheduler;
+    port_bus_t * ports;
+    history_t * history;
+    static capture_t present;
+    int tested = 0;
+    int failures = 0;
+
+    printf("test-history: seed %lu\n", seed);
+    state = seed;
+
+    memset(&cpu, 0, sizeof(cpu));
+    cpu.memory = malloc(0x10000);
+    ports = create_port_bus();
+    if (cpu.memory == NULL || ports == NULL || create_memory_map(&cpu) == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    // Random code that runs on rather than halting.
+    for (int i = 0; i < 0x10000; i++)
+    {
+        uint8_t byte = random_number();
+
+        cpu.memory[i] = byte == 0x76 ? 0x00 : byte;
+    }
+
+    for (int port = 0; port < 256; port++)
+    {
+        map_port_in(ports, port, PORT_DEVICE, port_read, NULL);
+    }
+    cpu.ports = ports;
+    map_mmio_pages(&cpu, DEVICE, DEVICE_SIZE, device_write, device_read, NULL);
+
+    cpu.block_cache = create_block_cache();
+    if (cpu.block_cache == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    cpu.block_cache->jit = create_jit();
+
+    init_scheduler(&scheduler, &cpu);
+    schedule_interrupt(&scheduler, 777, 16667, 1);
+    schedule_event(&scheduler, CYCLES / SNAPSHOTS, CYCLES / SNAPSHOTS, capture, NULL);
+
+    history = create_history(&cpu, &scheduler, INTERVAL, ARENA);
+    if (history == NULL || run_history(history, CYCLES) != 0)
+    {
+        printf("test-history: running forward failed\n");
+        return 1;
+    }
+
+    present.cycle = cpu.cycles;
+    present.size = take_snapshot(&cpu, present.snapshot);
+
+    for (int i = 0; i < capture_count; i++)
+    {
+        uint64_t oldest = history->checkpoints[history->first % HISTORY_MAX_CHECKPOINTS].cycle;
+
+        if (captures[i].cycle < oldest)
+        {
+            continue;
+        }
+
+        tested++;
+        if (seek_history(history, captures[i].cycle) != 0 ||
+            !same_as(&cpu, captures[i].cycle, captures[i].snapshot, captures[i].size))
+        {
+            printf("test-history: seeking back to cycle %llu differs\n",
+                   (unsigned long long)captures[i].cycle);
+            failures++;
+        }
+    }
+
+    if (seek_history(history, present.cycle) != 0 ||
+        !same_as(&cpu, present.cycle, present.snapshot, present.size))
+    {
+        printf("test-history: seeking to the present differs\n");
+        failures++;
+    }
+
+    printf("test-history: %d of %d snapshots still in the history, %d differed\n",
+           tested, capture_count, failures);
+
+    free_history(history);
+    free_block_cache(cpu.block_cache);
+    free_memory_map(&cpu);
+    free_port_bus(ports);
+    free(cpu.memory);
+
+    return failures != 0 || tested == 0;
+}